@@ -6,6 +6,7 @@
 
 #include <consensus/consensus.h>
 #include <random.h>
+#include <version.h>
 
 bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
@@ -13,6 +14,29 @@ std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return nullptr; }
 
+bool CCoinsView::GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const
+{
+    Coin tmp;
+    if (!GetCoin(outpoint, tmp) || tmp.IsSpent()) return false;
+    coin = CompressedCoin(tmp);
+    return true;
+}
+
+size_t CCoinsView::GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const
+{
+    size_t found = 0;
+    coins.clear();
+    coins.resize(outpoints.size());
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        if (GetCompressedCoin(outpoints[i], coins[i])) {
+            found++;
+        } else {
+            coins[i].Clear();
+        }
+    }
+    return found;
+}
+
 bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
 {
     Coin coin;
@@ -21,6 +45,8 @@ bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetCoin(const COutPoint &outpoint, Coin &coin) const { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const { return base->GetCompressedCoin(outpoint, coin); }
+size_t CCoinsViewBacked::GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const { return base->GetCoins(outpoints, coins); }
 bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 std::vector<uint256> CCoinsViewBacked::GetHeadBlocks() const { return base->GetHeadBlocks(); }
@@ -29,20 +55,54 @@ bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
 CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 size_t CCoinsViewBacked::EstimateSize() const { return base->EstimateSize(); }
 
+CompressedCoin::CompressedCoin(const Coin& coin)
+{
+    if (coin.IsSpent()) return;
+    // Encode into a stack buffer first, so that data is allocated at its exact size.
+    scratch_type tmp;
+    CBasicVectorWriter<scratch_type>(SER_DISK, PROTOCOL_VERSION, tmp, 0, coin);
+    data.assign(tmp.begin(), tmp.end());
+}
+
+Coin CompressedCoin::Decompress() const
+{
+    Coin coin;
+    if (!IsSpent()) {
+        CMemoryReader(SER_DISK, PROTOCOL_VERSION, data.data(), data.size()) >> coin;
+    }
+    return coin;
+}
+
 SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0) {}
+/** Number of decoded coins a CCoinsViewCache keeps for AccessCoin. */
+static const size_t MAX_DECODED_COINS = 1024;
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), cachedCoinsUsage(0), cachedDecodedUsage(0) {}
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
-    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage + memusage::DynamicUsage(cacheDecoded) + cachedDecodedUsage;
+}
+
+void CCoinsViewCache::EraseDecoded(const COutPoint &outpoint) {
+    CCoinsDecodedMap::iterator it = cacheDecoded.find(outpoint);
+    if (it != cacheDecoded.end()) {
+        cachedDecodedUsage -= it->second.DynamicMemoryUsage();
+        cacheDecoded.erase(it);
+    }
+}
+
+void CCoinsViewCache::ClearDecoded() const {
+    cacheDecoded.clear();
+    cachedDecodedUsage = 0;
 }
 
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
     CCoinsMap::iterator it = cacheCoins.find(outpoint);
     if (it != cacheCoins.end())
         return it;
-    Coin tmp;
-    if (!base->GetCoin(outpoint, tmp))
+    CompressedCoin tmp;
+    if (!base->GetCompressedCoin(outpoint, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
     if (ret->second.coin.IsSpent()) {
@@ -57,12 +117,56 @@ CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const
 bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     CCoinsMap::const_iterator it = FetchCoin(outpoint);
     if (it != cacheCoins.end()) {
-        coin = it->second.coin;
+        coin = it->second.coin.Decompress();
         return !coin.IsSpent();
     }
     return false;
 }
 
+bool CCoinsViewCache::GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const {
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    if (it != cacheCoins.end() && !it->second.coin.IsSpent()) {
+        coin = it->second.coin;
+        return true;
+    }
+    return false;
+}
+
+size_t CCoinsViewCache::GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const {
+    size_t found = 0;
+    coins.clear();
+    coins.resize(outpoints.size());
+    std::vector<COutPoint> missing;
+    std::vector<size_t> missing_pos;
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        CCoinsMap::const_iterator it = cacheCoins.find(outpoints[i]);
+        if (it == cacheCoins.end()) {
+            missing.push_back(outpoints[i]);
+            missing_pos.push_back(i);
+        } else if (!it->second.coin.IsSpent()) {
+            coins[i] = it->second.coin;
+            found++;
+        }
+    }
+    if (missing.empty()) return found;
+
+    std::vector<CompressedCoin> fetched;
+    base->GetCoins(missing, fetched);
+    for (size_t j = 0; j < missing.size(); j++) {
+        if (fetched[j].IsSpent()) continue;
+        // As in FetchCoin; an outpoint requested twice is only inserted once.
+        CCoinsMap::iterator it;
+        bool inserted;
+        std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(missing[j]), std::forward_as_tuple(std::move(fetched[j])));
+        if (inserted) {
+            cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+        }
+        coins[missing_pos[j]] = it->second.coin;
+        found++;
+    }
+    return found;
+}
+
 void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possible_overwrite) {
     assert(!coin.IsSpent());
     if (coin.out.scriptPubKey.IsUnspendable()) return;
@@ -79,7 +183,8 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
         }
         fresh = !(it->second.flags & CCoinsCacheEntry::DIRTY);
     }
-    it->second.coin = std::move(coin);
+    EraseDecoded(outpoint);
+    it->second.coin = CompressedCoin(coin);
     it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
     cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
@@ -99,8 +204,15 @@ bool CCoinsViewCache::SpendCoin(const COutPoint &outpoint, Coin* moveout) {
     CCoinsMap::iterator it = FetchCoin(outpoint);
     if (it == cacheCoins.end()) return false;
     cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
-    if (moveout) {
-        *moveout = std::move(it->second.coin);
+    CCoinsDecodedMap::iterator itDecoded = cacheDecoded.find(outpoint);
+    if (itDecoded != cacheDecoded.end()) {
+        cachedDecodedUsage -= itDecoded->second.DynamicMemoryUsage();
+        if (moveout) {
+            *moveout = std::move(itDecoded->second);
+        }
+        cacheDecoded.erase(itDecoded);
+    } else if (moveout) {
+        *moveout = it->second.coin.Decompress();
     }
     if (it->second.flags & CCoinsCacheEntry::FRESH) {
         cacheCoins.erase(it);
@@ -114,12 +226,20 @@ bool CCoinsViewCache::SpendCoin(const COutPoint &outpoint, Coin* moveout) {
 static const Coin coinEmpty;
 
 const Coin& CCoinsViewCache::AccessCoin(const COutPoint &outpoint) const {
+    CCoinsDecodedMap::const_iterator itDecoded = cacheDecoded.find(outpoint);
+    if (itDecoded != cacheDecoded.end()) {
+        return itDecoded->second;
+    }
     CCoinsMap::const_iterator it = FetchCoin(outpoint);
-    if (it == cacheCoins.end()) {
+    if (it == cacheCoins.end() || it->second.coin.IsSpent()) {
         return coinEmpty;
-    } else {
-        return it->second.coin;
     }
+    if (cacheDecoded.size() >= MAX_DECODED_COINS) {
+        ClearDecoded();
+    }
+    itDecoded = cacheDecoded.emplace(outpoint, it->second.coin.Decompress()).first;
+    cachedDecodedUsage += itDecoded->second.DynamicMemoryUsage();
+    return itDecoded->second;
 }
 
 bool CCoinsViewCache::HaveCoin(const COutPoint &outpoint) const {
@@ -143,6 +263,7 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
 }
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
+    ClearDecoded();
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it = mapCoins.erase(it)) {
         // Ignore non-dirty entries (optimization).
         if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
@@ -204,6 +325,7 @@ bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
+    ClearDecoded();
     return fOk;
 }
 
@@ -213,6 +335,7 @@ void CCoinsViewCache::Uncache(const COutPoint& hash)
     if (it != cacheCoins.end() && it->second.flags == 0) {
         cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
         cacheCoins.erase(it);
+        EraseDecoded(hash);
     }
 }
 
@@ -11,8 +11,11 @@
 #include <core_memusage.h>
 #include <hash.h>
 #include <memusage.h>
+#include <prevector.h>
 #include <serialize.h>
+#include <streams.h>
 #include <uint256.h>
+#include <version.h>
 
 #include <assert.h>
 #include <stdint.h>
@@ -81,6 +84,86 @@ public:
     }
 };
 
+/**
+ * A Coin kept in its compact serialized form (see Coin::Serialize): the
+ * height/coinbase code and the amount as VARINTs, the script as encoded by
+ * CScriptCompressor. This is what the entries of CCoinsViewCache hold, so that
+ * more of the UTXO set fits in a given -dbcache; the Coin is only materialized
+ * when it is accessed. An empty encoding means the coin is spent.
+ */
+class CompressedCoin
+{
+private:
+    /**
+     * Encodings up to this size are stored inline. It covers the common output
+     * types (including P2WSH and P2PK) while keeping the CCoinsMap node in the
+     * same allocation size class as a node with an empty entry.
+     */
+    static const unsigned int INLINE_SIZE = 44;
+
+    //! Scratch buffer for building an encoding before it is stored at its exact size.
+    typedef prevector<64, unsigned char> scratch_type;
+
+    prevector<INLINE_SIZE, unsigned char> data;
+
+public:
+    CompressedCoin() {}
+    explicit CompressedCoin(const Coin& coin);
+
+    Coin Decompress() const;
+
+    bool IsSpent() const {
+        return data.empty();
+    }
+
+    void Clear() {
+        data.clear();
+        data.shrink_to_fit();
+    }
+
+    //! Serializes exactly like the Coin it encodes.
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        assert(!IsSpent());
+        s.write((const char*)data.data(), data.size());
+    }
+
+    //! Reads a serialized Coin by copying its encoding, without decoding the
+    //! script (which for P2PK would mean decompressing the public key).
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        uint32_t code = 0;
+        uint64_t nAmount = 0;
+        unsigned int nSize = 0;
+        s >> VARINT(code) >> VARINT(nAmount) >> VARINT(nSize);
+        scratch_type tmp;
+        CBasicVectorWriter<scratch_type> writer(SER_DISK, PROTOCOL_VERSION, tmp, 0);
+        writer << VARINT(code) << VARINT(nAmount);
+        unsigned int nScriptSize;
+        if (nSize < CScriptCompressor::nSpecialScripts) {
+            nScriptSize = CScriptCompressor::GetSpecialSize(nSize);
+        } else if (nSize - CScriptCompressor::nSpecialScripts > MAX_SCRIPT_SIZE) {
+            // As CScriptCompressor does, replace an overly long script with a short invalid one.
+            s.ignore(nSize - CScriptCompressor::nSpecialScripts);
+            unsigned int nReplacementSize = CScriptCompressor::nSpecialScripts + 1;
+            writer << VARINT(nReplacementSize) << (unsigned char)OP_RETURN;
+            data.assign(tmp.begin(), tmp.end());
+            return;
+        } else {
+            nScriptSize = nSize - CScriptCompressor::nSpecialScripts;
+        }
+        writer << VARINT(nSize);
+        const size_t nPos = tmp.size();
+        tmp.resize(nPos + nScriptSize);
+        s.read((char*)tmp.data() + nPos, nScriptSize);
+        data.assign(tmp.begin(), tmp.end());
+    }
+
+    size_t DynamicMemoryUsage() const {
+        return memusage::DynamicUsage(data);
+    }
+};
+
 class SaltedOutpointHasher
 {
 private:
@@ -102,7 +185,7 @@ public:
 
 struct CCoinsCacheEntry
 {
-    Coin coin; // The actual cached data.
+    CompressedCoin coin; // The actual cached data.
     unsigned char flags;
 
     enum Flags {
@@ -116,10 +199,11 @@ struct CCoinsCacheEntry
     };
 
     CCoinsCacheEntry() : flags(0) {}
-    explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
+    explicit CCoinsCacheEntry(CompressedCoin&& coin_) : coin(std::move(coin_)), flags(0) {}
 };
 
 typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+typedef std::unordered_map<COutPoint, Coin, SaltedOutpointHasher> CCoinsDecodedMap;
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -151,6 +235,21 @@ public:
      */
     virtual bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
 
+    /** As GetCoin, but return the coin in the compressed form caches hold it
+     *  in, so that it can be passed on without being decoded and re-encoded.
+     *  The default implementation encodes the result of GetCoin.
+     */
+    virtual bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const;
+
+    /** Retrieve the Coins for several outpoints at once, so that views can
+     *  serve them in a batch (e.g. with parallel database reads). They are
+     *  returned compressed, as for GetCompressedCoin.
+     *  coins is resized to match outpoints; for every outpoint without an
+     *  unspent coin, the corresponding entry is spent (CompressedCoin::IsSpent).
+     *  Returns the number of unspent coins found.
+     */
+    virtual size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const;
+
     //! Just check whether a given outpoint is unspent.
     virtual bool HaveCoin(const COutPoint &outpoint) const;
 
@@ -187,6 +286,8 @@ protected:
 public:
     CCoinsViewBacked(CCoinsView *viewIn);
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const override;
+    size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
@@ -211,6 +312,15 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /**
+     * Decoded copies of the coins most recently returned by AccessCoin, so
+     * that accessing the same coin repeatedly (as the input checks of a
+     * transaction do) decodes it only once. An entry is dropped whenever the
+     * coin is modified, and the whole map when it exceeds MAX_DECODED_COINS.
+     */
+    mutable CCoinsDecodedMap cacheDecoded;
+    mutable size_t cachedDecodedUsage;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -221,6 +331,9 @@ public:
 
     // Standard CCoinsView methods
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const override;
+    //! Serves cached coins directly and fetches all others from the base view in one batch.
+    size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     void SetBestBlock(const uint256 &hashBlock);
@@ -241,10 +354,9 @@ public:
      * more efficient than GetCoin.
      *
      * Generally, do not hold the reference returned for more than a short scope.
-     * While the current implementation allows for modifications to the contents
-     * of the cache while holding the reference, this behavior should not be relied
-     * on! To be safe, best to not hold the returned reference through any other
-     * calls to this cache.
+     * The reference is to a decoded copy of the cache entry, which any other
+     * call to this cache may invalidate. To be safe, best to not hold the
+     * returned reference through any other calls to this cache.
      */
     const Coin& AccessCoin(const COutPoint &output) const;
 
@@ -295,6 +407,9 @@ public:
 
 private:
     CCoinsMap::iterator FetchCoin(const COutPoint &outpoint) const;
+    //! Drop the decoded copy of a coin that is about to be modified.
+    void EraseDecoded(const COutPoint &outpoint);
+    void ClearDecoded() const;
 };
 
 //! Utility function to add all of a transaction's outputs to a cache.
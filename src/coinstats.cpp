@@ -0,0 +1,151 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coinstats.h>
+
+#include <chain.h>
+#include <coins.h>
+#include <hash.h>
+#include <primitives/block.h>
+#include <streams.h>
+#include <sync.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+#include <version.h>
+
+#include <map>
+
+#include <boost/thread.hpp>
+
+//! Serialized form of a coin as committed to by the MuHash of the set.
+static void MuHashCoin(MuHash3072& muhash, const COutPoint& outpoint, const Coin& coin, bool fSpend)
+{
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << outpoint;
+    ss << (uint32_t)(coin.nHeight * 2 + coin.fCoinBase);
+    ss << coin.out;
+    if (fSpend) {
+        muhash.Remove((const unsigned char*)ss.data(), ss.size());
+    } else {
+        muhash.Insert((const unsigned char*)ss.data(), ss.size());
+    }
+}
+
+static uint64_t GetBogoSize(const CScript& scriptPubKey)
+{
+    return 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
+           2 /* scriptPubKey len */ + scriptPubKey.size() /* scriptPubKey */;
+}
+
+uint256 CCoinsStats::GetMuHash() const
+{
+    uint256 ret;
+    muhash.Finalize(ret.begin());
+    return ret;
+}
+
+void ApplyCoinToStats(CCoinsStats& stats, const COutPoint& outpoint, const Coin& coin, bool fSpend)
+{
+    MuHashCoin(stats.muhash, outpoint, coin, fSpend);
+    if (fSpend) {
+        stats.nTransactionOutputs--;
+        stats.nTotalAmount -= coin.out.nValue;
+        stats.nBogoSize -= GetBogoSize(coin.out.scriptPubKey);
+    } else {
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += coin.out.nValue;
+        stats.nBogoSize += GetBogoSize(coin.out.scriptPubKey);
+    }
+}
+
+// Mirrors the coin creation and spending done by ConnectBlock: unspendable
+// outputs never enter the set, and the spent coins come from the undo data.
+static bool ApplyBlock(CCoinsStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fRevert)
+{
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size()) {
+        return error("%s: block and undo data inconsistent", __func__);
+    }
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txid = tx.GetHash();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable()) continue;
+            ApplyCoinToStats(stats, COutPoint(txid, o), Coin(tx.vout[o], nHeight, tx.IsCoinBase()), fRevert);
+        }
+        if (i == 0) continue;
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size()) {
+            return error("%s: transaction and undo data inconsistent", __func__);
+        }
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            ApplyCoinToStats(stats, tx.vin[j].prevout, txundo.vprevout[j], !fRevert);
+        }
+    }
+    return true;
+}
+
+bool ApplyBlockToStats(CCoinsStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight)
+{
+    return ApplyBlock(stats, block, blockundo, nHeight, false);
+}
+
+bool RevertBlockFromStats(CCoinsStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight)
+{
+    return ApplyBlock(stats, block, blockundo, nHeight, true);
+}
+
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (const auto& output : outputs) {
+        ss << VARINT(output.first + 1);
+        ss << output.second.out.scriptPubKey;
+        ss << VARINT(output.second.out.nValue);
+        ApplyCoinToStats(stats, COutPoint(hash, output.first), output.second, false);
+    }
+    ss << VARINT(0);
+}
+
+bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
+{
+    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
+    assert(pcursor);
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    stats.hashBlock = pcursor->GetBestBlock();
+    {
+        LOCK(cs_main);
+        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    }
+    ss << stats.hashBlock;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
+            }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
+        } else {
+            return error("%s: unable to read value", __func__);
+        }
+        pcursor->Next();
+    }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
+    stats.hashSerialized = ss.GetHash();
+    stats.nDiskSize = view->EstimateSize();
+    return true;
+}
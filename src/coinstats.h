@@ -0,0 +1,71 @@
+// Copyright (c) 2010 Satoshi Nakamoto
+// Copyright (c) 2009-2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSTATS_H
+#define BITCOIN_COINSTATS_H
+
+#include <amount.h>
+#include <crypto/muhash.h>
+#include <serialize.h>
+#include <uint256.h>
+
+#include <stdint.h>
+
+class CBlock;
+class CBlockUndo;
+class CCoinsView;
+class COutPoint;
+class Coin;
+
+/** Statistics about the unspent transaction output set.
+ *
+ * The count, amount, bogosize and MuHash commitment can be maintained
+ * incrementally per connected block and are what gets persisted.
+ * nTransactions, hashSerialized and nDiskSize are only available from a full
+ * scan of the set (see GetUTXOStats).
+ */
+struct CCoinsStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nBogoSize;
+    uint256 hashSerialized;
+    uint64_t nDiskSize;
+    CAmount nTotalAmount;
+    MuHash3072 muhash;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(VARINT(nHeight));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nBogoSize));
+        READWRITE(nTotalAmount);
+        READWRITE(muhash);
+    }
+
+    /** Finalize the MuHash commitment of the set. Not cheap: computes a 3072-bit modular inverse. */
+    uint256 GetMuHash() const;
+};
+
+/** Add (or, with fSpend, remove) a single coin to the statistics. */
+void ApplyCoinToStats(CCoinsStats& stats, const COutPoint& outpoint, const Coin& coin, bool fSpend);
+
+/** Turn the statistics of the parent block into those after connecting block at nHeight (whose undo data is blockundo).
+ *  Returns false, leaving stats indeterminate, if the undo data does not match the block. */
+bool ApplyBlockToStats(CCoinsStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight);
+
+/** Turn the statistics of block at nHeight into those of its parent, i.e. undo ApplyBlockToStats. */
+bool RevertBlockFromStats(CCoinsStats& stats, const CBlock& block, const CBlockUndo& blockundo, int nHeight);
+
+/** Calculate statistics about the unspent transaction output set by walking the whole view. Slow. */
+bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats);
+
+#endif // BITCOIN_COINSTATS_H
@@ -76,7 +76,7 @@ bool CScriptCompressor::Compress(std::vector<unsigned char> &out) const
     return false;
 }
 
-unsigned int CScriptCompressor::GetSpecialSize(unsigned int nSize) const
+unsigned int CScriptCompressor::GetSpecialSize(unsigned int nSize)
 {
     if (nSize == 0 || nSize == 1)
         return 20;
@@ -27,7 +27,7 @@ class CScriptID;
  */
 class CScriptCompressor
 {
-private:
+public:
     /**
      * make this static for now (there are only 6 special scripts defined)
      * this can potentially be extended together with a new nVersion for
@@ -36,6 +36,10 @@ private:
      */
     static const unsigned int nSpecialScripts = 6;
 
+    //! Size of the encoded payload of special script nSize (< nSpecialScripts)
+    static unsigned int GetSpecialSize(unsigned int nSize);
+
+private:
     CScript &script;
 protected:
     /**
@@ -50,7 +54,6 @@ protected:
     bool IsToPubKey(CPubKey &pubkey) const;
 
     bool Compress(std::vector<unsigned char> &out) const;
-    unsigned int GetSpecialSize(unsigned int nSize) const;
     bool Decompress(unsigned int nSize, const std::vector<unsigned char> &out);
 public:
     explicit CScriptCompressor(CScript &scriptIn) : script(scriptIn) { }
@@ -0,0 +1,178 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <crypto/muhash.h>
+
+#include <crypto/chacha20.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+
+#include <string.h>
+
+namespace {
+
+typedef Num3072::limb_t limb_t;
+typedef Num3072::double_limb_t double_limb_t;
+
+/** 2^3072 - 1103717 is the largest 3072-bit safe prime. */
+const limb_t MAX_PRIME_DIFF = 1103717;
+const limb_t MAX_LIMB = ~(limb_t)0;
+
+/** Add a small value to a little-endian limb array, returning the carry out of the top limb. */
+double_limb_t AddSmall(limb_t* limbs, double_limb_t c)
+{
+    for (int i = 0; i < Num3072::LIMBS && c; ++i) {
+        c += limbs[i];
+        limbs[i] = (limb_t)c;
+        c >>= Num3072::LIMB_SIZE;
+    }
+    return c;
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 8) {
+            limbs[i] = ReadLE64(data + 8 * i);
+        } else {
+            limbs[i] = ReadLE32(data + 4 * i);
+        }
+    }
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i) limbs[i] = 0;
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        if (sizeof(limb_t) == 8) {
+            WriteLE64(out + 8 * i, limbs[i]);
+        } else {
+            WriteLE32(out + 4 * i, limbs[i]);
+        }
+    }
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= MAX_LIMB - MAX_PRIME_DIFF) return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != MAX_LIMB) return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // x >= p implies x - p = x + MAX_PRIME_DIFF - 2^3072; dropping the carry subtracts 2^3072.
+    if (IsOverflow()) AddSmall(limbs, MAX_PRIME_DIFF);
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    limb_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+
+    // Schoolbook multiplication into a 6144-bit intermediate. This is safe
+    // when a aliases *this, as limbs is only overwritten below.
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t uv = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)uv;
+            carry = (limb_t)(uv >> LIMB_SIZE);
+        }
+        tmp[i + LIMBS] = carry;
+    }
+
+    // Reduce using 2^3072 == MAX_PRIME_DIFF (mod p).
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t uv = (double_limb_t)tmp[i + LIMBS] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)uv;
+        carry = (limb_t)(uv >> LIMB_SIZE);
+    }
+    if (AddSmall(limbs, (double_limb_t)carry * MAX_PRIME_DIFF)) {
+        // Wrapped around once more; the result is now tiny so this cannot overflow.
+        AddSmall(limbs, MAX_PRIME_DIFF);
+    }
+    FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat's little theorem: a^-1 == a^(p-2) (mod p). Every limb of p-2
+    // is all ones except the lowest one, so a plain square-and-multiply is
+    // good enough for the rare callers (Finalize and Divide).
+    Num3072 r;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        const limb_t e = (i == 0) ? (limb_t)(MAX_LIMB - MAX_PRIME_DIFF - 1) : MAX_LIMB;
+        for (int bit = LIMB_SIZE - 1; bit >= 0; --bit) {
+            r.Multiply(r);
+            if ((e >> bit) & 1) r.Multiply(*this);
+        }
+    }
+    return r;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* in, size_t len)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    CSHA256().Write(in, len).Finalize(hash);
+    ChaCha20(hash, sizeof(hash)).Output(tmp, sizeof(tmp));
+    return Num3072(tmp);
+}
+
+MuHash3072::MuHash3072(const unsigned char* in, size_t len)
+{
+    numerator = ToNum3072(in, len);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* in, size_t len)
+{
+    numerator.Multiply(ToNum3072(in, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* in, size_t len)
+{
+    denominator.Multiply(ToNum3072(in, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char out[OUTPUT_SIZE]) const
+{
+    Num3072 result = numerator;
+    result.Divide(denominator);
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    result.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(out);
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** An element of the multiplicative group of integers modulo 2^3072 - 1103717. */
+class Num3072
+{
+public:
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const int LIMB_SIZE = 8 * sizeof(limb_t);
+    static const int LIMBS = 3072 / LIMB_SIZE;
+    static const size_t BYTE_SIZE = 384;
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    void Divide(const Num3072& a);
+    Num3072 GetInverse() const;
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]) const;
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+};
+
+/** A class representing MuHash sets.
+ *
+ * MuHash is a hashing algorithm that supports adding and removing set
+ * elements in any order, so that a commitment to a large set (such as the
+ * UTXO set) can be maintained incrementally. Each element is expanded into a
+ * 3072-bit number with ChaCha20 keyed by its SHA256, and the set is the
+ * product of its elements modulo 2^3072 - 1103717. Removals are kept in a
+ * separate denominator so that the (expensive) modular inverse is only
+ * needed once, in Finalize().
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* in, size_t len);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    /** Construct the empty set. */
+    MuHash3072() {}
+
+    /** Construct a set containing a single element. */
+    MuHash3072(const unsigned char* in, size_t len);
+
+    MuHash3072& Insert(const unsigned char* in, size_t len);
+    MuHash3072& Remove(const unsigned char* in, size_t len);
+
+    /** Multiply (resulting in the union of the two sets). */
+    MuHash3072& operator*=(const MuHash3072& mul);
+
+    /** Divide (resulting in the removal of the elements of div). */
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    /** Finalize into a 32-byte hash. Does not change this object's value. */
+    void Finalize(unsigned char out[OUTPUT_SIZE]) const;
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        unsigned char buf[Num3072::BYTE_SIZE];
+        numerator.ToBytes(buf);
+        s.write((const char*)buf, sizeof(buf));
+        denominator.ToBytes(buf);
+        s.write((const char*)buf, sizeof(buf));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        unsigned char buf[Num3072::BYTE_SIZE];
+        s.read((char*)buf, sizeof(buf));
+        numerator = Num3072(buf);
+        s.read((char*)buf, sizeof(buf));
+        denominator = Num3072(buf);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -0,0 +1,307 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <index/addrindex.h>
+
+#include <chainparams.h>
+#include <coins.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+constexpr char DB_ADDR_HISTORY = 'h';
+constexpr char DB_ADDR_UNSPENT = 'u';
+
+std::unique_ptr<AddrIndex> g_addrindex;
+
+namespace {
+
+uint256 GetScriptHash(const CScript& script)
+{
+    uint256 hash;
+    CSHA256().Write(script.data(), script.size()).Finalize(hash.begin());
+    return hash;
+}
+
+// Heights and output indices are stored big-endian so that LevelDB's
+// bytewise key order is chronological.
+template<typename Stream>
+void SerializeBE32(Stream& s, uint32_t n)
+{
+    unsigned char buf[4];
+    WriteBE32(buf, n);
+    s.write((const char*)buf, sizeof(buf));
+}
+
+template<typename Stream>
+uint32_t UnserializeBE32(Stream& s)
+{
+    unsigned char buf[4];
+    s.read((char*)buf, sizeof(buf));
+    return ReadBE32(buf);
+}
+
+struct HistoryKey {
+    char key;
+    uint256 script_hash;
+    int height;
+    uint256 txid;
+    bool spend;
+    uint32_t n;
+
+    HistoryKey() : key(DB_ADDR_HISTORY), height(0), spend(false), n(0) {}
+    HistoryKey(const uint256& script_hash_in, int height_in, const uint256& txid_in, bool spend_in, uint32_t n_in) :
+        key(DB_ADDR_HISTORY), script_hash(script_hash_in), height(height_in), txid(txid_in), spend(spend_in), n(n_in) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        s << key;
+        s << script_hash;
+        SerializeBE32(s, height);
+        s << txid;
+        s << spend;
+        SerializeBE32(s, n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> script_hash;
+        height = UnserializeBE32(s);
+        s >> txid;
+        s >> spend;
+        n = UnserializeBE32(s);
+    }
+};
+
+struct HistoryValue {
+    CAmount value;
+    COutPoint prevout;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(value);
+        READWRITE(prevout);
+    }
+};
+
+struct UnspentKey {
+    char key;
+    uint256 script_hash;
+    COutPoint outpoint;
+
+    UnspentKey() : key(DB_ADDR_UNSPENT) {}
+    UnspentKey(const uint256& script_hash_in, const COutPoint& outpoint_in) :
+        key(DB_ADDR_UNSPENT), script_hash(script_hash_in), outpoint(outpoint_in) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        s << key;
+        s << script_hash;
+        s << outpoint.hash;
+        SerializeBE32(s, outpoint.n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> script_hash;
+        s >> outpoint.hash;
+        outpoint.n = UnserializeBE32(s);
+    }
+};
+
+struct UnspentValue {
+    uint32_t height : 31;
+    bool coinbase : 1;
+    CAmount value;
+
+    UnspentValue() : height(0), coinbase(false), value(0) {}
+    UnspentValue(uint32_t height_in, bool coinbase_in, CAmount value_in) :
+        height(height_in), coinbase(coinbase_in), value(value_in) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        uint32_t code = height * 2 + coinbase;
+        ::Serialize(s, VARINT(code));
+        ::Serialize(s, value);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        uint32_t code = 0;
+        ::Unserialize(s, VARINT(code));
+        height = code >> 1;
+        coinbase = code & 1;
+        ::Unserialize(s, value);
+    }
+};
+
+} // namespace
+
+/**
+ * Access to the addrindex database (indexes/addrindex/)
+ *
+ * Next to the block locator of BaseIndex, the database holds one history
+ * record per funded output and per spending input, and one record per
+ * output that is still unspent, all keyed by the hash of the script.
+ */
+class AddrIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    /// Add the records of a connected block, or remove them again when fRevert.
+    bool WriteBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fRevert);
+
+    bool ReadHistory(const uint256& script_hash, size_t skip, size_t count, std::vector<CAddrHistoryEntry>& entries) const;
+
+    bool ReadUnspent(const uint256& script_hash, size_t skip, size_t count, std::vector<CAddrUnspentEntry>& entries) const;
+};
+
+AddrIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "addrindex", n_cache_size, f_memory, f_wipe)
+{}
+
+bool AddrIndex::DB::WriteBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fRevert)
+{
+    CDBBatch batch(*this);
+    // Transactions are applied in block order and reverted in the opposite
+    // order, so outputs spent within the block end up in the right state.
+    for (size_t k = 0; k < block.vtx.size(); k++) {
+        const size_t i = fRevert ? block.vtx.size() - 1 - k : k;
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        for (uint32_t o = 0; o < tx.vout.size(); o++) {
+            const CTxOut& out = tx.vout[o];
+            if (out.scriptPubKey.IsUnspendable()) continue;
+            const uint256 script_hash = GetScriptHash(out.scriptPubKey);
+            const HistoryKey history_key(script_hash, nHeight, txid, false, o);
+            const UnspentKey unspent_key(script_hash, COutPoint(txid, o));
+            if (fRevert) {
+                batch.Erase(history_key);
+                batch.Erase(unspent_key);
+            } else {
+                batch.Write(history_key, HistoryValue{out.nValue, COutPoint()});
+                batch.Write(unspent_key, UnspentValue(nHeight, tx.IsCoinBase(), out.nValue));
+            }
+        }
+
+        if (i == 0) continue;
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        if (txundo.vprevout.size() != tx.vin.size()) {
+            return error("%s: undo data does not match block at height %d", __func__, nHeight);
+        }
+        for (uint32_t j = 0; j < tx.vin.size(); j++) {
+            const Coin& coin = txundo.vprevout[j];
+            const COutPoint& prevout = tx.vin[j].prevout;
+            const uint256 script_hash = GetScriptHash(coin.out.scriptPubKey);
+            const HistoryKey history_key(script_hash, nHeight, txid, true, j);
+            const UnspentKey unspent_key(script_hash, prevout);
+            if (fRevert) {
+                batch.Erase(history_key);
+                batch.Write(unspent_key, UnspentValue(coin.nHeight, coin.IsCoinBase(), coin.out.nValue));
+            } else {
+                batch.Write(history_key, HistoryValue{coin.out.nValue, prevout});
+                batch.Erase(unspent_key);
+            }
+        }
+    }
+    return WriteBatch(batch);
+}
+
+bool AddrIndex::DB::ReadHistory(const uint256& script_hash, size_t skip, size_t count,
+                                std::vector<CAddrHistoryEntry>& entries) const
+{
+    std::unique_ptr<CDBIterator> pcursor(const_cast<DB&>(*this).NewIterator());
+    for (pcursor->Seek(HistoryKey(script_hash, 0, uint256(), false, 0)); pcursor->Valid() && entries.size() < count; pcursor->Next()) {
+        HistoryKey key;
+        if (!pcursor->GetKey(key) || key.key != DB_ADDR_HISTORY || key.script_hash != script_hash) break;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        HistoryValue value;
+        if (!pcursor->GetValue(value)) {
+            return error("%s: unable to read value", __func__);
+        }
+        entries.push_back(CAddrHistoryEntry{key.txid, key.n, key.spend, key.height, value.value, value.prevout});
+    }
+    return true;
+}
+
+bool AddrIndex::DB::ReadUnspent(const uint256& script_hash, size_t skip, size_t count,
+                                std::vector<CAddrUnspentEntry>& entries) const
+{
+    std::unique_ptr<CDBIterator> pcursor(const_cast<DB&>(*this).NewIterator());
+    for (pcursor->Seek(UnspentKey(script_hash, COutPoint(uint256(), 0))); pcursor->Valid() && entries.size() < count; pcursor->Next()) {
+        UnspentKey key;
+        if (!pcursor->GetKey(key) || key.key != DB_ADDR_UNSPENT || key.script_hash != script_hash) break;
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        UnspentValue value;
+        if (!pcursor->GetValue(value)) {
+            return error("%s: unable to read value", __func__);
+        }
+        entries.push_back(CAddrUnspentEntry{key.outpoint, (int)value.height, value.coinbase, value.value});
+    }
+    return true;
+}
+
+AddrIndex::AddrIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<AddrIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+AddrIndex::~AddrIndex() {}
+
+bool AddrIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // The genesis block has no undo data, and its outputs are not spendable.
+    if (!pindex->pprev) {
+        return true;
+    }
+
+    CBlockUndo blockundo;
+    if (!UndoReadFromDisk(blockundo, pindex)) {
+        return error("%s: Failed to read undo data for block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+    return m_db->WriteBlock(block, blockundo, pindex->nHeight, false);
+}
+
+bool AddrIndex::Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip)
+{
+    assert(current_tip->GetAncestor(new_tip->nHeight) == new_tip);
+
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    for (const CBlockIndex* pindex = current_tip; pindex != new_tip; pindex = pindex->pprev) {
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!ReadBlockFromDisk(block, pindex, consensus_params) || !UndoReadFromDisk(blockundo, pindex)) {
+            return error("%s: Failed to read block %s from disk", __func__, pindex->GetBlockHash().ToString());
+        }
+        if (!m_db->WriteBlock(block, blockundo, pindex->nHeight, true)) {
+            return false;
+        }
+    }
+    return BaseIndex::Rewind(current_tip, new_tip);
+}
+
+BaseIndex::DB& AddrIndex::GetDB() const { return *m_db; }
+
+bool AddrIndex::FindHistory(const CScript& script, size_t skip, size_t count, std::vector<CAddrHistoryEntry>& entries) const
+{
+    return m_db->ReadHistory(GetScriptHash(script), skip, count, entries);
+}
+
+bool AddrIndex::FindUnspent(const CScript& script, size_t skip, size_t count, std::vector<CAddrUnspentEntry>& entries) const
+{
+    return m_db->ReadUnspent(GetScriptHash(script), skip, count, entries);
+}
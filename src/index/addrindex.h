@@ -0,0 +1,90 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_ADDRINDEX_H
+#define BITCOIN_INDEX_ADDRINDEX_H
+
+#include <amount.h>
+#include <chain.h>
+#include <index/base.h>
+#include <primitives/transaction.h>
+#include <script/script.h>
+#include <uint256.h>
+
+#include <vector>
+
+/** A transaction that funded (an output) or spent (an input) a script, as recorded by AddrIndex. */
+struct CAddrHistoryEntry
+{
+    /** The funding or spending transaction. */
+    uint256 txid;
+    /** Output index when funding, input index when spending. */
+    uint32_t n;
+    bool fSpend;
+    int nHeight;
+    CAmount nValue;
+    /** The output that was spent, null when funding. */
+    COutPoint prevout;
+};
+
+/** An unspent output paying to a script, as recorded by AddrIndex. */
+struct CAddrUnspentEntry
+{
+    COutPoint outpoint;
+    int nHeight;
+    bool fCoinBase;
+    CAmount nValue;
+};
+
+/**
+ * AddrIndex is used to look up the confirmed history and unspent outputs of
+ * a scriptPubKey (and so of an address). The index is written to a LevelDB
+ * database keyed by the SHA256 of the script, with history entries ordered by
+ * height so that queries can be paged through chronologically. The spent
+ * scripts are taken from the undo data, and the entries of blocks leaving the
+ * active chain are removed again when the index is rewound.
+ */
+class AddrIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    bool Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "addrindex"; }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit AddrIndex(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~AddrIndex() override;
+
+    /// Look up the transactions funding or spending a script, oldest first.
+    /// Safe to call from any thread without holding cs_main.
+    ///
+    /// @param[in]   script  The scriptPubKey to look up.
+    /// @param[in]   skip  Number of leading entries to skip, for pagination.
+    /// @param[in]   count  Maximum number of entries to return.
+    /// @param[out]  entries  The entries found.
+    /// @return  false on a database error
+    bool FindHistory(const CScript& script, size_t skip, size_t count, std::vector<CAddrHistoryEntry>& entries) const;
+
+    /// Look up the unspent outputs paying to a script, ordered by outpoint.
+    /// Takes the same arguments as FindHistory.
+    bool FindUnspent(const CScript& script, size_t skip, size_t count, std::vector<CAddrUnspentEntry>& entries) const;
+};
+
+/// The global address index. May be null.
+extern std::unique_ptr<AddrIndex> g_addrindex;
+
+#endif // BITCOIN_INDEX_ADDRINDEX_H
@@ -0,0 +1,205 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <index/blockfilterindex.h>
+
+#include <coins.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+#include <algorithm>
+
+/* The index database stores two records for every block:
+ *
+ * 'h' + block hash -> filter hash and filter header
+ * 'f' + block hash -> encoded filter
+ *
+ * Ranges of filter hashes, as needed for cfheaders, are served from the
+ * small records without touching the filters themselves.
+ */
+constexpr char DB_FILTER_HEADER = 'h';
+constexpr char DB_FILTER = 'f';
+
+std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+namespace {
+
+struct DBVal {
+    uint256 hash;
+    uint256 header;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+    }
+};
+
+} // namespace
+
+/**
+ * Access to the block filter database (indexes/blockfilter/<filter name>/)
+ */
+class BlockFilterIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(const fs::path& path, size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    bool ReadFilterHeader(const uint256& block_hash, DBVal& val) const;
+
+    bool ReadFilter(const uint256& block_hash, std::vector<unsigned char>& encoded_filter) const;
+
+    bool WriteFilter(const BlockFilter& filter, const DBVal& val);
+};
+
+BlockFilterIndex::DB::DB(const fs::path& path, size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(path, n_cache_size, f_memory, f_wipe)
+{}
+
+bool BlockFilterIndex::DB::ReadFilterHeader(const uint256& block_hash, DBVal& val) const
+{
+    return Read(std::make_pair(DB_FILTER_HEADER, block_hash), val);
+}
+
+bool BlockFilterIndex::DB::ReadFilter(const uint256& block_hash, std::vector<unsigned char>& encoded_filter) const
+{
+    return Read(std::make_pair(DB_FILTER, block_hash), encoded_filter);
+}
+
+bool BlockFilterIndex::DB::WriteFilter(const BlockFilter& filter, const DBVal& val)
+{
+    CDBBatch batch(*this);
+    batch.Write(std::make_pair(DB_FILTER_HEADER, filter.GetBlockHash()), val);
+    batch.Write(std::make_pair(DB_FILTER, filter.GetBlockHash()), filter.GetEncodedFilter());
+    return WriteBatch(batch);
+}
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filter_type, size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_filter_type(filter_type), m_name(BlockFilterTypeName(filter_type) + " block filter index"),
+      m_db(MakeUnique<BlockFilterIndex::DB>(GetDataDir() / "indexes" / "blockfilter" / BlockFilterTypeName(filter_type),
+                                            n_cache_size, f_memory, f_wipe))
+{}
+
+BlockFilterIndex::~BlockFilterIndex() {}
+
+bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo block_undo;
+    uint256 prev_header;
+
+    if (pindex->pprev) {
+        if (!UndoReadFromDisk(block_undo, pindex)) {
+            return error("%s: Failed to read undo data for block %s", __func__, pindex->GetBlockHash().ToString());
+        }
+
+        DBVal prev_val;
+        if (!m_db->ReadFilterHeader(pindex->pprev->GetBlockHash(), prev_val)) {
+            return error("%s: Failed to read the filter header of block %s", __func__,
+                         pindex->pprev->GetBlockHash().ToString());
+        }
+        prev_header = prev_val.header;
+    }
+
+    BlockFilter filter(m_filter_type, block, block_undo);
+    DBVal val;
+    val.hash = filter.GetHash();
+    val.header = filter.ComputeHeader(prev_header);
+    return m_db->WriteFilter(filter, val);
+}
+
+BaseIndex::DB& BlockFilterIndex::GetDB() const { return *m_db; }
+
+/** The blocks from start_height up to and including stop_index, lowest first. */
+static bool GetBlockRange(int start_height, const CBlockIndex* stop_index, std::vector<uint256>& block_hashes)
+{
+    if (start_height < 0) {
+        return error("%s: start height (%d) is negative", __func__, start_height);
+    }
+    if (start_height > stop_index->nHeight) {
+        return error("%s: start height (%d) is greater than stop height (%d)",
+                     __func__, start_height, stop_index->nHeight);
+    }
+
+    block_hashes.resize(stop_index->nHeight - start_height + 1);
+    const CBlockIndex* pindex = stop_index;
+    for (auto it = block_hashes.rbegin(); it != block_hashes.rend(); ++it) {
+        *it = pindex->GetBlockHash();
+        pindex = pindex->pprev;
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const
+{
+    std::vector<unsigned char> encoded_filter;
+    if (!m_db->ReadFilter(block_index->GetBlockHash(), encoded_filter)) {
+        return false;
+    }
+
+    try {
+        filter_out = BlockFilter(m_filter_type, block_index->GetBlockHash(), std::move(encoded_filter));
+    } catch (const std::exception& e) {
+        return error("%s: Failed to decode the filter of block %s: %s", __func__,
+                     block_index->GetBlockHash().ToString(), e.what());
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const
+{
+    DBVal val;
+    if (!m_db->ReadFilterHeader(block_index->GetBlockHash(), val)) {
+        return false;
+    }
+    header_out = val.header;
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterRange(int start_height, const CBlockIndex* stop_index,
+                                         std::vector<BlockFilter>& filters_out) const
+{
+    std::vector<uint256> block_hashes;
+    if (!GetBlockRange(start_height, stop_index, block_hashes)) {
+        return false;
+    }
+
+    filters_out.clear();
+    filters_out.reserve(block_hashes.size());
+    for (const uint256& block_hash : block_hashes) {
+        std::vector<unsigned char> encoded_filter;
+        if (!m_db->ReadFilter(block_hash, encoded_filter)) {
+            return error("%s: filter of block %s not found", __func__, block_hash.ToString());
+        }
+        try {
+            filters_out.emplace_back(m_filter_type, block_hash, std::move(encoded_filter));
+        } catch (const std::exception& e) {
+            return error("%s: Failed to decode the filter of block %s: %s", __func__,
+                         block_hash.ToString(), e.what());
+        }
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHashRange(int start_height, const CBlockIndex* stop_index,
+                                             std::vector<uint256>& hashes_out) const
+{
+    std::vector<uint256> block_hashes;
+    if (!GetBlockRange(start_height, stop_index, block_hashes)) {
+        return false;
+    }
+
+    hashes_out.clear();
+    hashes_out.reserve(block_hashes.size());
+    for (const uint256& block_hash : block_hashes) {
+        DBVal val;
+        if (!m_db->ReadFilterHeader(block_hash, val)) {
+            return error("%s: filter header of block %s not found", __func__, block_hash.ToString());
+        }
+        hashes_out.push_back(val.hash);
+    }
+    return true;
+}
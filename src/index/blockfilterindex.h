@@ -0,0 +1,72 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKFILTERINDEX_H
+#define BITCOIN_INDEX_BLOCKFILTERINDEX_H
+
+#include <blockfilter.h>
+#include <chain.h>
+#include <index/base.h>
+
+#include <vector>
+
+/**
+ * BlockFilterIndex is used to store and retrieve block filters, hashes, and
+ * headers for single blocks or ranges of them. The filters are computed once per
+ * block from the block and its undo data, so that serving them to light
+ * clients costs a database read rather than a scan of the block.
+ *
+ * Entries are keyed by block hash. A filter and its header only depend on
+ * the block and its ancestors, so the entries of blocks that leave the
+ * active chain stay valid and nothing needs rewinding.
+ */
+class BlockFilterIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const BlockFilterType m_filter_type;
+    const std::string m_name;
+    const std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return m_name.c_str(); }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit BlockFilterIndex(BlockFilterType filter_type, size_t n_cache_size,
+                              bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~BlockFilterIndex() override;
+
+    BlockFilterType GetFilterType() const { return m_filter_type; }
+
+    /// Get a single filter by block. Safe to call from any thread without holding cs_main.
+    bool LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const;
+
+    /// Get a single filter header by block.
+    bool LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const;
+
+    /// Get a range of filters between two heights on the chain ending at
+    /// stop_index. The block indexes of the range must be stable, i.e. the
+    /// caller holds cs_main or the blocks cannot be pruned.
+    bool LookupFilterRange(int start_height, const CBlockIndex* stop_index,
+                           std::vector<BlockFilter>& filters_out) const;
+
+    /// Get a range of filter hashes between two heights on the chain ending at stop_index.
+    bool LookupFilterHashRange(int start_height, const CBlockIndex* stop_index,
+                               std::vector<uint256>& hashes_out) const;
+};
+
+/// The global basic block filter index, used to serve filters over P2P, RPC
+/// and REST. May be null.
+extern std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+#endif // BITCOIN_INDEX_BLOCKFILTERINDEX_H
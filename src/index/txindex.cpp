@@ -0,0 +1,209 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <index/txindex.h>
+#include <init.h>
+#include <ui_interface.h>
+#include <util.h>
+#include <validation.h>
+
+#include <boost/thread.hpp>
+
+constexpr char DB_TXINDEX = 't';
+
+std::unique_ptr<TxIndex> g_txindex;
+
+/** Location of a transaction on disk, and the block it is part of. */
+struct CDiskTxEntry
+{
+    CDiskTxPos pos;
+    uint256 hashBlock;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(pos);
+        READWRITE(hashBlock);
+    }
+};
+
+/**
+ * Access to the txindex database (indexes/txindex/)
+ *
+ * The database stores a block locator of the chain the database is synced to
+ * so that the TxIndex can efficiently determine the point it last stopped at.
+ * A locator is used instead of a simple hash of the chain tip because blocks
+ * and block index entries may not be flushed to disk until after this database
+ * is updated.
+ */
+class TxIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    /// Read the disk location of the transaction data with the given hash. Returns false if the
+    /// transaction hash is not indexed.
+    bool ReadTxEntry(const uint256& txid, CDiskTxEntry& entry) const;
+
+    /// Write a batch of transaction positions to the DB.
+    bool WriteTxs(const std::vector<std::pair<uint256, CDiskTxEntry>>& v_entries);
+
+    /// Migrate the transaction index that older versions kept in the block
+    /// index database to this one, and erase it from there.
+    bool MigrateData(CBlockTreeDB& block_tree_db, const CBlockLocator& best_locator);
+};
+
+TxIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "txindex", n_cache_size, f_memory, f_wipe)
+{}
+
+bool TxIndex::DB::ReadTxEntry(const uint256& txid, CDiskTxEntry& entry) const
+{
+    return Read(std::make_pair(DB_TXINDEX, txid), entry);
+}
+
+bool TxIndex::DB::WriteTxs(const std::vector<std::pair<uint256, CDiskTxEntry>>& v_entries)
+{
+    CDBBatch batch(*this);
+    for (const auto& tuple : v_entries) {
+        batch.Write(std::make_pair(DB_TXINDEX, tuple.first), tuple.second);
+    }
+    return WriteBatch(batch);
+}
+
+bool TxIndex::DB::MigrateData(CBlockTreeDB& block_tree_db, const CBlockLocator& best_locator)
+{
+    AssertLockHeld(cs_main);
+
+    // Legacy entries only hold the disk position of the transaction; the hash
+    // of the block stored at that position is found through the block index.
+    std::map<std::pair<int, unsigned int>, uint256> block_hashes;
+    for (const auto& item : mapBlockIndex) {
+        const CBlockIndex* pindex = item.second;
+        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            block_hashes.emplace(std::make_pair(pindex->nFile, pindex->nDataPos), item.first);
+        }
+    }
+
+    LogPrintf("Upgrading txindex database... [0%%]\n");
+    uiInterface.ShowProgress(_("Upgrading txindex database"), 0, true);
+    int report_done = 0;
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    size_t n_migrated = 0, n_dropped = 0;
+
+    std::unique_ptr<CDBIterator> cursor(block_tree_db.NewIterator());
+    cursor->Seek(std::make_pair(DB_TXINDEX, uint256()));
+    CDBBatch batch(*this);
+    std::pair<char, uint256> key;
+    while (cursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            // Entries written so far are overwritten when the migration is resumed.
+            LogPrintf("Interrupted txindex database upgrade\n");
+            return false;
+        }
+        if (!cursor->GetKey(key) || key.first != DB_TXINDEX) break;
+
+        // Keys are visited in txid order and txids are uniformly distributed,
+        // so the first byte of the current one gives the progress.
+        int percentage_done = (int)(*key.second.begin()) * 100 / 256;
+        if (percentage_done / 10 > report_done) {
+            report_done = percentage_done / 10;
+            LogPrintf("Upgrading txindex database... [%d%%]\n", percentage_done);
+            uiInterface.ShowProgress(_("Upgrading txindex database"), percentage_done, true);
+        }
+
+        CDiskTxEntry entry;
+        if (!cursor->GetValue(entry.pos)) {
+            return error("%s: cannot parse txindex record", __func__);
+        }
+        auto it = block_hashes.find(std::make_pair(entry.pos.nFile, entry.pos.nPos));
+        if (it != block_hashes.end()) {
+            entry.hashBlock = it->second;
+            batch.Write(key, entry);
+            ++n_migrated;
+        } else {
+            // The block is no longer stored, so the transaction cannot be read back anyway.
+            ++n_dropped;
+        }
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch)) return false;
+            batch.Clear();
+        }
+        cursor->Next();
+    }
+    if (!WriteBatch(batch, true)) return false;
+
+    // Legacy entries were written as blocks were connected, so they cover the
+    // active chain; the sync thread picks up from here.
+    if (!WriteBestBlock(best_locator)) {
+        return error("%s: failed to write locator to disk", __func__);
+    }
+    if (!block_tree_db.EraseLegacyTxIndex() || !block_tree_db.WriteFlag("txindex", false)) {
+        return error("%s: failed to erase the old transaction index", __func__);
+    }
+
+    uiInterface.ShowProgress("", 100, false);
+    LogPrintf("Upgraded txindex database: %u entries migrated, %u dropped\n", n_migrated, n_dropped);
+    return true;
+}
+
+TxIndex::TxIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<TxIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+TxIndex::~TxIndex() {}
+
+bool TxIndex::Init()
+{
+    LOCK(cs_main);
+
+    // Older versions kept the transaction index in the block index database.
+    bool legacy_txindex = false;
+    if (pblocktree->ReadFlag("txindex", legacy_txindex) && legacy_txindex) {
+        if (!m_db->MigrateData(*pblocktree, chainActive.GetLocator())) {
+            return false;
+        }
+    }
+
+    return BaseIndex::Init();
+}
+
+bool TxIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // Exclude genesis block transaction because outputs are not spendable.
+    if (pindex->nHeight == 0) return true;
+
+    CDiskTxEntry entry;
+    entry.pos = CDiskTxPos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    entry.hashBlock = pindex->GetBlockHash();
+    std::vector<std::pair<uint256, CDiskTxEntry>> vPos;
+    vPos.reserve(block.vtx.size());
+    for (const auto& tx : block.vtx) {
+        vPos.emplace_back(tx->GetHash(), entry);
+        entry.pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+    }
+    return m_db->WriteTxs(vPos);
+}
+
+BaseIndex::DB& TxIndex::GetDB() const { return *m_db; }
+
+bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx) const
+{
+    CDiskTxEntry entry;
+    if (!m_db->ReadTxEntry(tx_hash, entry)) {
+        return false;
+    }
+
+    // The block hash is stored in the index, so only the transaction is read
+    if (!ReadTxFromDisk(tx, entry.pos, entry.pos.nTxOffset)) {
+        return false;
+    }
+    if (tx->GetHash() != tx_hash) {
+        return error("%s: txid mismatch", __func__);
+    }
+    block_hash = entry.hashBlock;
+    return true;
+}
@@ -19,6 +19,9 @@
 #include <fs.h>
 #include <httpserver.h>
 #include <httprpc.h>
+#include <index/addrindex.h>
+#include <index/blockfilterindex.h>
+#include <index/txindex.h>
 #include <key.h>
 #include <validation.h>
 #include <miner.h>
@@ -89,6 +92,26 @@ static CZMQNotificationInterface* pzmqNotificationInterface = nullptr;
 #endif
 
 static const char* FEE_ESTIMATES_FILENAME="fee_estimates.dat";
+/** Seconds between writes of the fee estimates, if they changed */
+static const int64_t FEE_ESTIMATES_WRITE_INTERVAL = 10 * 60;
+
+/** Write the fee estimates next to the old file and swap them, so a crash leaves either intact */
+static void WriteFeeEstimates()
+{
+    fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
+    fs::path est_path_new = GetDataDir() / (std::string(FEE_ESTIMATES_FILENAME) + ".new");
+    CAutoFile est_fileout(fsbridge::fopen(est_path_new, "wb"), SER_DISK, CLIENT_VERSION);
+    if (est_fileout.IsNull()) {
+        LogPrintf("%s: Failed to write fee estimates to %s\n", __func__, est_path_new.string());
+        return;
+    }
+    if (!::feeEstimator.Write(est_fileout)) return;
+    FileCommit(est_fileout.Get());
+    est_fileout.fclose();
+    if (!RenameOver(est_path_new, est_path)) {
+        LogPrintf("%s: Failed to rename fee estimates to %s\n", __func__, est_path.string());
+    }
+}
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -149,6 +172,26 @@ public:
             abort();
         }
     }
+    bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const override {
+        try {
+            return CCoinsViewBacked::GetCompressedCoin(outpoint, coin);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            // See GetCoin above.
+            abort();
+        }
+    }
+    size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const override {
+        try {
+            return CCoinsViewBacked::GetCoins(outpoints, coins);
+        } catch(const std::runtime_error& e) {
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            // See GetCoin above.
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
@@ -168,6 +211,12 @@ void Interrupt()
     InterruptMapPort();
     if (g_connman)
         g_connman->Interrupt();
+    if (g_txindex)
+        g_txindex->Interrupt();
+    if (g_addrindex)
+        g_addrindex->Interrupt();
+    if (g_blockfilterindex)
+        g_blockfilterindex->Interrupt();
 }
 
 void Shutdown()
@@ -209,18 +258,13 @@ void Shutdown()
     threadGroup.join_all();
 
     if (fDumpMempoolLater && gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
-        DumpMempool();
+        AppendMempoolJournal();
     }
 
     if (fFeeEstimatesInitialized)
     {
         ::feeEstimator.FlushUnconfirmed();
-        fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
-        CAutoFile est_fileout(fsbridge::fopen(est_path, "wb"), SER_DISK, CLIENT_VERSION);
-        if (!est_fileout.IsNull())
-            ::feeEstimator.Write(est_fileout);
-        else
-            LogPrintf("%s: Failed to write fee estimates to %s\n", __func__, est_path.string());
+        WriteFeeEstimates();
         fFeeEstimatesInitialized = false;
     }
 
@@ -233,6 +277,19 @@ void Shutdown()
     // CValidationInterface callbacks, flush them...
     GetMainSignals().FlushBackgroundCallbacks();
 
+    if (g_txindex) {
+        g_txindex->Stop();
+        g_txindex.reset();
+    }
+    if (g_addrindex) {
+        g_addrindex->Stop();
+        g_addrindex.reset();
+    }
+    if (g_blockfilterindex) {
+        g_blockfilterindex->Stop();
+        g_blockfilterindex.reset();
+    }
+
     // Any future callbacks will be dropped. This should absolutely be safe - if
     // missing a callback results in an unrecoverable situation, unclean shutdown
     // would too. The only reason to do the above flushes is to let the wallet catch
@@ -243,12 +300,19 @@ void Shutdown()
         LOCK(cs_main);
         if (pcoinsTip != nullptr) {
             FlushStateToDisk();
+            // Leave a marker for a fast restart if the flush brought the block
+            // files, block index and chainstate on disk to the same tip.
+            if (!fReindex && chainActive.Tip() && pcoinsdbview->GetHeadBlocks().empty() &&
+                pcoinsdbview->GetBestBlock() == chainActive.Tip()->GetBlockHash()) {
+                pblocktree->WriteCleanShutdown(chainActive.Tip()->GetBlockHash());
+            }
         }
         pcoinsTip.reset();
         pcoinscatcher.reset();
         pcoinsdbview.reset();
         pblocktree.reset();
     }
+    StopBlockWriter();
 #ifdef ENABLE_WALLET
     StopWallets();
 #endif
@@ -331,12 +395,19 @@ std::string HelpMessage(HelpMessageMode mode)
     std::string strUsage = HelpMessageGroup(_("Options:"));
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
+    strUsage += HelpMessageOpt("-addrindex", strprintf(_("Maintain an index of the transactions funding and spending each address, used by the getaddresshistory and getutxos rpc calls (default: %u)"), DEFAULT_ADDRINDEX));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
     strUsage +=HelpMessageOpt("-assumevalid=<hex>", strprintf(_("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s)"), defaultChainParams->GetConsensus().defaultAssumeValid.GetHex(), testnetChainParams->GetConsensus().defaultAssumeValid.GetHex()));
+#ifdef USE_ZSTD
+    strUsage += HelpMessageOpt("-blockcompression=<n>", strprintf(_("Compress newly stored blocks and undo data with zstd at level <n> (0-%d, 0 to disable, default: %u). Reading compressed data needs no option"), MAX_BLOCK_COMPRESSION, DEFAULT_BLOCK_COMPRESSION));
+#endif
+    strUsage += HelpMessageOpt("-blockfilterindex=<type>", strprintf(_("Maintain an index of compact block filters by block, used by the getblockfilter rpc call and REST interface (default: %s). "
+            "If <type> is not supplied or if <type> = 1, the basic filters are indexed"), DEFAULT_BLOCKFILTERINDEX));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     strUsage += HelpMessageOpt("-blockreconstructionextratxn=<n>", strprintf(_("Extra transactions to keep in memory for compact block reconstructions (default: %u)"), DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
+    strUsage += HelpMessageOpt("-blocktreesyncinterval=<n>", strprintf(_("Sync block index writes to disk up to <n> seconds late, keeping them out of block processing. A system crash within that window may require -reindex (default: %u)"), DEFAULT_BLOCKTREE_SYNC_INTERVAL));
     strUsage += HelpMessageOpt("-conf=<file>", strprintf(_("Specify configuration file. Relative paths will be prefixed by datadir location. (default: %s)"), BITCOIN_CONF_FILENAME));
     if (mode == HMM_BITCOIND)
     {
@@ -354,26 +425,32 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
+    strUsage += HelpMessageOpt("-loadtxoutset=<file>", _("Fill an empty chainstate from a UTXO set snapshot written by the dumptxoutset rpc call. The snapshot's block and its ancestors must be available (e.g. copied blocks directory)"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     if (showDebug) {
         strUsage += HelpMessageOpt("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex()));
     }
+    strUsage += HelpMessageOpt("-mmapblockfiles=<n>", strprintf(_("Keep up to <n> recently read block and undo files memory-mapped, and read blocks from the mapping (0 to disable, default: %u)"), DEFAULT_MMAP_BLOCK_FILES));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
-    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to keep a journal of the mempool on disk, written every %d seconds and on shutdown, and load it on restart (default: %u)"), MEMPOOL_JOURNAL_INTERVAL, DEFAULT_PERSIST_MEMPOOL));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
-    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex and -rescan. "
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex, -addrindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+    strUsage += HelpMessageOpt("-pruneage=<n>", _("With -prune, also prune block files once all their blocks are more than <n> days older than the tip (default: 0 = off)"));
+    strUsage += HelpMessageOpt("-pruneundowindow=<n>", _("With -prune, keep the undo data of the last <n> blocks when their block data is pruned, so that they can be disconnected after fetching them again with getblockfrompeer (default: 0)"));
+    strUsage += HelpMessageOpt("-prunewindow=<n>", strprintf(_("With -prune, also prune block files once all their blocks are more than <n> blocks below the tip (default: 0 = off, minimum: %u)"), MIN_BLOCKS_TO_KEEP));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-utxostats", strprintf(_("Maintain UTXO set statistics for every connected block, used by the gettxoutsetinfo rpc call. Costs a MuHash update per coin and about 800 bytes of block index database per block (default: %u)"), DEFAULT_UTXOSTATS));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open (see the `addnode` RPC command help for more info)"));
@@ -395,6 +472,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-maxuploadtarget=<n>", strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET));
     strUsage += HelpMessageOpt("-onion=<ip:port>", strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy"));
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
+    strUsage += HelpMessageOpt("-peerblockfilters", strprintf(_("Serve compact block filters to peers per BIP 157 (default: %u)"), DEFAULT_PEERBLOCKFILTERS));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), defaultChainParams->GetDefaultPort(), testnetChainParams->GetDefaultPort()));
@@ -430,7 +508,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Debugging/Testing options:"));
     if (showDebug)
     {
-        strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
+        strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all). Unless -checkblocks or -checklevel is set, the check is skipped after a clean shutdown"), DEFAULT_CHECKBLOCKS));
         strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", defaultChainParams->DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", defaultChainParams->DefaultConsistencyChecks()));
@@ -694,6 +772,10 @@ void ThreadImport(std::vector<fs::path> vImportFiles)
     if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
         LoadMempool();
         fDumpMempoolLater = !fRequestShutdown;
+        if (fDumpMempoolLater) {
+            // Start the journal from what was loaded
+            DumpMempool();
+        }
     }
 }
 
@@ -837,6 +919,7 @@ int nMaxConnections;
 int nUserMaxConnections;
 int nFD;
 ServiceFlags nLocalServices = ServiceFlags(NODE_NETWORK | NODE_NETWORK_LIMITED);
+bool fBlockFilterIndex = false;
 
 } // namespace
 
@@ -908,10 +991,23 @@ bool AppInitParameterInteraction()
 
     // also see: InitParameterInteraction()
 
+    // parse and validate enabled filter types
+    std::string blockfilterindex_value = gArgs.GetArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+    if (blockfilterindex_value == "" || blockfilterindex_value == "1" ||
+        blockfilterindex_value == BlockFilterTypeName(BlockFilterType::BASIC)) {
+        fBlockFilterIndex = true;
+    } else if (blockfilterindex_value != "0") {
+        return InitError(strprintf(_("Unknown -blockfilterindex value %s."), blockfilterindex_value));
+    }
+
     // if using block pruning, then disallow txindex
     if (gArgs.GetArg("-prune", 0)) {
         if (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX))
             return InitError(_("Prune mode is incompatible with -txindex."));
+        if (gArgs.GetBoolArg("-addrindex", DEFAULT_ADDRINDEX))
+            return InitError(_("Prune mode is incompatible with -addrindex."));
+        if (fBlockFilterIndex)
+            return InitError(_("Prune mode is incompatible with -blockfilterindex."));
     }
 
     // -bind and -whitebind can't be set when not listening
@@ -989,6 +1085,13 @@ bool AppInitParameterInteraction()
     }
     fCheckBlockIndex = gArgs.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = gArgs.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    fUTXOStats = gArgs.GetBoolArg("-utxostats", DEFAULT_UTXOSTATS);
+    nMappedBlockFiles = std::max(0, (int)gArgs.GetArg("-mmapblockfiles", DEFAULT_MMAP_BLOCK_FILES));
+    nBlockCompressionLevel = std::min(std::max(0, (int)gArgs.GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION)), MAX_BLOCK_COMPRESSION);
+#ifndef USE_ZSTD
+    if (nBlockCompressionLevel > 0)
+        return InitError(_("Compressed block storage (-blockcompression) is not supported by this build."));
+#endif
 
     hashAssumeValid = uint256S(gArgs.GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
     if (!hashAssumeValid.IsNull())
@@ -1052,6 +1155,29 @@ bool AppInitParameterInteraction()
         fPruneMode = true;
     }
 
+    // pruning by height window and by age, on top of the target size, and keeping undo data longer
+    int64_t nPruneWindowArg = gArgs.GetArg("-prunewindow", 0);
+    int64_t nPruneAgeArg = gArgs.GetArg("-pruneage", 0);
+    int64_t nPruneUndoWindowArg = gArgs.GetArg("-pruneundowindow", 0);
+    if (nPruneWindowArg < 0 || nPruneAgeArg < 0 || nPruneUndoWindowArg < 0) {
+        return InitError(_("-prunewindow, -pruneage and -pruneundowindow cannot be configured with a negative value."));
+    }
+    if ((nPruneWindowArg || nPruneAgeArg || nPruneUndoWindowArg) && !fPruneMode) {
+        return InitError(_("-prunewindow, -pruneage and -pruneundowindow require -prune."));
+    }
+    nPruneWindow = nPruneWindowArg ? std::min<int64_t>(std::max<int64_t>(nPruneWindowArg, MIN_BLOCKS_TO_KEEP), std::numeric_limits<int>::max()) : 0;
+    nPruneAge = std::min<int64_t>(nPruneAgeArg, 1000000) * 24 * 60 * 60;
+    nPruneUndoWindow = std::min<int64_t>(nPruneUndoWindowArg, std::numeric_limits<int>::max());
+    if (nPruneWindow) {
+        LogPrintf("Prune block files with blocks more than %u blocks below the tip.\n", nPruneWindow);
+    }
+    if (nPruneAge) {
+        LogPrintf("Prune block files with blocks more than %d days older than the tip.\n", nPruneAgeArg);
+    }
+    if (nPruneUndoWindow) {
+        LogPrintf("Prune keeps undo data of the last %u blocks.\n", nPruneUndoWindow);
+    }
+
     nConnectTimeout = gArgs.GetArg("-timeout", DEFAULT_CONNECT_TIMEOUT);
     if (nConnectTimeout <= 0)
         nConnectTimeout = DEFAULT_CONNECT_TIMEOUT;
@@ -1108,6 +1234,14 @@ bool AppInitParameterInteraction()
     if (gArgs.GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices = ServiceFlags(nLocalServices | NODE_BLOOM);
 
+    // Signal NODE_COMPACT_FILTERS if peerblockfilters and basic filters index are both enabled.
+    if (gArgs.GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        if (!fBlockFilterIndex) {
+            return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+        }
+        nLocalServices = ServiceFlags(nLocalServices | NODE_COMPACT_FILTERS);
+    }
+
     if (gArgs.GetArg("-rpcserialversion", DEFAULT_RPC_SERIALIZE_VERSION) < 0)
         return InitError("rpcserialversion must be non-negative.");
 
@@ -1246,6 +1380,14 @@ bool AppInitMain()
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPrevalidationCheck);
+    }
+
+    // The thread doing a batched coin lookup joins these in reading
+    const int nCoinsReadThreads = std::min(std::max(GetNumCores(), 1), MAX_COINS_DB_READ_THREADS);
+    for (int i = 0; i < nCoinsReadThreads - 1; i++) {
+        threadGroup.create_thread(&ThreadCoinsRead);
     }
 
     // Start the lightweight task scheduler thread
@@ -1255,6 +1397,9 @@ bool AppInitMain()
     GetMainSignals().RegisterBackgroundSignalScheduler(scheduler);
     GetMainSignals().RegisterWithMempoolSignals(mempool);
 
+    // Start the thread writing blocks and undo data in the background
+    StartBlockWriter();
+
     /* Register RPC commands regardless of -server setting so they will be
      * available in the GUI RPC console even if external calls are disabled.
      */
@@ -1404,9 +1549,14 @@ bool AppInitMain()
     int64_t nTotalCache = (gArgs.GetArg("-dbcache", nDefaultDbCache) << 20);
     nTotalCache = std::max(nTotalCache, nMinDbCache << 20); // total cache cannot be less than nMinDbCache
     nTotalCache = std::min(nTotalCache, nMaxDbCache << 20); // total cache cannot be greater than nMaxDbcache
-    int64_t nBlockTreeDBCache = nTotalCache / 8;
-    nBlockTreeDBCache = std::min(nBlockTreeDBCache, (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
+    int64_t nBlockTreeDBCache = std::min(nTotalCache / 8, nMaxBlockDBCache << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nTxIndexCache = std::min(nTotalCache / 8, gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxTxIndexCache << 20 : 0);
+    nTotalCache -= nTxIndexCache;
+    int64_t nAddrIndexCache = std::min(nTotalCache / 8, gArgs.GetBoolArg("-addrindex", DEFAULT_ADDRINDEX) ? nMaxAddrIndexCache << 20 : 0);
+    nTotalCache -= nAddrIndexCache;
+    int64_t nFilterIndexCache = std::min(nTotalCache / 8, fBlockFilterIndex ? nMaxFilterIndexCache << 20 : 0);
+    nTotalCache -= nFilterIndexCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
@@ -1414,6 +1564,16 @@ bool AppInitMain()
     int64_t nMempoolSizeMax = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    if (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+        LogPrintf("* Using %.1fMiB for transaction index database\n", nTxIndexCache * (1.0 / 1024 / 1024));
+    }
+    if (gArgs.GetBoolArg("-addrindex", DEFAULT_ADDRINDEX)) {
+        LogPrintf("* Using %.1fMiB for address index database\n", nAddrIndexCache * (1.0 / 1024 / 1024));
+    }
+    if (fBlockFilterIndex) {
+        LogPrintf("* Using %.1fMiB for %s block filter index database\n",
+                  nFilterIndexCache * (1.0 / 1024 / 1024), BlockFilterTypeName(BlockFilterType::BASIC));
+    }
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set (plus up to %.1fMiB of unused mempool space)\n", nCoinCacheUsage * (1.0 / 1024 / 1024), nMempoolSizeMax * (1.0 / 1024 / 1024));
 
@@ -1445,9 +1605,8 @@ bool AppInitMain()
 
                 if (fRequestShutdown) break;
 
-                // LoadBlockIndex will load fTxIndex from the db, or set it if
-                // we're reindexing. It will also load fHavePruned if we've
-                // ever removed a block file from disk.
+                // LoadBlockIndex will load fHavePruned if we've ever removed a
+                // block file from disk.
                 // Note that it also sets fReindex based on the disk flag!
                 // From here on out fReindex and fReset mean something different!
                 if (!LoadBlockIndex(chainparams)) {
@@ -1460,12 +1619,6 @@ bool AppInitMain()
                 if (!mapBlockIndex.empty() && mapBlockIndex.count(chainparams.GetConsensus().hashGenesisBlock) == 0)
                     return InitError(_("Incorrect or no genesis block found. Wrong datadir for network?"));
 
-                // Check for changed -txindex state
-                if (fTxIndex != gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
-                    break;
-                }
-
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
                 if (fHavePruned && !fPruneMode) {
@@ -1495,6 +1648,29 @@ bool AppInitMain()
                     break;
                 }
 
+                // Coins of a snapshot load that was interrupted are unverified, drop them.
+                if (pcoinsdbview->IsSnapshotIncomplete()) {
+                    LogPrintf("Discarding partially loaded UTXO set snapshot\n");
+                    if (!pcoinsdbview->WipeSnapshot()) {
+                        strLoadError = _("Error erasing partially loaded UTXO set snapshot");
+                        break;
+                    }
+                }
+
+                // Fill the coinsviewdb from a snapshot instead of connecting all blocks again. Only
+                // done for an empty chainstate (new datadir or -reindex-chainstate), so that the
+                // option can be left in place for later restarts.
+                bool fLoadedSnapshot = false;
+                if (!fReset && gArgs.IsArgSet("-loadtxoutset") &&
+                    pcoinsdbview->GetBestBlock().IsNull() && pcoinsdbview->GetHeadBlocks().empty()) {
+                    uiInterface.InitMessage(_("Loading UTXO set snapshot..."));
+                    if (!LoadTxOutSet(AbsPathForConfigVal(fs::path(gArgs.GetArg("-loadtxoutset", ""))), pcoinsdbview.get(), chainparams)) {
+                        strLoadError = _("Error loading UTXO set snapshot");
+                        break;
+                    }
+                    fLoadedSnapshot = true;
+                }
+
                 // ReplayBlocks is a no-op if we cleared the coinsviewdb with -reindex or -reindex-chainstate
                 if (!ReplayBlocks(chainparams, pcoinsdbview.get())) {
                     strLoadError = _("Unable to replay blocks. You will need to rebuild the database using -reindex-chainstate.");
@@ -1504,7 +1680,7 @@ bool AppInitMain()
                 // The on-disk coinsdb is now in a good state, create the cache
                 pcoinsTip.reset(new CCoinsViewCache(pcoinscatcher.get()));
 
-                bool is_coinsview_empty = fReset || fReindexChainState || pcoinsTip->GetBestBlock().IsNull();
+                bool is_coinsview_empty = fReset || (fReindexChainState && !fLoadedSnapshot) || pcoinsTip->GetBestBlock().IsNull();
                 if (!is_coinsview_empty) {
                     // LoadChainTip sets chainActive based on pcoinsTip's best block
                     if (!LoadChainTip(chainparams)) {
@@ -1532,6 +1708,7 @@ bool AppInitMain()
                             MIN_BLOCKS_TO_KEEP);
                     }
 
+                    bool fSkipVerify = false;
                     {
                         LOCK(cs_main);
                         CBlockIndex* tip = chainActive.Tip();
@@ -1542,9 +1719,15 @@ bool AppInitMain()
                                     "Only rebuild the block database if you are sure that your computer's date and time are correct");
                             break;
                         }
+                        // After a clean shutdown at the current tip the blocks below it were
+                        // checked when they were connected, and nothing has touched them since.
+                        fSkipVerify = tip && tip->GetBlockHash() == hashCleanShutdownTip &&
+                                      !gArgs.IsArgSet("-checkblocks") && !gArgs.IsArgSet("-checklevel");
                     }
 
-                    if (!CVerifyDB().VerifyDB(chainparams, pcoinsdbview.get(), gArgs.GetArg("-checklevel", DEFAULT_CHECKLEVEL),
+                    if (fSkipVerify) {
+                        LogPrintf("Skipping block verification after a clean shutdown\n");
+                    } else if (!CVerifyDB().VerifyDB(chainparams, pcoinsdbview.get(), gArgs.GetArg("-checklevel", DEFAULT_CHECKLEVEL),
                                   gArgs.GetArg("-checkblocks", DEFAULT_CHECKBLOCKS))) {
                         strLoadError = _("Corrupted block database detected");
                         break;
@@ -1591,12 +1774,51 @@ bool AppInitMain()
         LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
     }
 
+    // Catch up on block index syncs deferred by -blocktreesyncinterval
+    if (gArgs.GetArg("-blocktreesyncinterval", DEFAULT_BLOCKTREE_SYNC_INTERVAL) > 0) {
+        scheduler.scheduleEvery([]{ pblocktree->SyncIfDue(); }, 1000);
+    }
+
+    // Keep mempool.dat up to date; this is a no-op until the mempool was loaded
+    if (gArgs.GetArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        scheduler.scheduleEvery([]{ AppendMempoolJournal(); }, MEMPOOL_JOURNAL_INTERVAL * 1000);
+    }
+
+    // Older versions kept the transaction index in the block index database,
+    // it now has a database of its own. TxIndex migrates the old entries when
+    // -txindex stays on, otherwise they are dropped.
+    bool fLegacyTxIndex = false;
+    if (!gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX) && pblocktree->ReadFlag("txindex", fLegacyTxIndex) && fLegacyTxIndex) {
+        LogPrintf("Erasing the transaction index from the block index database...\n");
+        if (!pblocktree->EraseLegacyTxIndex() || !pblocktree->WriteFlag("txindex", false)) {
+            return InitError(_("Failed to erase the old transaction index"));
+        }
+    }
+
+    // ********************************************************* Step 7b: start indexers
+    if (gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX)) {
+        g_txindex = MakeUnique<TxIndex>(nTxIndexCache, false, fReindex);
+        g_txindex->Start();
+    }
+    if (gArgs.GetBoolArg("-addrindex", DEFAULT_ADDRINDEX)) {
+        g_addrindex = MakeUnique<AddrIndex>(nAddrIndexCache, false, fReindex);
+        g_addrindex->Start();
+    }
+    if (fBlockFilterIndex) {
+        g_blockfilterindex = MakeUnique<BlockFilterIndex>(BlockFilterType::BASIC, nFilterIndexCache, false, fReindex);
+        g_blockfilterindex->Start();
+    }
+
     fs::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fsbridge::fopen(est_path, "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
     if (!est_filein.IsNull())
         ::feeEstimator.Read(est_filein);
     fFeeEstimatesInitialized = true;
+    // Save the estimates every block or so, rather than only at shutdown
+    scheduler.scheduleEvery([]{
+        if (::feeEstimator.ChangedSinceWrite()) WriteFeeEstimates();
+    }, FEE_ESTIMATES_WRITE_INTERVAL * 1000);
 
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
@@ -0,0 +1,39 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include <fs.h>
+
+#include <memory>
+#include <stddef.h>
+
+/**
+ * A read-only, shared memory mapping of a file. The length of the mapping is
+ * fixed to the size of the file when it was mapped; data appended later lies
+ * beyond size() and needs a new mapping to be read.
+ */
+class CMappedFile
+{
+public:
+    /** Map the file at path, or return nullptr if that fails or is not supported on this platform. */
+    static std::unique_ptr<const CMappedFile> Open(const fs::path& path);
+
+    ~CMappedFile();
+
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    CMappedFile(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+
+    const unsigned char* const m_data;
+    const size_t m_size;
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
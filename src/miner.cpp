@@ -41,6 +41,25 @@
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockWeight = 0;
 
+/**
+ * The transactions selected for the last block template, and what the
+ * selection depended on. While the tip and the options stay the same and
+ * the mempool has only gained transactions since (see
+ * CTxMemPool::StartTemplateJournal), the next template starts from this
+ * selection and only looks at the new packages. Protected by mempool.cs.
+ */
+struct LastTemplate {
+    uint256 hashPrevBlock;
+    unsigned int nBlockMaxWeight;
+    CFeeRate blockMinFeeRate;
+    bool fIncludeWitness;
+    int64_t nLockTimeCutoff;
+    std::vector<uint256> vTxHashes;
+    bool fSpaceLimited;
+    CFeeRate minPackageFeeRate;
+};
+static LastTemplate lastTemplate;
+
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -91,6 +110,8 @@ BlockAssembler::BlockAssembler(const CChainParams& params) : BlockAssembler(para
 void BlockAssembler::resetBlock()
 {
     inBlock.clear();
+    fSpaceLimited = false;
+    minPackageFeeRate = CFeeRate(MAX_MONEY);
 
     // Reserve space for coinbase tx
     nBlockWeight = 4000;
@@ -148,7 +169,10 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    std::vector<CTxMemPool::txiter> vCandidates;
+    const bool fResumed = addLastTemplateTxs(vCandidates);
+    const uint64_t nCarriedOver = nBlockTx;
+    addPackageTxs(nPackagesSelected, nDescendantsUpdated, fResumed ? &vCandidates : nullptr);
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -182,7 +206,20 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    lastTemplate.hashPrevBlock = pblock->hashPrevBlock;
+    lastTemplate.nBlockMaxWeight = nBlockMaxWeight;
+    lastTemplate.blockMinFeeRate = blockMinFeeRate;
+    lastTemplate.fIncludeWitness = fIncludeWitness;
+    lastTemplate.nLockTimeCutoff = nLockTimeCutoff;
+    lastTemplate.vTxHashes.clear();
+    for (size_t i = 1; i < pblock->vtx.size(); ++i) {
+        lastTemplate.vTxHashes.push_back(pblock->vtx[i]->GetHash());
+    }
+    lastTemplate.fSpaceLimited = fSpaceLimited;
+    lastTemplate.minPackageFeeRate = minPackageFeeRate;
+    mempool.StartTemplateJournal();
+
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants%s), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, fResumed ? strprintf(", %u txs carried over", nCarriedOver) : "", 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
     return std::move(pblocktemplate);
 }
@@ -297,6 +334,70 @@ void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemP
     std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
 }
 
+bool BlockAssembler::addLastTemplateTxs(std::vector<CTxMemPool::txiter>& vCandidates)
+{
+    if (lastTemplate.hashPrevBlock != chainActive.Tip()->GetBlockHash() ||
+            lastTemplate.nBlockMaxWeight != nBlockMaxWeight ||
+            lastTemplate.blockMinFeeRate != blockMinFeeRate ||
+            lastTemplate.fIncludeWitness != fIncludeWitness ||
+            lastTemplate.nLockTimeCutoff != nLockTimeCutoff) {
+        return false;
+    }
+    std::vector<uint256> vAdded;
+    if (!mempool.GetTemplateJournal(vAdded)) {
+        return false;
+    }
+
+    // Nothing left the mempool since, so all of the last selection is still there
+    std::vector<CTxMemPool::txiter> vSelected;
+    CTxMemPool::setEntries setSelected;
+    for (const uint256& hash : lastTemplate.vTxHashes) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            return false;
+        }
+        vSelected.push_back(it);
+        setSelected.insert(it);
+    }
+
+    // New transactions cannot change the ancestor feerate of those already
+    // in the mempool, so the last selection is still what we would choose
+    // first, unless a new package would have been selected ahead of a
+    // package that took the space it needs.
+    vCandidates.clear();
+    for (const uint256& hash : vAdded) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            return false;
+        }
+        if (lastTemplate.fSpaceLimited) {
+            CTxMemPool::setEntries ancestors;
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*it, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            uint64_t packageSize = it->GetSizeWithAncestors();
+            CAmount packageFees = it->GetModFeesWithAncestors();
+            for (CTxMemPool::txiter ancestor : ancestors) {
+                if (setSelected.count(ancestor)) {
+                    packageSize -= ancestor->GetTxSize();
+                    packageFees -= ancestor->GetModifiedFee();
+                }
+            }
+            if (CFeeRate(packageFees, packageSize) >= lastTemplate.minPackageFeeRate) {
+                return false;
+            }
+        }
+        vCandidates.push_back(it);
+    }
+
+    for (CTxMemPool::txiter it : vSelected) {
+        AddToBlock(it);
+    }
+    fSpaceLimited = lastTemplate.fSpaceLimited;
+    minPackageFeeRate = lastTemplate.minPackageFeeRate;
+    return true;
+}
+
 // This transaction selection algorithm orders the mempool based
 // on feerate of a transaction including all unconfirmed ancestors.
 // Since we don't remove transactions from the mempool as we select them
@@ -307,7 +408,10 @@ void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemP
 // Each time through the loop, we compare the best transaction in
 // mapModifiedTxs with the next transaction in the mempool to decide what
 // transaction package to work on next.
-void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated)
+// When continuing the last block template, only the new transactions take
+// the place of the mempool walk: every other package either was already
+// considered, or contains a new transaction or a descendant of the block.
+void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated, const std::vector<CTxMemPool::txiter>* vCandidates)
 {
     // mapModifiedTx will store sorted packages after they are modified
     // because some of their txs are already in the block
@@ -320,6 +424,14 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     UpdatePackagesForAdded(inBlock, mapModifiedTx);
 
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    if (vCandidates) {
+        for (CTxMemPool::txiter it : *vCandidates) {
+            if (!mapModifiedTx.count(it)) {
+                mapModifiedTx.insert(CTxMemPoolModifiedEntry(it));
+            }
+        }
+        mi = mempool.mapTx.get<ancestor_score>().end();
+    }
     CTxMemPool::txiter iter;
 
     // Limit the number of attempts to add transactions to the block when it is
@@ -382,6 +494,7 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         if (!TestPackage(packageSize, packageSigOpsCost)) {
+            fSpaceLimited = true;
             if (fUsingModified) {
                 // Since we always look at the best entry in mapModifiedTx,
                 // we must erase failed entries so that we can consider the
@@ -431,6 +544,7 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         ++nPackagesSelected;
+        minPackageFeeRate = std::min(minPackageFeeRate, CFeeRate(packageFees, packageSize));
 
         // Update transactions that depend on each of these
         nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
@@ -139,6 +139,10 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    // Whether a package was left out for lack of space, and the lowest
+    // feerate of the packages selected
+    bool fSpaceLimited;
+    CFeeRate minPackageFeeRate;
 
     // Chain context for the block
     int nHeight;
@@ -168,8 +172,15 @@ private:
     // Methods for how to add transactions to a block.
     /** Add transactions based on feerate including unconfirmed ancestors
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
-      * statistics from the package selection (for logging statistics). */
-    void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+      * statistics from the package selection (for logging statistics).
+      * If vCandidates is given, only packages of those transactions and of
+      * descendants of transactions in the block are considered, instead of
+      * every package in the mempool. */
+    void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated, const std::vector<CTxMemPool::txiter>* vCandidates = nullptr);
+    /** Add the transactions of the last block template, if selecting from
+      * the current mempool would still choose them, and fill vCandidates
+      * with the transactions that entered the mempool since. */
+    bool addLastTemplateTxs(std::vector<CTxMemPool::txiter>& vCandidates);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -681,6 +681,8 @@ public:
     // Set of transaction ids we still have to announce.
     // They are sorted by the mempool before relay, so the order is not important.
     std::set<uint256> setInventoryTxToSend;
+    // Set of package hashes we still have to announce, along with the transactions.
+    std::set<uint256> setInventoryPackageToSend;
     // List of block ids we still have announce.
     // There is no final sorting before sending, as they are always sent immediately
     // and in the order requested.
@@ -824,6 +826,10 @@ public:
             if (!filterInventoryKnown.contains(inv.hash)) {
                 setInventoryTxToSend.insert(inv.hash);
             }
+        } else if (inv.type == MSG_PACKAGE) {
+            if (!filterInventoryKnown.contains(inv.hash)) {
+                setInventoryPackageToSend.insert(inv.hash);
+            }
         } else if (inv.type == MSG_BLOCK) {
             vInventoryBlockToSend.push_back(inv.hash);
         }
@@ -8,9 +8,11 @@
 #include <addrman.h>
 #include <arith_uint256.h>
 #include <blockencodings.h>
+#include <blockfilter.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
+#include <index/blockfilterindex.h>
 #include <init.h>
 #include <validation.h>
 #include <merkleblock.h>
@@ -69,6 +71,13 @@ static const int STALE_RELAY_AGE_LIMIT = 30 * 24 * 60 * 60;
 /// limiting block relay. Set to one week, denominated in seconds.
 static const int HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
 
+/// Maximum number of compact filters that may be requested with one getcfilters. See BIP 157.
+static constexpr uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/// Maximum number of cf hashes that may be requested with one getcfheaders. See BIP 157.
+static constexpr uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+/// Interval between compact filter checkpoints. See BIP 157.
+static constexpr int CFCHECKPT_INTERVAL = 1000;
+
 // Internal stuff
 namespace {
     /** Number of nodes with fSyncStarted. */
@@ -106,6 +115,13 @@ namespace {
     std::unique_ptr<CRollingBloomFilter> recentRejects;
     uint256 hashRecentRejectsChainTip;
 
+    /**
+     * The transactions in recentRejects that were rejected only for their
+     * fee, and may still be accepted in a package whose child pays for them.
+     * Reset along with recentRejects.
+     */
+    std::unique_ptr<CRollingBloomFilter> recentRejectsReconsiderable;
+
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
     struct QueuedBlock {
         uint256 hash;
@@ -135,6 +151,12 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /** Packages we announced, by package hash, to answer getdata for them. Protected by cs_main. */
+    typedef std::map<uint256, std::vector<CTransactionRef>> MapRelayPackages;
+    MapRelayPackages mapRelayPackages;
+    /** Expiration-time ordered list of (expire time, relay package map entry) pairs, protected by cs_main. */
+    std::deque<std::pair<int64_t, MapRelayPackages::iterator>> vRelayPackageExpiration;
 } // namespace
 
 namespace {
@@ -206,6 +228,8 @@ struct CNodeState {
      * otherwise: whether this peer sends non-witnesses in cmpctblocks/blocktxns.
      */
     bool fSupportsDesiredCmpctVersion;
+    //! Whether this peer accepts pkgtxns messages.
+    bool fSupportsPackages;
 
     /** State used to enforce CHAIN_SYNC_TIMEOUT
       * Only in effect for outbound, non-manual connections, with
@@ -259,6 +283,7 @@ struct CNodeState {
         fHaveWitness = false;
         fWantsCmpctWitness = false;
         fSupportsDesiredCmpctVersion = false;
+        fSupportsPackages = false;
         m_chain_sync = { 0, nullptr, false, false };
         m_last_block_announcement = 0;
     }
@@ -633,6 +658,40 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     return true;
 }
 
+bool FetchBlock(CConnman* connman, NodeId nodeid, const CBlockIndex* pindex, std::string& strError)
+{
+    const uint256& hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_main);
+        CNodeState *state = State(nodeid);
+        if (state == nullptr) {
+            strError = "Peer does not exist";
+            return false;
+        }
+        // Blocks are always fetched with their witness data
+        if (!state->fHaveWitness) {
+            strError = "Peer does not serve witness data";
+            return false;
+        }
+        // A block in flight is processed when it arrives, whether or not it is a candidate for the tip
+        MarkBlockAsInFlight(nodeid, hash, pindex);
+    }
+
+    bool fSent = connman->ForNode(nodeid, [&](CNode* pnode) {
+        const CNetMsgMaker msgMaker(pnode->GetSendVersion());
+        connman->PushMessage(pnode, msgMaker.Make(NetMsgType::GETDATA, std::vector<CInv>{CInv(MSG_BLOCK | MSG_WITNESS_FLAG, hash)}));
+        return true;
+    });
+    if (!fSent) {
+        LOCK(cs_main);
+        MarkBlockAsReceived(hash);
+        strError = "Peer does not exist";
+        return false;
+    }
+    LogPrint(BCLog::NET, "Requested block %s from peer=%d\n", hash.ToString(), nodeid);
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
@@ -808,6 +867,7 @@ static bool BlockRequestAllowed(const CBlockIndex* pindex, const Consensus::Para
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &scheduler) : connman(connmanIn), m_stale_tip_check_time(0) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    recentRejectsReconsiderable.reset(new CRollingBloomFilter(120000, 0.000001));
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
     // Stale tip checking and peer eviction are on two different timers, but we
@@ -991,6 +1051,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     {
     case MSG_TX:
     case MSG_WITNESS_TX:
+    case MSG_PACKAGE:
         {
             assert(recentRejects);
             if (chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip)
@@ -1001,6 +1062,11 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 // txs a second chance.
                 hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
                 recentRejects->reset();
+                recentRejectsReconsiderable->reset();
+            }
+
+            if (inv.type == MSG_PACKAGE) {
+                return recentRejects->contains(inv.hash) || mapRelayPackages.count(inv.hash);
             }
 
             {
@@ -1030,6 +1096,50 @@ static void RelayTransaction(const CTransaction& tx, CConnman* connman)
     });
 }
 
+/** The hash a package is announced and requested by: that of the wtxids of its transactions, in order */
+static uint256 GetPackageHash(const std::vector<CTransactionRef>& package)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    for (const CTransactionRef& tx : package) {
+        ss << tx->GetWitnessHash();
+    }
+    return ss.GetHash();
+}
+
+void RelayPackage(const std::vector<CTransactionRef>& package, CConnman* connman)
+{
+    LOCK(cs_main);
+    const uint256 hashPackage = GetPackageHash(package);
+    const int64_t nNow = GetTimeMicros();
+
+    // Expire old relay packages
+    while (!vRelayPackageExpiration.empty() && vRelayPackageExpiration.front().first < nNow) {
+        mapRelayPackages.erase(vRelayPackageExpiration.front().second);
+        vRelayPackageExpiration.pop_front();
+    }
+    auto ret = mapRelayPackages.insert(std::make_pair(hashPackage, package));
+    if (ret.second) {
+        vRelayPackageExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
+    }
+
+    const CInv invPackage(MSG_PACKAGE, hashPackage);
+    connman->ForEachNode([&package, &invPackage](CNode* pnode)
+    {
+        CNodeState* state = State(pnode->GetId());
+        if (state != nullptr && state->fSupportsPackages) {
+            // Don't announce the transactions of the package separately as well
+            for (const CTransactionRef& tx : package) {
+                pnode->AddInventoryKnown(CInv(MSG_TX, tx->GetHash()));
+            }
+            pnode->PushInventory(invPackage);
+        } else {
+            for (const CTransactionRef& tx : package) {
+                pnode->PushInventory(CInv(MSG_TX, tx->GetHash()));
+            }
+        }
+    });
+}
+
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connman)
 {
     unsigned int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
@@ -1137,6 +1247,14 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
         std::shared_ptr<const CBlock> pblock;
         if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
             pblock = a_recent_block;
+        } else if (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
+            // Fast-path: send the block as serialized on disk, without deserializing it
+            CSerializedNetMsg msg;
+            msg.command = NetMsgType::BLOCK;
+            if (!ReadRawBlockFromDisk(msg.data, (*mi).second, Params().MessageStart(), inv.type == MSG_WITNESS_BLOCK))
+                assert(!"cannot load block from disk");
+            connman->PushMessage(pfrom, std::move(msg));
+            // Don't set pblock as we've sent the block
         } else {
             // Send block from disk
             std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
@@ -1144,7 +1262,9 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
                 assert(!"cannot load block from disk");
             pblock = pblockRead;
         }
-        if (inv.type == MSG_BLOCK)
+        if (!pblock) {
+            // Already sent above
+        } else if (inv.type == MSG_BLOCK)
             connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
         else if (inv.type == MSG_WITNESS_BLOCK)
             connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
@@ -1218,7 +1338,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     {
         LOCK(cs_main);
 
-        while (it != pfrom->vRecvGetData.end() && (it->type == MSG_TX || it->type == MSG_WITNESS_TX)) {
+        while (it != pfrom->vRecvGetData.end() && (it->type == MSG_TX || it->type == MSG_WITNESS_TX || it->type == MSG_PACKAGE)) {
             if (interruptMsgProc)
                 return;
             // Don't bother if send buffer is too full to respond anyway
@@ -1228,6 +1348,17 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             const CInv &inv = *it;
             it++;
 
+            if (inv.type == MSG_PACKAGE) {
+                auto mi = mapRelayPackages.find(inv.hash);
+                if (mi != mapRelayPackages.end()) {
+                    int nSendFlags = State(pfrom->GetId())->fHaveWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::PKGTXNS, mi->second));
+                } else {
+                    vNotFound.push_back(inv);
+                }
+                continue;
+            }
+
             // Send stream from relay memory
             bool push = false;
             auto mi = mapRelay.find(inv.hash);
@@ -1520,6 +1651,247 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
     return true;
 }
 
+/**
+ * Validate that a compact filter request from a peer is one we serve, and
+ * look up its stop block. Peers asking for filters we do not advertise, or
+ * for ranges beyond the protocol limits, are disconnected.
+ *
+ * @param[in]   pfrom           The peer that we received the request from
+ * @param[in]   chain_params    Chain parameters
+ * @param[in]   filter_type     The filter type the request is for. Must be basic filters.
+ * @param[in]   start_height    The start height for the request
+ * @param[in]   stop_hash       The stop_hash for the request
+ * @param[in]   max_height_diff The maximum number of items permitted to request, as specified in BIP 157
+ * @param[out]  stop_index      The CBlockIndex for the stop_hash block, if the request can be serviced.
+ * @return                      True if the request can be serviced.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, const CChainParams& chain_params,
+                                      uint8_t filter_type, uint32_t start_height,
+                                      const uint256& stop_hash, uint32_t max_height_diff,
+                                      const CBlockIndex*& stop_index)
+{
+    const bool supported_filter_type =
+        (static_cast<BlockFilterType>(filter_type) == BlockFilterType::BASIC &&
+         (pfrom->GetLocalServices() & NODE_COMPACT_FILTERS) && g_blockfilterindex);
+    if (!supported_filter_type) {
+        LogPrint(BCLog::NET, "peer %d requested unsupported block filter type: %d\n",
+                 pfrom->GetId(), filter_type);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(stop_hash);
+        stop_index = it == mapBlockIndex.end() ? nullptr : it->second;
+
+        // Check that the stop block exists and the peer would be allowed to fetch it.
+        if (!stop_index || !BlockRequestAllowed(stop_index, chain_params.GetConsensus())) {
+            LogPrint(BCLog::NET, "peer %d requested invalid block hash: %s\n",
+                     pfrom->GetId(), stop_hash.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+    }
+
+    uint32_t stop_height = stop_index->nHeight;
+    if (start_height > stop_height) {
+        LogPrint(BCLog::NET, "peer %d sent invalid getcfilters/getcfheaders with " /* Continued */
+                 "start height %d and stop height %d\n",
+                 pfrom->GetId(), start_height, stop_height);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    if (stop_height - start_height >= max_height_diff) {
+        LogPrint(BCLog::NET, "peer %d requested too many cfilters/cfheaders: %d / %d\n",
+                 pfrom->GetId(), stop_height - start_height + 1, max_height_diff);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    return true;
+}
+
+/** Handle a getcfilters request by sending one cfilter message per block in the range. */
+static void ProcessGetCFilters(CNode* pfrom, CDataStream& vRecv, const CChainParams& chain_params,
+                               CConnman* connman)
+{
+    uint8_t filter_type;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type >> start_height >> stop_hash;
+
+    const CBlockIndex* stop_index;
+    if (!PrepareBlockFilterRequest(pfrom, chain_params, filter_type, start_height, stop_hash,
+                                   MAX_GETCFILTERS_SIZE, stop_index)) {
+        return;
+    }
+
+    std::vector<BlockFilter> filters;
+    if (!g_blockfilterindex->LookupFilterRange(start_height, stop_index, filters)) {
+        LogPrint(BCLog::NET, "Failed to find block filter in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(g_blockfilterindex->GetFilterType()), start_height, stop_hash.ToString());
+        return;
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (const BlockFilter& filter : filters) {
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
+
+/** Handle a getcfheaders request by sending the filter header before the range and the filter hashes in it. */
+static void ProcessGetCFHeaders(CNode* pfrom, CDataStream& vRecv, const CChainParams& chain_params,
+                                CConnman* connman)
+{
+    uint8_t filter_type;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type >> start_height >> stop_hash;
+
+    const CBlockIndex* stop_index;
+    if (!PrepareBlockFilterRequest(pfrom, chain_params, filter_type, start_height, stop_hash,
+                                   MAX_GETCFHEADERS_SIZE, stop_index)) {
+        return;
+    }
+
+    uint256 prev_header;
+    if (start_height > 0) {
+        const CBlockIndex* const prev_block = stop_index->GetAncestor(static_cast<int>(start_height - 1));
+        if (!g_blockfilterindex->LookupFilterHeader(prev_block, prev_header)) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(g_blockfilterindex->GetFilterType()), prev_block->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    std::vector<uint256> filter_hashes;
+    if (!g_blockfilterindex->LookupFilterHashRange(start_height, stop_index, filter_hashes)) {
+        LogPrint(BCLog::NET, "Failed to find block filter hashes in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(g_blockfilterindex->GetFilterType()), start_height, stop_hash.ToString());
+        return;
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFHEADERS,
+                                              filter_type,
+                                              stop_index->GetBlockHash(),
+                                              prev_header,
+                                              filter_hashes));
+}
+
+/** Handle a getcfcheckpt request by sending the filter headers at every CFCHECKPT_INTERVAL blocks up to the stop block. */
+static void ProcessGetCFCheckPt(CNode* pfrom, CDataStream& vRecv, const CChainParams& chain_params,
+                                CConnman* connman)
+{
+    uint8_t filter_type;
+    uint256 stop_hash;
+
+    vRecv >> filter_type >> stop_hash;
+
+    const CBlockIndex* stop_index;
+    if (!PrepareBlockFilterRequest(pfrom, chain_params, filter_type, /*start_height=*/0, stop_hash,
+                                   /*max_height_diff=*/std::numeric_limits<uint32_t>::max(), stop_index)) {
+        return;
+    }
+
+    std::vector<uint256> headers(stop_index->nHeight / CFCHECKPT_INTERVAL);
+
+    // Populate headers.
+    const CBlockIndex* block_index = stop_index;
+    for (int i = headers.size() - 1; i >= 0; i--) {
+        int height = (i + 1) * CFCHECKPT_INTERVAL;
+        block_index = block_index->GetAncestor(height);
+
+        if (!g_blockfilterindex->LookupFilterHeader(block_index, headers[i])) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(g_blockfilterindex->GetFilterType()), block_index->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFCHECKPT,
+                                              filter_type,
+                                              stop_index->GetBlockHash(),
+                                              headers));
+}
+
+/**
+ * Retry the orphans spending the outpoints in vWorkQueue, which were just
+ * created by transactions added to the mempool, and in turn those spending
+ * the outputs of the orphans accepted.
+ */
+void static ProcessOrphanTx(CConnman* connman, std::deque<COutPoint>& vWorkQueue, std::list<CTransactionRef>& lRemovedTxn) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(g_cs_orphans);
+    std::vector<uint256> vEraseQueue;
+    std::set<NodeId> setMisbehaving;
+    while (!vWorkQueue.empty()) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
+        vWorkQueue.pop_front();
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi = itByPrev->second.begin();
+             mi != itByPrev->second.end();
+             ++mi)
+        {
+            const CTransactionRef& porphanTx = (*mi)->second.tx;
+            const CTransaction& orphanTx = *porphanTx;
+            const uint256& orphanHash = orphanTx.GetHash();
+            NodeId fromPeer = (*mi)->second.fromPeer;
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (setMisbehaving.count(fromPeer))
+                continue;
+            if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
+                LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphanTx, connman);
+                for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
+                    vWorkQueue.emplace_back(orphanHash, i);
+                }
+                vEraseQueue.push_back(orphanHash);
+            }
+            else if (!fMissingInputs2)
+            {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee
+                LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
+                vEraseQueue.push_back(orphanHash);
+                if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
+                    // Do not use rejection cache for witness transactions or
+                    // witness-stripped transactions, as they can have been malleated.
+                    // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                    if (stateDummy.GetRejectCode() == REJECT_INSUFFICIENTFEE) {
+                        recentRejectsReconsiderable->insert(orphanHash);
+                    }
+                }
+            }
+            mempool.check(pcoinsTip.get());
+        }
+    }
+
+    for (uint256 hash : vEraseQueue)
+        EraseOrphanTx(hash);
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
@@ -1796,6 +2168,11 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             nCMPCTBLOCKVersion = 1;
             connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion));
         }
+        if (fRelayTxes) {
+            // Tell our peer we accept transaction packages. Peers that
+            // don't know the message ignore it.
+            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::SENDPACKAGES));
+        }
         pfrom->fSuccessfullyConnected = true;
     }
 
@@ -1863,6 +2240,12 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
+    else if (strCommand == NetMsgType::SENDPACKAGES)
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fSupportsPackages = true;
+    }
+
     else if (strCommand == NetMsgType::SENDCMPCT)
     {
         bool fAnnounceUsingCMPCTBLOCK = false;
@@ -2143,6 +2526,24 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     }
 
 
+    else if (strCommand == NetMsgType::GETCFILTERS)
+    {
+        ProcessGetCFilters(pfrom, vRecv, chainparams, connman);
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFHEADERS)
+    {
+        ProcessGetCFHeaders(pfrom, vRecv, chainparams, connman);
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT)
+    {
+        ProcessGetCFCheckPt(pfrom, vRecv, chainparams, connman);
+    }
+
+
     else if (strCommand == NetMsgType::TX)
     {
         // Stop processing the transaction early if
@@ -2154,7 +2555,6 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
 
         std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransactionRef ptx;
         vRecv >> ptx;
         const CTransaction& tx = *ptx;
@@ -2162,6 +2562,17 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify the scripts of a new transaction before taking the locks
+        // for AcceptToMemoryPool, which then mostly hits the signature cache.
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        if (!fAlreadyHave) {
+            PrevalidateTransactions(mempool, {ptx});
+        }
+
         LOCK2(cs_main, g_cs_orphans);
 
         bool fMissingInputs = false;
@@ -2188,65 +2599,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
             // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
-                        LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee
-                        LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness transactions or
-                            // witness-stripped transactions, as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip.get());
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+            ProcessOrphanTx(connman, vWorkQueue, lRemovedTxn);
         }
         else if (fMissingInputs)
         {
@@ -2285,6 +2638,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
                 assert(recentRejects);
                 recentRejects->insert(tx.GetHash());
+                if (state.GetRejectCode() == REJECT_INSUFFICIENTFEE) {
+                    // A child may still pay for it in a package
+                    recentRejectsReconsiderable->insert(tx.GetHash());
+                }
                 if (RecursiveDynamicUsage(*ptx) < 100000) {
                     AddToCompactExtraTransactions(ptx);
                 }
@@ -2330,6 +2687,122 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     }
 
 
+    else if (strCommand == NetMsgType::PKGTXNS)
+    {
+        // Same as for single transactions in blocks only mode
+        if (!fRelayTxes && (!pfrom->fWhitelisted || !gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY)))
+        {
+            LogPrint(BCLog::NET, "package sent in violation of protocol peer=%d\n", pfrom->GetId());
+            return true;
+        }
+
+        std::vector<CTransactionRef> package;
+        vRecv >> package;
+
+        if (package.size() > MAX_PACKAGE_COUNT) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), 20, strprintf("pkgtxns message size = %u", package.size()));
+            return false;
+        }
+
+        const uint256 hashPackage = GetPackageHash(package);
+        const CInv invPackage(MSG_PACKAGE, hashPackage);
+        pfrom->AddInventoryKnown(invPackage);
+        for (const CTransactionRef& ptx : package) {
+            pfrom->AddInventoryKnown(CInv(MSG_TX, ptx->GetHash()));
+        }
+
+        // Weed out what can be turned down without any script work: packages
+        // we already have or rejected, malformed ones, and those with members
+        // rejected on their own for anything but their fee. What is left is
+        // only prevalidated if some of it is new to the mempool.
+        std::vector<CTransactionRef> vNew;
+        {
+            LOCK(cs_main);
+            pfrom->setAskFor.erase(hashPackage);
+            mapAlreadyAskedFor.erase(hashPackage);
+            if (AlreadyHave(invPackage)) {
+                return true;
+            }
+
+            CValidationState state;
+            if (!CheckPackage(package, state)) {
+                LogPrint(BCLog::MEMPOOLREJ, "package of %u txn from peer=%d was not accepted: %s\n",
+                    package.size(), pfrom->GetId(), FormatStateMessage(state));
+                recentRejects->insert(hashPackage);
+                return true;
+            }
+            for (const CTransactionRef& ptx : package) {
+                if (recentRejects->contains(ptx->GetHash()) && !recentRejectsReconsiderable->contains(ptx->GetHash())) {
+                    LogPrint(BCLog::MEMPOOLREJ, "package of %u txn from peer=%d was not accepted: tx %s was rejected before\n",
+                        package.size(), pfrom->GetId(), ptx->GetHash().ToString());
+                    recentRejects->insert(hashPackage);
+                    return true;
+                }
+                if (!mempool.exists(ptx->GetHash())) vNew.push_back(ptx);
+            }
+        }
+        if (vNew.empty()) {
+            return true;
+        }
+        PrevalidateTransactions(mempool, vNew);
+
+        LOCK2(cs_main, g_cs_orphans);
+
+        bool fMissingInputs = false;
+        CValidationState state;
+        PackageAcceptResult result;
+        for (const CTransactionRef& ptx : package) {
+            pfrom->setAskFor.erase(ptx->GetHash());
+            mapAlreadyAskedFor.erase(ptx->GetHash());
+        }
+
+        if (AlreadyHave(invPackage)) {
+            return true;
+        }
+
+        if (AcceptPackageToMemoryPool(mempool, state, package, &fMissingInputs, 0 /* nAbsurdFee */,
+                                      false /* test_accept */, result)) {
+            mempool.check(pcoinsTip.get());
+            RelayPackage(package, connman);
+
+            pfrom->nLastTXTime = GetTime();
+
+            LogPrint(BCLog::MEMPOOL, "AcceptPackageToMemoryPool: peer=%d: accepted package of %u txn at %s (poolsz %u txn, %u kB)\n",
+                pfrom->GetId(), package.size(),
+                CFeeRate(result.nFees, result.nVSize).ToString(),
+                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
+
+            // Process any orphan transactions that depended on the package
+            std::deque<COutPoint> vWorkQueue;
+            std::list<CTransactionRef> lRemovedTxn;
+            for (const CTransactionRef& ptx : vNew) {
+                EraseOrphanTx(ptx->GetHash());
+                for (unsigned int i = 0; i < ptx->vout.size(); i++) {
+                    vWorkQueue.emplace_back(ptx->GetHash(), i);
+                }
+            }
+            ProcessOrphanTx(connman, vWorkQueue, lRemovedTxn);
+            for (const CTransactionRef& removedTx : lRemovedTxn)
+                AddToCompactExtraTransactions(removedTx);
+        } else {
+            int nDoS = 0;
+            LogPrint(BCLog::MEMPOOLREJ, "package of %u txn from peer=%d was not accepted: %s%s\n",
+                package.size(), pfrom->GetId(), fMissingInputs ? "missing inputs" : FormatStateMessage(state),
+                result.nFailedTx < package.size() ? strprintf(" (tx %s)", package[result.nFailedTx]->GetHash().ToString()) : "");
+            // A failed package says nothing about its transactions on their
+            // own, so only the package itself is remembered as rejected; one
+            // with missing inputs may be fine once they arrive.
+            if (!fMissingInputs) {
+                recentRejects->insert(hashPackage);
+            }
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
     else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlockHeaderAndShortTxIDs cmpctblock;
@@ -3170,23 +3643,6 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params
     }
 }
 
-class CompareInvMempoolOrder
-{
-    CTxMemPool *mp;
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
-    {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
-    }
-};
-
 bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptMsgProc)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -3474,12 +3930,15 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) {
+                    pto->setInventoryTxToSend.clear();
+                    pto->setInventoryPackageToSend.clear();
+                }
             }
 
             // Respond to BIP35 mempool requests
             if (fSendTrickle && pto->fSendMempool) {
-                auto vtxinfo = mempool.infoAll();
+                std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
                 pto->fSendMempool = false;
                 CAmount filterrate = 0;
                 {
@@ -3489,7 +3948,8 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
                 LOCK(pto->cs_filter);
 
-                for (const auto& txinfo : vtxinfo) {
+                for (const CTxMemPoolSnapshot::Entry& entry : snapshot->vEntries) {
+                    const TxMempoolInfo txinfo = entry.GetInfo();
                     const uint256& hash = txinfo.tx->GetHash();
                     CInv inv(MSG_TX, hash);
                     pto->setInventoryTxToSend.erase(hash);
@@ -3512,42 +3972,37 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
+                // Copy all candidates for sending out of the mempool in one go. The
+                // snapshot is sorted topologically and by fee-rate, the order we
+                // send inventory in for privacy and priority reasons.
+                std::vector<uint256> vInvTx(pto->setInventoryTxToSend.begin(), pto->setInventoryTxToSend.end());
+                std::unique_ptr<CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot(vInvTx, false);
+                // Not in the mempool anymore? don't bother sending it.
+                if (snapshot->vEntries.size() < vInvTx.size()) {
+                    uint32_t index;
+                    for (const uint256& hash : vInvTx) {
+                        if (!snapshot->Find(hash, index)) pto->setInventoryTxToSend.erase(hash);
+                    }
                 }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
+                for (const CTxMemPoolSnapshot::Entry& entry : snapshot->vEntries) {
+                    if (nRelayedTransactions >= INVENTORY_BROADCAST_MAX) break;
+                    uint256 hash = entry.tx->GetHash();
                     // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                    pto->setInventoryTxToSend.erase(hash);
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
                         continue;
                     }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
+                    auto txinfo = entry.GetInfo();
                     if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
                         continue;
                     }
@@ -3574,6 +4029,20 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                     }
                     pto->filterInventoryKnown.insert(hash);
                 }
+
+                // Packages go out along with the transactions
+                for (const uint256& hash : pto->setInventoryPackageToSend) {
+                    if (pto->filterInventoryKnown.contains(hash)) {
+                        continue;
+                    }
+                    vInv.push_back(CInv(MSG_PACKAGE, hash));
+                    if (vInv.size() == MAX_INV_SZ) {
+                        connman->PushMessage(pto, msgMaker.Make(NetMsgType::INV, vInv));
+                        vInv.clear();
+                    }
+                    pto->filterInventoryKnown.insert(hash);
+                }
+                pto->setInventoryPackageToSend.clear();
             }
         }
         if (!vInv.empty())
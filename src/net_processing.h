@@ -96,5 +96,9 @@ struct CNodeStateStats {
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch, const std::string& message="");
+/** Announce a package to the peers that accept them, and its transactions one by one to all other peers. */
+void RelayPackage(const std::vector<CTransactionRef>& package, CConnman* connman);
+/** Request a block, e.g. one that was pruned, from a peer. It is stored when it arrives even if it is not on a better chain. */
+bool FetchBlock(CConnman* connman, NodeId nodeid, const CBlockIndex* pindex, std::string& strError);
 
 #endif // BITCOIN_NET_PROCESSING_H
@@ -12,8 +12,22 @@
 #include <txmempool.h>
 #include <util.h>
 
+#include <algorithm>
+
 static constexpr double INF_FEERATE = 1e99;
 
+/** Version required to read estimates that keep the per-period counters as vectors of vectors */
+static constexpr int FEE_ESTIMATES_NESTED_VERSION = 149900;
+/** Version required to read estimates that keep them as one flat array per horizon */
+static constexpr int FEE_ESTIMATES_FLAT_VERSION = 1000100;
+static_assert(FEE_ESTIMATES_FLAT_VERSION <= CLIENT_VERSION, "fee estimates must be readable by the client writing them");
+/**
+ * Layout of estimates written for FEE_ESTIMATES_FLAT_VERSION or later readers,
+ * stored after the version header and matched exactly, so that the layout
+ * does not depend on what CLIENT_VERSION happens to be.
+ */
+static constexpr uint32_t FEE_ESTIMATES_FORMAT_FLAT = 1;
+
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
         {FeeEstimateHorizon::SHORT_HALFLIFE, "short"},
@@ -74,7 +88,13 @@ class TxConfirmStats
 private:
     //Define the buckets we will group transactions into
     const std::vector<double>& buckets;              // The upper-bound of the range for the bucket (inclusive)
-    const std::map<double, unsigned int>& bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    // Number of buckets of the counters below, which may be read before buckets is updated
+    size_t nBuckets;
+    // Number of periods confirmations are tracked for
+    unsigned int maxPeriods;
+
+    // The per-period counters are flat arrays of maxPeriods rows of nBuckets,
+    // so that decaying them and summing a row are single sequential passes.
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -83,11 +103,11 @@ private:
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double>> confAvg; // confAvg[Y][X]
+    std::vector<double> confAvg; // confAvg[Y * nBuckets + X]
 
     // Track moving avg of txs which have been evicted from the mempool
     // after failing to be confirmed within Y blocks
-    std::vector<std::vector<double>> failAvg; // failAvg[Y][X]
+    std::vector<double> failAvg; // failAvg[Y * nBuckets + X]
 
     // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -104,7 +124,7 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  //unconfTxs[Y * nBuckets + X]
     // transactions still unconfirmed after GetMaxConfirms for each bucket
     std::vector<int> oldUnconfTxs;
 
@@ -118,8 +138,7 @@ public:
      * @param maxPeriods max number of periods to track
      * @param decay how much to decay the historical moving average per block
      */
-    TxConfirmStats(const std::vector<double>& defaultBuckets, const std::map<double, unsigned int>& defaultBucketMap,
-                   unsigned int maxPeriods, double decay, unsigned int scale);
+    TxConfirmStats(const std::vector<double>& defaultBuckets, unsigned int maxPeriods, double decay, unsigned int scale);
 
     /** Roll the circular buffer for unconfirmed txs*/
     void ClearCurrent(unsigned int nBlockHeight);
@@ -127,13 +146,14 @@ public:
     /**
      * Record a new transaction data point in the current block stats
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
+     * @param bucketindex the bucket of the feerate of the transaction
      * @param val the feerate of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
      */
-    void Record(int blocksToConfirm, double val);
+    void Record(int blocksToConfirm, unsigned int bucketindex, double val);
 
     /** Record a new transaction entering the mempool*/
-    unsigned int NewTx(unsigned int nBlockHeight, double val);
+    void NewTx(unsigned int nBlockHeight, unsigned int bucketindex);
 
     /** Remove a transaction from mempool tracking stats*/
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
@@ -159,70 +179,60 @@ public:
                              EstimationResult *result = nullptr) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() const { return scale * confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return scale * maxPeriods; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout) const;
 
     /**
      * Read saved state of estimation data from a file and replace all internal data structures and
-     * variables with this state.
+     * variables with this state. fFlat tells the layout of the file.
      */
-    void Read(CAutoFile& filein, int nFileVersion, size_t numBuckets);
+    void Read(CAutoFile& filein, bool fFlat, size_t numBuckets);
 };
 
 
 TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets,
-                                const std::map<double, unsigned int>& defaultBucketMap,
-                               unsigned int maxPeriods, double _decay, unsigned int _scale)
-    : buckets(defaultBuckets), bucketMap(defaultBucketMap)
+                               unsigned int _maxPeriods, double _decay, unsigned int _scale)
+    : buckets(defaultBuckets), nBuckets(defaultBuckets.size()), maxPeriods(_maxPeriods)
 {
     decay = _decay;
     assert(_scale != 0 && "_scale must be non-zero");
     scale = _scale;
-    confAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        confAvg[i].resize(buckets.size());
-    }
-    failAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        failAvg[i].resize(buckets.size());
-    }
+    confAvg.resize(maxPeriods * nBuckets);
+    failAvg.resize(maxPeriods * nBuckets);
 
-    txCtAvg.resize(buckets.size());
-    avg.resize(buckets.size());
+    txCtAvg.resize(nBuckets);
+    avg.resize(nBuckets);
 
-    resizeInMemoryCounters(buckets.size());
+    resizeInMemoryCounters(nBuckets);
 }
 
 void TxConfirmStats::resizeInMemoryCounters(size_t newbuckets) {
     // newbuckets must be passed in because the buckets referred to during Read have not been updated yet.
-    unconfTxs.resize(GetMaxConfirms());
-    for (unsigned int i = 0; i < unconfTxs.size(); i++) {
-        unconfTxs[i].resize(newbuckets);
-    }
-    oldUnconfTxs.resize(newbuckets);
+    unconfTxs.assign(GetMaxConfirms() * newbuckets, 0);
+    oldUnconfTxs.assign(newbuckets, 0);
 }
 
 // Roll the unconfirmed txs circular buffer
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
+    int* current = &unconfTxs[(nBlockHeight % GetMaxConfirms()) * nBuckets];
+    for (unsigned int j = 0; j < nBuckets; j++) {
+        oldUnconfTxs[j] += current[j];
+        current[j] = 0;
     }
 }
 
 
-void TxConfirmStats::Record(int blocksToConfirm, double val)
+void TxConfirmStats::Record(int blocksToConfirm, unsigned int bucketindex, double val)
 {
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
     int periodsToConfirm = (blocksToConfirm + scale - 1)/scale;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = periodsToConfirm; i <= confAvg.size(); i++) {
-        confAvg[i - 1][bucketindex]++;
+    for (size_t i = periodsToConfirm; i <= maxPeriods; i++) {
+        confAvg[(i - 1) * nBuckets + bucketindex]++;
     }
     txCtAvg[bucketindex]++;
     avg[bucketindex] += val;
@@ -230,14 +240,10 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay;
-        for (unsigned int i = 0; i < failAvg.size(); i++)
-            failAvg[i][j] = failAvg[i][j] * decay;
-        avg[j] = avg[j] * decay;
-        txCtAvg[j] = txCtAvg[j] * decay;
-    }
+    for (double& v : confAvg) v *= decay;
+    for (double& v : failAvg) v *= decay;
+    for (double& v : avg) v *= decay;
+    for (double& v : txCtAvg) v *= decay;
 }
 
 // returns -1 on error conditions
@@ -252,7 +258,20 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     double failNum = 0; // Number of tx's that were never confirmed but removed from the mempool after confTarget
     int periodTarget = (confTarget + scale - 1)/scale;
 
-    int maxbucketindex = buckets.size() - 1;
+    int maxbucketindex = nBuckets - 1;
+
+    // The txs still in the mempool for confTarget or longer, summed by bucket
+    // a row of the circular buffer at a time
+    unsigned int bins = GetMaxConfirms();
+    std::vector<int> unconfByBucket(oldUnconfTxs);
+    for (unsigned int confct = confTarget; confct < bins; confct++) {
+        const int* row = &unconfTxs[((nBlockHeight - confct) % bins) * nBuckets];
+        for (size_t j = 0; j < nBuckets; j++) {
+            unconfByBucket[j] += row[j];
+        }
+    }
+    const double* confRow = &confAvg[(periodTarget - 1) * nBuckets];
+    const double* failRow = &failAvg[(periodTarget - 1) * nBuckets];
 
     // requireGreater means we are looking for the lowest feerate such that all higher
     // values pass, so we start at maxbucketindex (highest feerate) and look at successively
@@ -272,7 +291,6 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
     bool newBucketRange = true;
     bool passing = true;
     EstimatorBucket passBucket;
@@ -285,12 +303,10 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
             newBucketRange = false;
         }
         curFarBucket = bucket;
-        nConf += confAvg[periodTarget - 1][bucket];
+        nConf += confRow[bucket];
         totalNum += txCtAvg[bucket];
-        failNum += failAvg[periodTarget - 1][bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
-        extraNum += oldUnconfTxs[bucket];
+        failNum += failRow[bucket];
+        extraNum += unconfByBucket[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
         // (Only count the confirmed data points, so that each confirmation count
@@ -397,18 +413,19 @@ void TxConfirmStats::Write(CAutoFile& fileout) const
 {
     fileout << decay;
     fileout << scale;
+    fileout << maxPeriods;
     fileout << avg;
     fileout << txCtAvg;
     fileout << confAvg;
     fileout << failAvg;
 }
 
-void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets)
+void TxConfirmStats::Read(CAutoFile& filein, bool fFlat, size_t numBuckets)
 {
     // Read data file and do some very basic sanity checking
-    // buckets and bucketMap are not updated yet, so don't access them
+    // buckets are not updated yet, so don't access them
     // If there is a read failure, we'll just discard this entire object anyway
-    size_t maxConfirms, maxPeriods;
+    size_t maxConfirms;
 
     // The current version will store the decay with each individual TxConfirmStats and also keep a scale factor
     filein >> decay;
@@ -419,6 +436,9 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
     if (scale == 0) {
         throw std::runtime_error("Corrupt estimates file. Scale must be non-zero");
     }
+    if (fFlat) {
+        filein >> maxPeriods;
+    }
 
     filein >> avg;
     if (avg.size() != numBuckets) {
@@ -428,43 +448,57 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
     if (txCtAvg.size() != numBuckets) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     }
-    filein >> confAvg;
-    maxPeriods = confAvg.size();
-    maxConfirms = scale * maxPeriods;
 
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
-        throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    }
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (confAvg[i].size() != numBuckets) {
+    if (fFlat) {
+        filein >> confAvg;
+        if (confAvg.size() != maxPeriods * numBuckets) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
         }
-    }
-
-    filein >> failAvg;
-    if (maxPeriods != failAvg.size()) {
-        throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
-    }
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (failAvg[i].size() != numBuckets) {
+        filein >> failAvg;
+        if (failAvg.size() != maxPeriods * numBuckets) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in one of failure average bucket counts");
         }
+    } else {
+        // Flatten the vectors of vectors of the older layout
+        std::vector<std::vector<double>> fileConfAvg, fileFailAvg;
+        filein >> fileConfAvg;
+        maxPeriods = fileConfAvg.size();
+        filein >> fileFailAvg;
+        if (maxPeriods != fileFailAvg.size()) {
+            throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
+        }
+        confAvg.clear();
+        failAvg.clear();
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            if (fileConfAvg[i].size() != numBuckets) {
+                throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
+            }
+            if (fileFailAvg[i].size() != numBuckets) {
+                throw std::runtime_error("Corrupt estimates file. Mismatch in one of failure average bucket counts");
+            }
+            confAvg.insert(confAvg.end(), fileConfAvg[i].begin(), fileConfAvg[i].end());
+            failAvg.insert(failAvg.end(), fileFailAvg[i].begin(), fileFailAvg[i].end());
+        }
+    }
+
+    maxConfirms = (size_t)scale * maxPeriods;
+    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
+        throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
     }
 
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
+    nBuckets = numBuckets;
     resizeInMemoryCounters(numBuckets);
 
     LogPrint(BCLog::ESTIMATEFEE, "Reading estimates: %u buckets counting confirms up to %u blocks\n",
              numBuckets, maxConfirms);
 }
 
-unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
+void TxConfirmStats::NewTx(unsigned int nBlockHeight, unsigned int bucketindex)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
-    return bucketindex;
+    unsigned int blockIndex = nBlockHeight % GetMaxConfirms();
+    unconfTxs[blockIndex * nBuckets + bucketindex]++;
 }
 
 void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight, unsigned int bucketindex, bool inBlock)
@@ -478,7 +512,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)GetMaxConfirms()) {
         if (oldUnconfTxs[bucketindex] > 0) {
             oldUnconfTxs[bucketindex]--;
         } else {
@@ -487,9 +521,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         }
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0) {
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % GetMaxConfirms();
+        if (unconfTxs[blockIndex * nBuckets + bucketindex] > 0) {
+            unconfTxs[blockIndex * nBuckets + bucketindex]--;
         } else {
             LogPrint(BCLog::ESTIMATEFEE, "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
@@ -498,8 +532,8 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     if (!inBlock && (unsigned int)blocksAgo >= scale) { // Only counts as a failure if not confirmed for entire period
         assert(scale != 0);
         unsigned int periodsAgo = blocksAgo / scale;
-        for (size_t i = 0; i < periodsAgo && i < failAvg.size(); i++) {
-            failAvg[i][bucketindex]++;
+        for (size_t i = 0; i < periodsAgo && i < maxPeriods; i++) {
+            failAvg[i * nBuckets + bucketindex]++;
         }
     }
 }
@@ -518,6 +552,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
         shortStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         longStats->removeTx(pos->second.blockHeight, nBestSeenHeight, pos->second.bucketIndex, inBlock);
         mapMemPoolTxs.erase(hash);
+        StatsChanged();
         return true;
     } else {
         return false;
@@ -525,27 +560,36 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator()
-    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), trackedTxs(0), untrackedTxs(0)
+    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), trackedTxs(0), untrackedTxs(0),
+      fChangedSinceWrite(false)
 {
     static_assert(MIN_BUCKET_FEERATE > 0, "Min feerate must be nonzero");
-    size_t bucketIndex = 0;
-    for (double bucketBoundary = MIN_BUCKET_FEERATE; bucketBoundary <= MAX_BUCKET_FEERATE; bucketBoundary *= FEE_SPACING, bucketIndex++) {
+    for (double bucketBoundary = MIN_BUCKET_FEERATE; bucketBoundary <= MAX_BUCKET_FEERATE; bucketBoundary *= FEE_SPACING) {
         buckets.push_back(bucketBoundary);
-        bucketMap[bucketBoundary] = bucketIndex;
     }
     buckets.push_back(INF_FEERATE);
-    bucketMap[INF_FEERATE] = bucketIndex;
-    assert(bucketMap.size() == buckets.size());
 
-    feeStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, bucketMap, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
-    shortStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, bucketMap, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
-    longStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, bucketMap, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
+    feeStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
+    shortStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
+    longStats = std::unique_ptr<TxConfirmStats>(new TxConfirmStats(buckets, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
 }
 
 CBlockPolicyEstimator::~CBlockPolicyEstimator()
 {
 }
 
+unsigned int CBlockPolicyEstimator::BucketIndex(double feerate) const
+{
+    // The last bucket is unbounded, so every feerate has one
+    return std::lower_bound(buckets.begin(), buckets.end(), feerate) - buckets.begin();
+}
+
+void CBlockPolicyEstimator::StatsChanged()
+{
+    mapSmartFeeCache.clear();
+    fChangedSinceWrite = true;
+}
+
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool validFeeEstimate)
 {
     LOCK(cs_feeEstimator);
@@ -576,13 +620,14 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // Feerates are stored and reported as BGD-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
-    mapMemPoolTxs[hash].blockHeight = txHeight;
-    unsigned int bucketIndex = feeStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
-    mapMemPoolTxs[hash].bucketIndex = bucketIndex;
-    unsigned int bucketIndex2 = shortStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
-    assert(bucketIndex == bucketIndex2);
-    unsigned int bucketIndex3 = longStats->NewTx(txHeight, (double)feeRate.GetFeePerK());
-    assert(bucketIndex == bucketIndex3);
+    // Txs entering at the current height are not counted by any estimate
+    // until the next block, so the cached estimates stay valid.
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
+    info.bucketIndex = BucketIndex((double)feeRate.GetFeePerK());
+    feeStats->NewTx(txHeight, info.bucketIndex);
+    shortStats->NewTx(txHeight, info.bucketIndex);
+    longStats->NewTx(txHeight, info.bucketIndex);
 }
 
 bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry)
@@ -606,9 +651,11 @@ bool CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
     // Feerates are stored and reported as BGD-per-kb:
     CFeeRate feeRate(entry->GetFee(), entry->GetTxSize());
 
-    feeStats->Record(blocksToConfirm, (double)feeRate.GetFeePerK());
-    shortStats->Record(blocksToConfirm, (double)feeRate.GetFeePerK());
-    longStats->Record(blocksToConfirm, (double)feeRate.GetFeePerK());
+    double val = (double)feeRate.GetFeePerK();
+    unsigned int bucketIndex = BucketIndex(val);
+    feeStats->Record(blocksToConfirm, bucketIndex, val);
+    shortStats->Record(blocksToConfirm, bucketIndex, val);
+    longStats->Record(blocksToConfirm, bucketIndex, val);
     return true;
 }
 
@@ -639,6 +686,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     feeStats->UpdateMovingAverages();
     shortStats->UpdateMovingAverages();
     longStats->UpdateMovingAverages();
+    StatsChanged();
 
     unsigned int countedTxs = 0;
     // Update averages with data points from current block
@@ -821,6 +869,23 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, FeeCalculation
 {
     LOCK(cs_feeEstimator);
 
+    auto key = std::make_pair(confTarget, conservative);
+    auto cached = mapSmartFeeCache.find(key);
+    if (cached != mapSmartFeeCache.end()) {
+        if (feeCalc) *feeCalc = cached->second.second;
+        return cached->second.first;
+    }
+    FeeCalculation calc;
+    CFeeRate feeRate = estimateSmartFeeUncached(confTarget, &calc, conservative);
+    if (mapSmartFeeCache.size() < 2 * longStats->GetMaxConfirms()) {
+        mapSmartFeeCache.emplace(key, std::make_pair(feeRate, calc));
+    }
+    if (feeCalc) *feeCalc = calc;
+    return feeRate;
+}
+
+CFeeRate CBlockPolicyEstimator::estimateSmartFeeUncached(int confTarget, FeeCalculation *feeCalc, bool conservative) const
+{
     if (feeCalc) {
         feeCalc->desiredTarget = confTarget;
         feeCalc->returnedTarget = confTarget;
@@ -900,8 +965,9 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
 {
     try {
         LOCK(cs_feeEstimator);
-        fileout << 149900; // version required to read: 0.14.99 or later
+        fileout << FEE_ESTIMATES_FLAT_VERSION; // version required to read
         fileout << CLIENT_VERSION; // version that wrote the file
+        fileout << FEE_ESTIMATES_FORMAT_FLAT;
         fileout << nBestSeenHeight;
         if (BlockSpan() > HistoricalBlockSpan()/2) {
             fileout << firstRecordedHeight << nBestSeenHeight;
@@ -913,6 +979,7 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
         feeStats->Write(fileout);
         shortStats->Write(fileout);
         longStats->Write(fileout);
+        fChangedSinceWrite = false;
     }
     catch (const std::exception&) {
         LogPrintf("CBlockPolicyEstimator::Write(): unable to write policy estimator data (non-fatal)\n");
@@ -921,6 +988,12 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
     return true;
 }
 
+bool CBlockPolicyEstimator::ChangedSinceWrite() const
+{
+    LOCK(cs_feeEstimator);
+    return fChangedSinceWrite;
+}
+
 bool CBlockPolicyEstimator::Read(CAutoFile& filein)
 {
     try {
@@ -929,15 +1002,22 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
         filein >> nVersionRequired >> nVersionThatWrote;
         if (nVersionRequired > CLIENT_VERSION)
             return error("CBlockPolicyEstimator::Read(): up-version (%d) fee estimate file", nVersionRequired);
+        const bool fFlat = nVersionRequired >= FEE_ESTIMATES_FLAT_VERSION;
+        uint32_t nFormat = 0;
+        if (fFlat) {
+            filein >> nFormat;
+        }
 
         // Read fee estimates file into temporary variables so existing data
         // structures aren't corrupted if there is an exception.
         unsigned int nFileBestSeenHeight;
         filein >> nFileBestSeenHeight;
 
-        if (nVersionRequired < 149900) {
+        if (nVersionRequired < FEE_ESTIMATES_NESTED_VERSION) {
             LogPrintf("%s: incompatible old fee estimation data (non-fatal). Version: %d\n", __func__, nVersionRequired);
-        } else { // New format introduced in 149900
+        } else if (fFlat && nFormat != FEE_ESTIMATES_FORMAT_FLAT) {
+            LogPrintf("%s: incompatible fee estimation data layout (non-fatal). Version: %d, layout: %u\n", __func__, nVersionRequired, nFormat);
+        } else { // New format introduced in 149900, flattened in 1000100
             unsigned int nFileHistoricalFirst, nFileHistoricalBest;
             filein >> nFileHistoricalFirst >> nFileHistoricalBest;
             if (nFileHistoricalFirst > nFileHistoricalBest || nFileHistoricalBest > nFileBestSeenHeight) {
@@ -949,20 +1029,19 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             if (numBuckets <= 1 || numBuckets > 1000)
                 throw std::runtime_error("Corrupt estimates file. Must have between 2 and 1000 feerate buckets");
 
-            std::unique_ptr<TxConfirmStats> fileFeeStats(new TxConfirmStats(buckets, bucketMap, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
-            std::unique_ptr<TxConfirmStats> fileShortStats(new TxConfirmStats(buckets, bucketMap, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
-            std::unique_ptr<TxConfirmStats> fileLongStats(new TxConfirmStats(buckets, bucketMap, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
-            fileFeeStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileShortStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileLongStats->Read(filein, nVersionThatWrote, numBuckets);
+            if (!std::is_sorted(fileBuckets.begin(), fileBuckets.end()) || fileBuckets.back() != INF_FEERATE)
+                throw std::runtime_error("Corrupt estimates file. Feerate buckets must be increasing and unbounded");
+
+            std::unique_ptr<TxConfirmStats> fileFeeStats(new TxConfirmStats(buckets, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
+            std::unique_ptr<TxConfirmStats> fileShortStats(new TxConfirmStats(buckets, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
+            std::unique_ptr<TxConfirmStats> fileLongStats(new TxConfirmStats(buckets, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
+            fileFeeStats->Read(filein, fFlat, numBuckets);
+            fileShortStats->Read(filein, fFlat, numBuckets);
+            fileLongStats->Read(filein, fFlat, numBuckets);
 
             // Fee estimates file parsed correctly
-            // Copy buckets from file and refresh our bucketmap
+            // Copy buckets from file
             buckets = fileBuckets;
-            bucketMap.clear();
-            for (unsigned int i = 0; i < buckets.size(); i++) {
-                bucketMap[buckets[i]] = i;
-            }
 
             // Destroy old TxConfirmStats and point to new ones that already reference buckets and bucketMap
             feeStats = std::move(fileFeeStats);
@@ -972,6 +1051,7 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             nBestSeenHeight = nFileBestSeenHeight;
             historicalFirst = nFileHistoricalFirst;
             historicalBest = nFileHistoricalBest;
+            mapSmartFeeCache.clear();
         }
     }
     catch (const std::exception& e) {
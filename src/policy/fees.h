@@ -219,6 +219,9 @@ public:
     /** Write estimation data to a file */
     bool Write(CAutoFile& fileout) const;
 
+    /** Whether the estimation data changed since it was last written */
+    bool ChangedSinceWrite() const;
+
     /** Read estimation data from a file */
     bool Read(CAutoFile& filein);
 
@@ -253,13 +256,24 @@ private:
     unsigned int untrackedTxs;
 
     std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
 
     mutable CCriticalSection cs_feeEstimator;
 
+    /** estimateSmartFee results by target and mode, until the stats change */
+    mutable std::map<std::pair<int, bool>, std::pair<CFeeRate, FeeCalculation>> mapSmartFeeCache;
+    /** Set when the stats change, cleared by Write */
+    mutable bool fChangedSinceWrite;
+
+    /** Index of the bucket a feerate falls in */
+    unsigned int BucketIndex(double feerate) const;
+    /** Drop the cached estimates and mark the stats for writing */
+    void StatsChanged();
+
     /** Process a transaction confirmed in a block*/
     bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
 
+    /** estimateSmartFee without the cache */
+    CFeeRate estimateSmartFeeUncached(int confTarget, FeeCalculation *feeCalc, bool conservative) const;
     /** Helper for estimateSmartFee */
     double estimateCombinedFee(unsigned int confTarget, double successThreshold, bool checkShorterHorizon, EstimationResult *result) const;
     /** Helper for estimateSmartFee */
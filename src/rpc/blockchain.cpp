@@ -6,10 +6,12 @@
 #include <rpc/blockchain.h>
 
 #include <amount.h>
+#include <blockfilter.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <coins.h>
+#include <coinstats.h>
 #include <consensus/validation.h>
 #include <validation.h>
 #include <core_io.h>
@@ -27,7 +29,11 @@
 #include <key_io.h>
 #include <utilstrencodings.h>
 #include <hash.h>
+#include <index/addrindex.h>
+#include <index/blockfilterindex.h>
 #include <base58.h>
+#include <net.h>
+#include <net_processing.h>
 #include <validationinterface.h>
 #include <warnings.h>
 
@@ -385,28 +391,26 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+void entryToJSON(UniValue &info, const CTxMemPoolSnapshot& snapshot, uint32_t index)
 {
-    AssertLockHeld(mempool.cs);
-
-    info.pushKV("size", (int)e.GetTxSize());
-    info.pushKV("fee", ValueFromAmount(e.GetFee()));
-    info.pushKV("modifiedfee", ValueFromAmount(e.GetModifiedFee()));
-    info.pushKV("time", e.GetTime());
-    info.pushKV("height", (int)e.GetHeight());
-    info.pushKV("descendantcount", e.GetCountWithDescendants());
-    info.pushKV("descendantsize", e.GetSizeWithDescendants());
-    info.pushKV("descendantfees", e.GetModFeesWithDescendants());
-    info.pushKV("ancestorcount", e.GetCountWithAncestors());
-    info.pushKV("ancestorsize", e.GetSizeWithAncestors());
-    info.pushKV("ancestorfees", e.GetModFeesWithAncestors());
-    info.pushKV("wtxid", mempool.vTxHashes[e.vTxHashesIdx].first.ToString());
-    const CTransaction& tx = e.GetTx();
+    const CTxMemPoolSnapshot::Entry& e = snapshot.vEntries[index];
+
+    info.pushKV("size", (int)e.nTxSize);
+    info.pushKV("fee", ValueFromAmount(e.nFee));
+    info.pushKV("modifiedfee", ValueFromAmount(e.nModFee));
+    info.pushKV("time", e.nTime);
+    info.pushKV("height", (int)e.nHeight);
+    info.pushKV("descendantcount", e.nCountWithDescendants);
+    info.pushKV("descendantsize", e.nSizeWithDescendants);
+    info.pushKV("descendantfees", e.nModFeesWithDescendants);
+    info.pushKV("ancestorcount", e.nCountWithAncestors);
+    info.pushKV("ancestorsize", e.nSizeWithAncestors);
+    info.pushKV("ancestorfees", e.nModFeesWithAncestors);
+    info.pushKV("wtxid", e.tx->GetWitnessHash().ToString());
     std::set<std::string> setDepends;
-    for (const CTxIn& txin : tx.vin)
+    for (uint32_t parent : e.vParents)
     {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
+        setDepends.insert(snapshot.vEntries[parent].tx->GetHash().ToString());
     }
 
     UniValue depends(UniValue::VARR);
@@ -418,10 +422,8 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.pushKV("depends", depends);
 
     UniValue spent(UniValue::VARR);
-    const CTxMemPool::txiter &it = mempool.mapTx.find(tx.GetHash());
-    const CTxMemPool::setEntries &setChildren = mempool.GetMemPoolChildren(it);
-    for (const CTxMemPool::txiter &childiter : setChildren) {
-        spent.push_back(childiter->GetTx().GetHash().ToString());
+    for (uint32_t child : e.vChildren) {
+        spent.push_back(snapshot.vEntries[child].tx->GetHash().ToString());
     }
 
     info.pushKV("spentby", spent);
@@ -429,27 +431,25 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
 
 UniValue mempoolToJSON(bool fVerbose)
 {
+    // Reading a snapshot keeps mempool.cs free for transaction acceptance
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
+        for (uint32_t i = 0; i < snapshot->vEntries.size(); i++)
         {
-            const uint256& hash = e.GetTx().GetHash();
+            const uint256& hash = snapshot->vEntries[i].tx->GetHash();
             UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
+            entryToJSON(info, *snapshot, i);
             o.pushKV(hash.ToString(), info);
         }
         return o;
     }
     else
     {
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        for (const uint256& hash : vtxid)
-            a.push_back(hash.ToString());
+        for (const CTxMemPoolSnapshot::Entry& e : snapshot->vEntries)
+            a.push_back(e.tx->GetHash().ToString());
 
         return a;
     }
@@ -519,32 +519,27 @@ UniValue getmempoolancestors(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
+    uint32_t index;
+    if (!snapshot->Find(hash, index)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    CTxMemPool::setEntries setAncestors;
-    uint64_t noLimit = std::numeric_limits<uint64_t>::max();
-    std::string dummy;
-    mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
+    std::vector<uint32_t> vAncestors = snapshot->CalculateAncestors(index);
 
     if (!fVerbose) {
         UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            o.push_back(ancestorIt->GetTx().GetHash().ToString());
+        for (uint32_t ancestor : vAncestors) {
+            o.push_back(snapshot->vEntries[ancestor].tx->GetHash().ToString());
         }
 
         return o;
     } else {
         UniValue o(UniValue::VOBJ);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            const CTxMemPoolEntry &e = *ancestorIt;
-            const uint256& _hash = e.GetTx().GetHash();
+        for (uint32_t ancestor : vAncestors) {
+            const uint256& _hash = snapshot->vEntries[ancestor].tx->GetHash();
             UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
+            entryToJSON(info, *snapshot, ancestor);
             o.pushKV(_hash.ToString(), info);
         }
         return o;
@@ -583,32 +578,27 @@ UniValue getmempooldescendants(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
+    uint32_t index;
+    if (!snapshot->Find(hash, index)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    CTxMemPool::setEntries setDescendants;
-    mempool.CalculateDescendants(it, setDescendants);
-    // CTxMemPool::CalculateDescendants will include the given tx
-    setDescendants.erase(it);
+    std::vector<uint32_t> vDescendants = snapshot->CalculateDescendants(index);
 
     if (!fVerbose) {
         UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            o.push_back(descendantIt->GetTx().GetHash().ToString());
+        for (uint32_t descendant : vDescendants) {
+            o.push_back(snapshot->vEntries[descendant].tx->GetHash().ToString());
         }
 
         return o;
     } else {
         UniValue o(UniValue::VOBJ);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            const CTxMemPoolEntry &e = *descendantIt;
-            const uint256& _hash = e.GetTx().GetHash();
+        for (uint32_t descendant : vDescendants) {
+            const uint256& _hash = snapshot->vEntries[descendant].tx->GetHash();
             UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
+            entryToJSON(info, *snapshot, descendant);
             o.pushKV(_hash.ToString(), info);
         }
         return o;
@@ -635,16 +625,15 @@ UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
-
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
+    // Only the entry and its parents and children are needed
+    std::unique_ptr<CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot({hash}, true);
+    uint32_t index;
+    if (!snapshot->Find(hash, index)) {
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
-    entryToJSON(info, e);
+    entryToJSON(info, *snapshot, index);
     return info;
 }
 
@@ -823,77 +812,6 @@ UniValue getblock(const JSONRPCRequest& request)
     return blockToJSON(block, pblockindex, verbosity >= 2);
 }
 
-struct CCoinsStats
-{
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nBogoSize;
-    uint256 hashSerialized;
-    uint64_t nDiskSize;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nBogoSize(0), nDiskSize(0), nTotalAmount(0) {}
-};
-
-static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
-{
-    assert(!outputs.empty());
-    ss << hash;
-    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
-    stats.nTransactions++;
-    for (const auto output : outputs) {
-        ss << VARINT(output.first + 1);
-        ss << output.second.out.scriptPubKey;
-        ss << VARINT(output.second.out.nValue);
-        stats.nTransactionOutputs++;
-        stats.nTotalAmount += output.second.out.nValue;
-        stats.nBogoSize += 32 /* txid */ + 4 /* vout index */ + 4 /* height + coinbase */ + 8 /* amount */ +
-                           2 /* scriptPubKey len */ + output.second.out.scriptPubKey.size() /* scriptPubKey */;
-    }
-    ss << VARINT(0);
-}
-
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
-{
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-    assert(pcursor);
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
-    {
-        LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
-    }
-    ss << stats.hashBlock;
-    uint256 prevkey;
-    std::map<uint32_t, Coin> outputs;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        COutPoint key;
-        Coin coin;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
-            if (!outputs.empty() && key.hash != prevkey) {
-                ApplyStats(stats, ss, prevkey, outputs);
-                outputs.clear();
-            }
-            prevkey = key.hash;
-            outputs[key.n] = std::move(coin);
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
-    }
-    if (!outputs.empty()) {
-        ApplyStats(stats, ss, prevkey, outputs);
-    }
-    stats.hashSerialized = ss.GetHash();
-    stats.nDiskSize = view->EstimateSize();
-    return true;
-}
-
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOs(CCoinsView *view, const std::string & address, std::map<COutPoint, Coin> & outset)
 {
@@ -970,85 +888,267 @@ UniValue pruneblockchain(const JSONRPCRequest& request)
 
 UniValue gettxoutsetinfo(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 0)
+    if (request.fHelp || request.params.size() > 2)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_or_height\" full_scan )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Statistics maintained with -utxostats are returned instantly, also for earlier blocks.\n"
+            "Otherwise the whole set is scanned, which may take some time and is only possible for the current tip.\n"
+            "\nArguments:\n"
+            "1. \"hash_or_height\"  (string or numeric, optional) The block hash or height to return statistics for (default: the current tip, also when empty)\n"
+            "2. full_scan          (boolean, optional, default=false) Scan the whole set even if maintained statistics are available\n"
             "\nResult:\n"
             "{\n"
-            "  \"height\":n,     (numeric) The current block height (index)\n"
-            "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"height\":n,     (numeric) The block height (index) the statistics are for\n"
+            "  \"bestblock\": \"hex\",   (string) the block hash hex the statistics are for\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (full scan only)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bogosize\": n,          (numeric) A meaningless metric for UTXO set size\n"
-            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash\n"
-            "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk\n"
+            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash (full scan only)\n"
+            "  \"muhash\": \"hash\",     (string) The rolling MuHash3072 commitment to the set\n"
+            "  \"disk_size\": n,         (numeric) The estimated size of the chainstate on disk (current tip only)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "1000")
+            + HelpExampleCli("gettxoutsetinfo", "\"\" true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    UniValue ret(UniValue::VOBJ);
+    const CBlockIndex* pindex;
+    bool fTip;
+    {
+        LOCK(cs_main);
+        if (request.params[0].isNull() || (request.params[0].isStr() && request.params[0].get_str().empty())) {
+            pindex = chainActive.Tip();
+        } else if (request.params[0].isNum() || request.params[0].get_str().size() != 64) {
+            int nHeight;
+            if (request.params[0].isNum()) {
+                nHeight = request.params[0].get_int();
+            } else if (!ParseInt32(request.params[0].get_str(), &nHeight)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block hash or height");
+            }
+            if (nHeight < 0 || nHeight > chainActive.Height())
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+            pindex = chainActive[nHeight];
+        } else {
+            uint256 hash = ParseHashV(request.params[0], "hash_or_height");
+            BlockMap::const_iterator it = mapBlockIndex.find(hash);
+            if (it == mapBlockIndex.end())
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+            pindex = it->second;
+        }
+        fTip = pindex == chainActive.Tip();
+    }
+    const bool fFullScan = !request.params[1].isNull() && request.params[1].get_bool();
 
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (GetUTXOStats(pcoinsdbview.get(), stats)) {
-        ret.pushKV("height", (int64_t)stats.nHeight);
-        ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    if (!fFullScan && pblocktree->ReadUTXOStats(pindex->GetBlockHash(), stats)) {
+        if (fTip) stats.nDiskSize = pcoinsdbview->EstimateSize();
+    } else {
+        if (!fTip)
+            throw JSONRPCError(RPC_MISC_ERROR, "UTXO set statistics are not available for this block (a full scan is only possible at the current tip)");
+        FlushStateToDisk();
+        if (!GetUTXOStats(pcoinsdbview.get(), stats))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        // Seed the maintained statistics, so that following blocks are
+        // accounted for incrementally.
+        if (fUTXOStats && !pblocktree->WriteUTXOStats(stats.hashBlock, stats))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to write UTXO set statistics");
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("height", (int64_t)stats.nHeight);
+    ret.pushKV("bestblock", stats.hashBlock.GetHex());
+    if (!stats.hashSerialized.IsNull()) {
         ret.pushKV("transactions", (int64_t)stats.nTransactions);
-        ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
-        ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    }
+    ret.pushKV("txouts", (int64_t)stats.nTransactionOutputs);
+    ret.pushKV("bogosize", (int64_t)stats.nBogoSize);
+    if (!stats.hashSerialized.IsNull()) {
         ret.pushKV("hash_serialized_2", stats.hashSerialized.GetHex());
+    }
+    ret.pushKV("muhash", stats.GetMuHash().GetHex());
+    if (fTip) {
         ret.pushKV("disk_size", stats.nDiskSize);
-        ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
-    } else {
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
     }
+    ret.pushKV("total_amount", ValueFromAmount(stats.nTotalAmount));
     return ret;
 }
 
+bool ParseAddressScript(const std::string& str, CScript& script)
+{
+    CTxDestination dest = DecodeDestination(str);
+    if (IsValidDestination(dest)) {
+        script = GetScriptForDestination(dest);
+        return true;
+    }
+    if (!str.empty() && IsHex(str)) {
+        std::vector<unsigned char> data(ParseHex(str));
+        script = CScript(data.begin(), data.end());
+        return true;
+    }
+    return false;
+}
+
+UniValue addressHistoryToJSON(const std::vector<CAddrHistoryEntry>& entries)
+{
+    UniValue result(UniValue::VARR);
+    LOCK(cs_main);
+    for (const CAddrHistoryEntry& entry : entries) {
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("txid", entry.txid.GetHex());
+        obj.pushKV("category", entry.fSpend ? "spend" : "receive");
+        obj.pushKV(entry.fSpend ? "vin" : "vout", (int)entry.n);
+        obj.pushKV("value", ValueFromAmount(entry.nValue));
+        if (entry.fSpend) {
+            obj.pushKV("prevout_txid", entry.prevout.hash.GetHex());
+            obj.pushKV("prevout_vout", (int)entry.prevout.n);
+        }
+        obj.pushKV("height", entry.nHeight);
+        if (const CBlockIndex* pindex = chainActive[entry.nHeight]) {
+            obj.pushKV("blockhash", pindex->GetBlockHash().GetHex());
+        }
+        result.push_back(obj);
+    }
+    return result;
+}
+
+UniValue addressUnspentToJSON(const std::vector<CAddrUnspentEntry>& entries, bool fAmountInCoins)
+{
+    UniValue result(UniValue::VARR);
+    for (const CAddrUnspentEntry& entry : entries) {
+        UniValue obj(UniValue::VOBJ);
+        obj.pushKV("txid", entry.outpoint.hash.GetHex());
+        obj.pushKV("n", (int)entry.outpoint.n);
+        if (fAmountInCoins) {
+            obj.pushKV("amount", ValueFromAmount(entry.nValue));
+        } else {
+            obj.pushKV("amount", entry.nValue);
+        }
+        obj.pushKV("coinbase", entry.fCoinBase);
+        obj.pushKV("height", entry.nHeight);
+        result.push_back(obj);
+    }
+    return result;
+}
+
+/** Read the optional skip and count arguments of an address query starting at params[i]. */
+static void ParseAddressQueryRange(const UniValue& params, size_t i, size_t& skip, size_t& count)
+{
+    skip = 0;
+    count = DEFAULT_ADDRESS_QUERY_COUNT;
+    if (!params[i].isNull()) {
+        int64_t n = params[i].get_int64();
+        if (n < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip");
+        skip = n;
+    }
+    if (!params[i + 1].isNull()) {
+        int64_t n = params[i + 1].get_int64();
+        if (n < 1 || (uint64_t)n > MAX_ADDRESS_QUERY_COUNT)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Count out of range (1-%u)", MAX_ADDRESS_QUERY_COUNT));
+        count = n;
+    }
+}
+
 UniValue getutxos(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() != 1)
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
         throw std::runtime_error(
-            "getutxos\n"
-            "\nReturns the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "getutxos \"address\" ( skip count )\n"
+            "\nReturns the unspent transaction outputs paying to an address.\n"
+            "With -addrindex the outputs are looked up in the address index, which also accepts\n"
+            "a hex-encoded scriptPubKey. Otherwise the whole unspent transaction output set is\n"
+            "scanned, and this call may take some time.\n"
             "\nArguments:\n"
             "1. \"address\"         (string, required) address\n"
+            "2. skip              (numeric, optional, default=0) Number of outputs to skip, for pagination\n"
+            "3. count             (numeric, optional, default=" + std::to_string(DEFAULT_ADDRESS_QUERY_COUNT) + ") Maximum number of outputs to return\n"
             "\nResult:\n"
             "[{\n"
             "  \"txid\":\"hex\",    (string) The transaction id\n"
             "  \"n\": n,            (number) the index of transaction outputs\n"
-            "  \"amount\": n,       (number) utxo value\n"
+            "  \"amount\": n,       (numeric) The value of the output in satoshis\n"
             "  \"coinbase\": n,     (boolean) if coinbase\n"
+            "  \"height\": n,       (number) the height of the block creating the output\n"
             "},...]\n"
             "\nExamples:\n"
-            + HelpExampleCli("getutxos", "")
-            + HelpExampleRpc("getutxos", "")
+            + HelpExampleCli("getutxos", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleRpc("getutxos", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\", 0, 100")
         );
 
-    UniValue ret(UniValue::VARR);
     std::string dest = (request.params[0].get_str());
+    size_t skip, count;
+    ParseAddressQueryRange(request.params, 1, skip, count);
+
+    std::vector<CAddrUnspentEntry> entries;
+    if (g_addrindex) {
+        CScript script;
+        if (!ParseAddressScript(dest, script))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address or script");
+        g_addrindex->BlockUntilSyncedToCurrentChain();
+        if (!g_addrindex->FindUnspent(script, skip, count, entries))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read address index");
+        return addressUnspentToJSON(entries, false);
+    }
+
     std::map<COutPoint, Coin> outset;
-    if (GetUTXOs(pcoinsdbview.get(), dest, outset)) {
-        for(auto it = outset.begin(); it != outset.end(); ++it){
-            COutPoint outpoint = it->first;
-            Coin coin = it->second;
-            UniValue elt(UniValue::VOBJ);
-            elt.pushKV("txid", outpoint.hash.ToString());
-            elt.pushKV("n", (int)outpoint.n);
-            elt.pushKV("amount", coin.out.nValue);
-            elt.pushKV("coinbase", coin.IsCoinBase());
-            ret.push_back(elt);
-        }
-    } else {
+    if (!GetUTXOs(pcoinsdbview.get(), dest, outset))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+    for (const auto& out : outset) {
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        if (entries.size() == count) break;
+        entries.push_back(CAddrUnspentEntry{out.first, (int)out.second.nHeight, out.second.IsCoinBase(), out.second.out.nValue});
     }
-    return ret;
+    return addressUnspentToJSON(entries, false);
+}
+
+UniValue getaddresshistory(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 3)
+        throw std::runtime_error(
+            "getaddresshistory \"address\" ( skip count )\n"
+            "\nReturns the confirmed transactions funding or spending the outputs of an address, oldest first.\n"
+            "Requires -addrindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"         (string, required) The address, or a hex-encoded scriptPubKey\n"
+            "2. skip              (numeric, optional, default=0) Number of entries to skip, for pagination\n"
+            "3. count             (numeric, optional, default=" + std::to_string(DEFAULT_ADDRESS_QUERY_COUNT) + ") Maximum number of entries to return\n"
+            "\nResult:\n"
+            "[{\n"
+            "  \"txid\":\"hex\",           (string) The funding or spending transaction id\n"
+            "  \"category\":\"receive|spend\", (string) Whether an output was funded or spent\n"
+            "  \"vout\"|\"vin\": n,        (numeric) The index of the funded output or of the spending input\n"
+            "  \"value\": x.xxx,         (numeric) The value of the output in " + CURRENCY_UNIT + "\n"
+            "  \"prevout_txid\":\"hex\",   (string) For spends, the transaction id of the spent output\n"
+            "  \"prevout_vout\": n,      (numeric) For spends, the index of the spent output\n"
+            "  \"height\": n,            (numeric) The height of the block containing the transaction\n"
+            "  \"blockhash\":\"hex\"       (string) The hash of that block\n"
+            "},...]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleRpc("getaddresshistory", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\", 1000, 1000")
+        );
+
+    if (!g_addrindex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled. Use -addrindex");
+
+    CScript script;
+    if (!ParseAddressScript(request.params[0].get_str(), script))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address or script");
+    size_t skip, count;
+    ParseAddressQueryRange(request.params, 1, skip, count);
+
+    g_addrindex->BlockUntilSyncedToCurrentChain();
+    std::vector<CAddrHistoryEntry> entries;
+    if (!g_addrindex->FindHistory(script, skip, count, entries))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read address index");
+    return addressHistoryToJSON(entries);
 }
 
 UniValue gettxout(const JSONRPCRequest& request)
@@ -1230,6 +1330,120 @@ void BIP9SoftForkDescPushBack(UniValue& bip9_softforks, const Consensus::Params&
         bip9_softforks.pushKV(VersionBitsDeploymentInfo[id].name, BIP9SoftForkDesc(consensusParams, id));
 }
 
+UniValue getblockfrompeer(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 2)
+        throw std::runtime_error(
+            "getblockfrompeer \"blockhash\" nodeid\n"
+            "\nRequest a block whose header is known, but whose data was pruned or never downloaded, from a peer.\n"
+            "Once it arrives it is stored like any other block, until it is pruned again.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"  (string, required) The block hash\n"
+            "2. nodeid       (numeric, required) The id of the peer to request the block from (see getpeerinfo)\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfrompeer", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" 0")
+            + HelpExampleRpc("getblockfrompeer", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", 0")
+        );
+
+    if (!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    uint256 hash(ParseHashV(request.params[0], "blockhash"));
+    const NodeId nodeid = request.params[1].get_int64();
+
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hash);
+        if (it == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block header missing");
+        pindex = it->second;
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            throw JSONRPCError(RPC_MISC_ERROR, "Block already downloaded");
+    }
+
+    std::string strError;
+    if (!FetchBlock(g_connman.get(), nodeid, pindex, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+    return NullUniValue;
+}
+
+UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "Requires -blockfilterindex.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"   (string, required) The hash of the block\n"
+            "2. \"filtertype\"  (string, optional, default=\"basic\") The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : (string) the hex-encoded filter data\n"
+            "  \"header\" : (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+
+    uint256 block_hash(ParseHashV(request.params[0], "blockhash"));
+    std::string filtertype_name = "basic";
+    if (!request.params[1].isNull()) {
+        filtertype_name = request.params[1].get_str();
+    }
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(filtertype_name, filtertype)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    if (!g_blockfilterindex || g_blockfilterindex->GetFilterType() != filtertype) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + filtertype_name);
+    }
+
+    const CBlockIndex* block_index;
+    bool block_was_connected;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(block_hash);
+        if (it == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        block_index = it->second;
+        block_was_connected = block_index->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool index_ready = g_blockfilterindex->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!g_blockfilterindex->LookupFilter(block_index, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(block_index, filter_header)) {
+        int err_code;
+        std::string errmsg = "Filter not found.";
+
+        if (!block_was_connected) {
+            err_code = RPC_INVALID_ADDRESS_OR_KEY;
+            errmsg += " Block was not connected to active chain.";
+        } else if (!index_ready) {
+            err_code = RPC_MISC_ERROR;
+            errmsg += " Block filters are still in the process of being indexed.";
+        } else {
+            err_code = RPC_INTERNAL_ERROR;
+            errmsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(err_code, errmsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("filter", HexStr(filter.GetEncodedFilter()));
+    ret.pushKV("header", filter_header.GetHex());
+    return ret;
+}
+
 UniValue getblockchaininfo(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() != 0)
@@ -1694,6 +1908,54 @@ UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1) {
+        throw std::runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set at the current tip to a snapshot file.\n"
+            "The file can be loaded into the empty chainstate of another node with -loadtxoutset.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) Path to the snapshot file. Relative paths are prefixed by the data directory.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coins_written\": n,   (numeric) The number of coins written\n"
+            "  \"base_hash\": \"hash\",  (string) The hash of the block the snapshot is for\n"
+            "  \"base_height\": n,     (numeric) The height of the block the snapshot is for\n"
+            "  \"muhash\": \"hash\",     (string) The MuHash3072 commitment to the set, as reported by gettxoutsetinfo\n"
+            "  \"path\": \"path\"        (string) The absolute path the snapshot was written to\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+    }
+
+    const fs::path path = AbsPathForConfigVal(fs::path(request.params[0].get_str()));
+    if (fs::exists(path)) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    }
+
+    FlushStateToDisk();
+    uint256 hashBlock;
+    uint64_t nCoins;
+    uint256 hashMuHash;
+    if (!DumpTxOutSet(path, pcoinsdbview.get(), hashBlock, nCoins, hashMuHash)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to write UTXO set snapshot");
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("coins_written", nCoins);
+    ret.pushKV("base_hash", hashBlock.GetHex());
+    {
+        LOCK(cs_main);
+        ret.pushKV("base_height", mapBlockIndex.at(hashBlock)->nHeight);
+    }
+    ret.pushKV("muhash", hashMuHash.GetHex());
+    ret.pushKV("path", path.string());
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1704,6 +1966,9 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblock",               &getblock,               {"blockhash","verbosity|verbose"} },
     { "blockchain",         "getblockhash",           &getblockhash,           {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         {"blockhash","verbose"} },
+    { "blockchain",         "getblockfrompeer",       &getblockfrompeer,       {"blockhash","nodeid"} },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         {"blockhash","filtertype"} },
+    { "blockchain",         "getaddresshistory",      &getaddresshistory,      {"address","skip","count"} },
     { "blockchain",         "getchaintips",           &getchaintips,           {} },
     { "blockchain",         "getdifficulty",          &getdifficulty,          {} },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    {"txid","verbose"} },
@@ -1712,10 +1977,11 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
-    { "blockchain",         "getutxos",               &getutxos,               {"address"} },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {"hash_or_height","full_scan"} },
+    { "blockchain",         "getutxos",               &getutxos,               {"address","skip","count"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
     { "blockchain",         "savemempool",            &savemempool,            {} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           {"path"} },
     { "blockchain",         "verifychain",            &verifychain,            {"checklevel","nblocks"} },
 
     { "blockchain",         "preciousblock",          &preciousblock,          {"blockhash"} },
@@ -7,9 +7,20 @@
 
 #include "uint256.h"
 
+#include <stddef.h>
+#include <string>
+#include <vector>
+
 class CBlock;
 class CBlockIndex;
+class CScript;
 class UniValue;
+struct CAddrHistoryEntry;
+struct CAddrUnspentEntry;
+
+/** Default and maximum number of entries returned by one address index query */
+static const size_t DEFAULT_ADDRESS_QUERY_COUNT = 1000;
+static const size_t MAX_ADDRESS_QUERY_COUNT = 10000;
 
 /**
  * Get the difficulty of the net wrt to the given block index, or the chain tip if
@@ -35,5 +46,14 @@ UniValue mempoolToJSON(bool fVerbose = false);
 /** Block header to JSON */
 UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
+/** Parse an address, or a hex-encoded scriptPubKey, into the script it stands for */
+bool ParseAddressScript(const std::string& str, CScript& script);
+
+/** Address index history to JSON */
+UniValue addressHistoryToJSON(const std::vector<CAddrHistoryEntry>& entries);
+
+/** Address index unspent outputs to JSON, with amounts in coins (REST) or satoshis (getutxos) */
+UniValue addressUnspentToJSON(const std::vector<CAddrUnspentEntry>& entries, bool fAmountInCoins);
+
 #endif
 
@@ -7,6 +7,7 @@
 #include <coins.h>
 #include <consensus/validation.h>
 #include <core_io.h>
+#include <index/txindex.h>
 #include <init.h>
 #include <keystore.h>
 #include <validation.h>
@@ -14,6 +15,7 @@
 #include <key_io.h>
 #include <merkleblock.h>
 #include <net.h>
+#include <net_processing.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
 #include <primitives/transaction.h>
@@ -168,6 +170,10 @@ UniValue getrawtransaction(const JSONRPCRequest& request)
         in_active_chain = chainActive.Contains(blockindex);
     }
 
+    if (g_txindex && !blockindex) {
+        g_txindex->BlockUntilSyncedToCurrentChain();
+    }
+
     CTransactionRef tx;
     uint256 hash_block;
     if (!GetTransaction(hash, tx, Params().GetConsensus(), hash_block, true, blockindex)) {
@@ -178,7 +184,7 @@ UniValue getrawtransaction(const JSONRPCRequest& request)
             }
             errmsg = "No such transaction found in the provided block";
         } else {
-            errmsg = fTxIndex
+            errmsg = g_txindex
               ? "No such mempool or blockchain transaction"
               : "No such mempool transaction. Use -txindex to enable blockchain transaction queries";
         }
@@ -1046,6 +1052,9 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     if (!request.params[1].isNull() && request.params[1].get_bool())
         nMaxRawTxFee = 0;
 
+    // Verify the scripts before taking cs_main, see PrevalidateTransactions
+    PrevalidateTransactions(mempool, {tx});
+
     { // cs_main scope
     LOCK(cs_main);
     CCoinsViewCache &view = *pcoinsTip;
@@ -1103,6 +1112,205 @@ UniValue sendrawtransaction(const JSONRPCRequest& request)
     return hashTx.GetHex();
 }
 
+/** Decode the raw transactions of a testmempoolaccept or submitpackage call */
+static std::vector<CTransactionRef> DecodeRawTransactions(const UniValue& rawtxs)
+{
+    if (rawtxs.empty()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Array must contain at least one transaction.");
+    }
+    if (rawtxs.size() > MAX_PACKAGE_COUNT) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Array must contain at most %u transactions.", MAX_PACKAGE_COUNT));
+    }
+
+    std::vector<CTransactionRef> txs;
+    txs.reserve(rawtxs.size());
+    for (size_t i = 0; i < rawtxs.size(); i++) {
+        CMutableTransaction mtx;
+        if (!DecodeHexTx(mtx, rawtxs[i].get_str())) {
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, strprintf("TX decode failed for transaction %u", i));
+        }
+        txs.push_back(MakeTransactionRef(std::move(mtx)));
+    }
+    return txs;
+}
+
+UniValue testmempoolaccept(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "testmempoolaccept [\"rawtxs\"] ( allowhighfees )\n"
+            "\nReturns if raw transactions (serialized, hex-encoded) would be accepted by mempool.\n"
+            "\nA single transaction is tested the way sendrawtransaction would submit it. Several\n"
+            "transactions are tested as a package, the way submitpackage would submit them.\n"
+            "\nThis checks if the transactions violate the consensus or policy rules.\n"
+            "\nSee sendrawtransaction and submitpackage calls.\n"
+            "\nArguments:\n"
+            "1. [\"rawtxs\"]       (array, required) An array of hex strings of raw transactions: a child's\n"
+            "                                        parents, sorted parents first, and then the child.\n"
+            "                                        Up to " + std::to_string(MAX_PACKAGE_COUNT) + " transactions.\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[                   (array) The result of the mempool acceptance test for each raw transaction in the input array.\n"
+            "  {\n"
+            "    \"txid\"           (string) The transaction hash in hex\n"
+            "    \"allowed\"        (boolean) If the mempool allows this tx to be inserted\n"
+            "    \"reject-reason\"  (string) Rejection string (only present when 'allowed' is false). Given for the\n"
+            "                                rejected transaction, or for all of them if the package as a whole was rejected\n"
+            "  }\n"
+            "]\n"
+            "\nExamples:\n"
+            "\nCreate a transaction\n"
+            + HelpExampleCli("createrawtransaction", "\"[{\\\"txid\\\" : \\\"mytxid\\\",\\\"vout\\\":0}]\" \"{\\\"myaddress\\\":0.01}\"") +
+            "Sign the transaction, and get back the hex\n"
+            + HelpExampleCli("signrawtransaction", "\"myhex\"") +
+            "\nTest acceptance of the transaction (signed hex)\n"
+            + HelpExampleCli("testmempoolaccept", "\"[\\\"signedhex\\\"]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("testmempoolaccept", "[\"signedhex\"]")
+        );
+
+    ObserveSafeMode();
+
+    RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
+
+    const std::vector<CTransactionRef> txs = DecodeRawTransactions(request.params[0].get_array());
+
+    CAmount max_raw_tx_fee = ::maxTxFee;
+    if (!request.params[1].isNull() && request.params[1].get_bool()) {
+        max_raw_tx_fee = 0;
+    }
+
+    CValidationState state;
+    bool missing_inputs;
+    bool test_accept_res;
+    size_t failed_tx;
+    {
+        LOCK(cs_main);
+        if (txs.size() == 1) {
+            test_accept_res = AcceptToMemoryPool(mempool, state, txs[0], &missing_inputs,
+                nullptr /* plTxnReplaced */, false /* bypass_limits */, max_raw_tx_fee, true /* test_accept */);
+            failed_tx = 0;
+        } else {
+            PackageAcceptResult result;
+            test_accept_res = AcceptPackageToMemoryPool(mempool, state, txs, &missing_inputs, max_raw_tx_fee,
+                true /* test_accept */, result);
+            failed_tx = result.nFailedTx;
+        }
+    }
+
+    std::string reject_reason;
+    if (!test_accept_res) {
+        if (state.IsInvalid()) {
+            reject_reason = strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason());
+        } else if (missing_inputs) {
+            reject_reason = "missing-inputs";
+        } else {
+            reject_reason = state.GetRejectReason();
+        }
+    }
+
+    UniValue result(UniValue::VARR);
+    for (size_t i = 0; i < txs.size(); i++) {
+        UniValue result_0(UniValue::VOBJ);
+        result_0.pushKV("txid", txs[i]->GetHash().GetHex());
+        result_0.pushKV("allowed", test_accept_res);
+        if (!test_accept_res && (i == failed_tx || failed_tx == txs.size())) {
+            result_0.pushKV("reject-reason", reject_reason);
+        }
+        result.push_back(std::move(result_0));
+    }
+    return result;
+}
+
+UniValue submitpackage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "submitpackage [\"rawtxs\"] ( allowhighfees )\n"
+            "\nSubmits a package of raw transactions (serialized, hex-encoded) to local node and network.\n"
+            "\nThe package is accepted as a whole or not at all, and the minimum relay and mempool fees\n"
+            "apply to the feerate of the whole package, so that children can pay for their parents.\n"
+            "Transactions already in the mempool are skipped. The package may not replace mempool\n"
+            "transactions. Peers that support it are announced the package, all other peers the single\n"
+            "transactions.\n"
+            "\nArguments:\n"
+            "1. [\"rawtxs\"]       (array, required) An array of hex strings of raw transactions: a child's\n"
+            "                                        parents, sorted parents first, and then the child.\n"
+            "                                        Up to " + std::to_string(MAX_PACKAGE_COUNT) + " transactions.\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txids\" : [ \"txid\", ... ],  (array) The transaction hashes in hex\n"
+            "  \"fee\" : n,                  (numeric) Fee of the transactions that were not in the mempool yet, in " + CURRENCY_UNIT + ",\n"
+            "                                 including any fee deltas\n"
+            "  \"vsize\" : n,                (numeric) Virtual size of those transactions\n"
+            "  \"feerate\" : n               (numeric) The package feerate in " + CURRENCY_UNIT + "/kB\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitpackage", "\"[\\\"signedparenthex\\\",\\\"signedchildhex\\\"]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("submitpackage", "[\"signedparenthex\",\"signedchildhex\"]")
+        );
+
+    ObserveSafeMode();
+
+    std::promise<void> promise;
+
+    RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
+
+    const std::vector<CTransactionRef> txs = DecodeRawTransactions(request.params[0].get_array());
+
+    CAmount nMaxRawTxFee = maxTxFee;
+    if (!request.params[1].isNull() && request.params[1].get_bool())
+        nMaxRawTxFee = 0;
+
+    // Verify the scripts before taking cs_main, see PrevalidateTransactions
+    PrevalidateTransactions(mempool, txs);
+
+    PackageAcceptResult result;
+    { // cs_main scope
+    LOCK(cs_main);
+    CValidationState state;
+    bool fMissingInputs;
+    if (!AcceptPackageToMemoryPool(mempool, state, txs, &fMissingInputs, nMaxRawTxFee, false /* test_accept */, result)) {
+        std::string strPrefix;
+        if (result.nFailedTx < txs.size()) {
+            strPrefix = txs[result.nFailedTx]->GetHash().GetHex() + ": ";
+        }
+        if (state.IsInvalid()) {
+            throw JSONRPCError(RPC_TRANSACTION_REJECTED, strPrefix + FormatStateMessage(state));
+        } else {
+            if (fMissingInputs) {
+                throw JSONRPCError(RPC_TRANSACTION_ERROR, strPrefix + "Missing inputs");
+            }
+            throw JSONRPCError(RPC_TRANSACTION_ERROR, strPrefix + FormatStateMessage(state));
+        }
+    }
+    // See sendrawtransaction
+    CallFunctionInValidationInterfaceQueue([&promise] {
+        promise.set_value();
+    });
+    } // cs_main
+
+    promise.get_future().wait();
+
+    if(!g_connman)
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+
+    RelayPackage(txs, g_connman.get());
+
+    UniValue txids(UniValue::VARR);
+    for (const CTransactionRef& tx : txs) {
+        txids.push_back(tx->GetHash().GetHex());
+    }
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("txids", txids);
+    ret.pushKV("fee", ValueFromAmount(result.nFees));
+    ret.pushKV("vsize", result.nVSize);
+    ret.pushKV("feerate", ValueFromAmount(CFeeRate(result.nFees, result.nVSize).GetFeePerK()));
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                            actor (function)            argNames
   //  --------------------- ------------------------        -----------------------     ----------
@@ -1111,6 +1319,8 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "decoderawtransaction",         &decoderawtransaction,      {"hexstring","iswitness"} },
     { "rawtransactions",    "decodescript",                 &decodescript,              {"hexstring"} },
     { "rawtransactions",    "sendrawtransaction",           &sendrawtransaction,        {"hexstring","allowhighfees"} },
+    { "rawtransactions",    "testmempoolaccept",            &testmempoolaccept,         {"rawtxs","allowhighfees"} },
+    { "rawtransactions",    "submitpackage",                &submitpackage,             {"rawtxs","allowhighfees"} },
     { "rawtransactions",    "combinerawtransaction",        &combinerawtransaction,     {"txs"} },
     { "rawtransactions",    "signrawtransaction",           &signrawtransaction,        {"hexstring","prevtxs","privkeys","sighashtype"} }, /* uses wallet if enabled */
     { "rawtransactions",    "signrawtransactionwithkey",    &signrawtransactionwithkey, {"hexstring","privkeys","prevtxs","sighashtype"} },
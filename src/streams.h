@@ -15,6 +15,7 @@
 #include <limits>
 #include <map>
 #include <set>
+#include <stdexcept>
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
@@ -71,9 +72,11 @@ OverrideStream<S> WithOrVersion(S* s, int nVersionFlag)
 
 /* Minimal stream for overwriting and/or appending to an existing byte vector
  *
- * The referenced vector will grow as necessary
+ * The referenced vector will grow as necessary. Vector is std::vector<unsigned char>
+ * (see CVectorWriter) or a prevector of unsigned char.
  */
-class CVectorWriter
+template<typename Vector>
+class CBasicVectorWriter
 {
  public:
 
@@ -84,7 +87,7 @@ class CVectorWriter
  * @param[in]  nPosIn Starting position. Vector index where writes should start. The vector will initially
  *                    grow as necessary to max(nPosIn, vec.size()). So to append, use vec.size().
 */
-    CVectorWriter(int nTypeIn, int nVersionIn, std::vector<unsigned char>& vchDataIn, size_t nPosIn) : nType(nTypeIn), nVersion(nVersionIn), vchData(vchDataIn), nPos(nPosIn)
+    CBasicVectorWriter(int nTypeIn, int nVersionIn, Vector& vchDataIn, size_t nPosIn) : nType(nTypeIn), nVersion(nVersionIn), vchData(vchDataIn), nPos(nPosIn)
     {
         if(nPos > vchData.size())
             vchData.resize(nPos);
@@ -94,7 +97,7 @@ class CVectorWriter
  * @param[in]  args  A list of items to serialize starting at nPosIn.
 */
     template <typename... Args>
-    CVectorWriter(int nTypeIn, int nVersionIn, std::vector<unsigned char>& vchDataIn, size_t nPosIn, Args&&... args) : CVectorWriter(nTypeIn, nVersionIn, vchDataIn, nPosIn)
+    CBasicVectorWriter(int nTypeIn, int nVersionIn, Vector& vchDataIn, size_t nPosIn, Args&&... args) : CBasicVectorWriter(nTypeIn, nVersionIn, vchDataIn, nPosIn)
     {
         ::SerializeMany(*this, std::forward<Args>(args)...);
     }
@@ -111,7 +114,7 @@ class CVectorWriter
         nPos += nSize;
     }
     template<typename T>
-    CVectorWriter& operator<<(const T& obj)
+    CBasicVectorWriter& operator<<(const T& obj)
     {
         // Serialize to this stream
         ::Serialize(*this, obj);
@@ -134,10 +137,58 @@ class CVectorWriter
 private:
     const int nType;
     const int nVersion;
-    std::vector<unsigned char>& vchData;
+    Vector& vchData;
     size_t nPos;
 };
 
+typedef CBasicVectorWriter<std::vector<unsigned char> > CVectorWriter;
+
+/** Minimal stream for reading from a byte array it does not own, such as a
+ *  memory-mapped file. The memory must outlive the stream.
+ */
+class CMemoryReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const unsigned char* pbegin;
+    const unsigned char* const pend;
+
+public:
+    CMemoryReader(int nTypeIn, int nVersionIn, const unsigned char* pbeginIn, size_t nSize) : nType(nTypeIn), nVersion(nVersionIn), pbegin(pbeginIn), pend(pbeginIn + nSize) {}
+
+    template<typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+
+    int GetVersion() const { return nVersion; }
+    int GetType() const { return nType; }
+
+    size_t size() const { return pend - pbegin; }
+    bool empty() const { return pbegin == pend; }
+
+    void read(char* dst, size_t n)
+    {
+        if (n > size()) {
+            throw std::ios_base::failure("CMemoryReader::read(): end of data");
+        }
+        memcpy(dst, pbegin, n);
+        pbegin += n;
+    }
+
+    void ignore(size_t n)
+    {
+        if (n > size()) {
+            throw std::ios_base::failure("CMemoryReader::ignore(): end of data");
+        }
+        pbegin += n;
+    }
+};
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -444,6 +495,88 @@ public:
 
 
 
+/** Read bits, most significant first, from a byte stream. */
+template<typename IStream>
+class BitStreamReader
+{
+private:
+    IStream& m_istream;
+    /** Byte last read from the stream */
+    uint8_t m_buffer;
+    /** Number of high order bits of m_buffer already returned */
+    int m_offset;
+
+public:
+    explicit BitStreamReader(IStream& istream) : m_istream(istream), m_buffer(0), m_offset(8) {}
+
+    /** Read nbits (at most 64) bits, returned in the low order bits of the result */
+    uint64_t Read(int nbits)
+    {
+        if (nbits < 0 || nbits > 64) {
+            throw std::out_of_range("BitStreamReader::Read(): nbits must be between 0 and 64");
+        }
+        uint64_t data = 0;
+        while (nbits > 0) {
+            if (m_offset == 8) {
+                m_istream >> m_buffer;
+                m_offset = 0;
+            }
+            const int bits = std::min(8 - m_offset, nbits);
+            data <<= bits;
+            data |= static_cast<uint8_t>(m_buffer << m_offset) >> (8 - bits);
+            m_offset += bits;
+            nbits -= bits;
+        }
+        return data;
+    }
+};
+
+/** Write bits, most significant first, to a byte stream. A partial last byte is padded with zeroes. */
+template<typename OStream>
+class BitStreamWriter
+{
+private:
+    OStream& m_ostream;
+    /** Byte being assembled */
+    uint8_t m_buffer;
+    /** Number of high order bits of m_buffer already written */
+    int m_offset;
+
+public:
+    explicit BitStreamWriter(OStream& ostream) : m_ostream(ostream), m_buffer(0), m_offset(0) {}
+    ~BitStreamWriter() { Flush(); }
+
+    /** Write the nbits (at most 64) low order bits of data */
+    void Write(uint64_t data, int nbits)
+    {
+        if (nbits < 0 || nbits > 64) {
+            throw std::out_of_range("BitStreamWriter::Write(): nbits must be between 0 and 64");
+        }
+        while (nbits > 0) {
+            const int bits = std::min(8 - m_offset, nbits);
+            m_buffer |= (data << (64 - nbits)) >> (64 - 8 + m_offset);
+            m_offset += bits;
+            nbits -= bits;
+            if (m_offset == 8) {
+                Flush();
+            }
+        }
+    }
+
+    /** Write out the byte being assembled, if any */
+    void Flush()
+    {
+        if (m_offset == 0) {
+            return;
+        }
+        m_ostream << m_buffer;
+        m_buffer = 0;
+        m_offset = 0;
+    }
+};
+
+
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -6,7 +6,10 @@
 #include <txdb.h>
 
 #include <chainparams.h>
+#include <checkqueue.h>
+#include <coinstats.h>
 #include <hash.h>
+#include <memusage.h>
 #include <random.h>
 #include <pow.h>
 #include <uint256.h>
@@ -23,12 +26,15 @@ static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_UTXO_STATS = 's';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_HEAD_BLOCKS = 'H';
+static const char DB_SNAPSHOT_LOADING = 'L';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_CLEAN_SHUTDOWN = 'S';
 
 namespace {
 
@@ -52,6 +58,44 @@ struct CoinEntry {
     }
 };
 
+/** A read of one coin from the coin database, done on the coin read threads. */
+class CCoinsReadCheck
+{
+private:
+    const CDBWrapper* db;
+    const COutPoint* outpoint;
+    CompressedCoin* coin;
+
+public:
+    CCoinsReadCheck() : db(nullptr), outpoint(nullptr), coin(nullptr) {}
+    CCoinsReadCheck(const CDBWrapper& dbIn, const COutPoint& outpointIn, CompressedCoin& coinIn) : db(&dbIn), outpoint(&outpointIn), coin(&coinIn) {}
+
+    bool operator()() {
+        try {
+            if (!db->Read(CoinEntry(outpoint), *coin)) {
+                coin->Clear();
+            }
+        } catch (const std::runtime_error& e) {
+            LogPrintf("Error reading from coin database: %s\n", e.what());
+            return false;
+        }
+        return true;
+    }
+
+    void swap(CCoinsReadCheck& check) {
+        std::swap(db, check.db);
+        std::swap(outpoint, check.outpoint);
+        std::swap(coin, check.coin);
+    }
+};
+
+}
+
+static CCheckQueue<CCoinsReadCheck> coinsreadqueue(MIN_COINS_PER_READ_THREAD);
+
+void ThreadCoinsRead() {
+    RenameThread("bitcoin-coinsrd");
+    coinsreadqueue.Thread();
 }
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
@@ -62,6 +106,45 @@ bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     return db.Read(CoinEntry(&outpoint), coin);
 }
 
+bool CCoinsViewDB::GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
+}
+
+size_t CCoinsViewDB::GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const {
+    coins.clear();
+    coins.resize(outpoints.size());
+    size_t found = 0;
+    if (outpoints.size() < 2 * MIN_COINS_PER_READ_THREAD) {
+        for (size_t i = 0; i < outpoints.size(); i++) {
+            if (db.Read(CoinEntry(&outpoints[i]), coins[i])) {
+                found++;
+            } else {
+                coins[i].Clear();
+            }
+        }
+        return found;
+    }
+
+    // LevelDB reads are thread-safe; hand the reads to the coin read
+    // threads, with this thread joining in once they are queued.
+    {
+        CCheckQueueControl<CCoinsReadCheck> control(&coinsreadqueue);
+        std::vector<CCoinsReadCheck> vChecks;
+        vChecks.reserve(outpoints.size());
+        for (size_t i = 0; i < outpoints.size(); i++) {
+            vChecks.emplace_back(db, outpoints[i], coins[i]);
+        }
+        control.Add(vChecks);
+        if (!control.Wait()) {
+            throw std::runtime_error("Failed to read coins from database");
+        }
+    }
+    for (const CompressedCoin& coin : coins) {
+        if (!coin.IsSpent()) found++;
+    }
+    return found;
+}
+
 bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
     return db.Exists(CoinEntry(&outpoint));
 }
@@ -142,12 +225,60 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return ret;
 }
 
+bool CCoinsViewDB::WriteSnapshotChunk(const std::vector<std::pair<COutPoint, Coin> > &vCoins, const uint256 &hashBlock, bool fFinal) {
+    CDBBatch batch(db);
+    // Until the final chunk is written, the database is marked as holding a
+    // partial snapshot, which is never used: it has neither a best block nor
+    // head blocks, and WipeSnapshot erases it at the next start.
+    batch.Write(DB_SNAPSHOT_LOADING, hashBlock);
+    for (const auto& it : vCoins) {
+        batch.Write(CoinEntry(&it.first), it.second);
+    }
+    if (fFinal) {
+        batch.Erase(DB_SNAPSHOT_LOADING);
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
+    LogPrint(BCLog::COINDB, "Writing snapshot batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    return db.WriteBatch(batch, fFinal);
+}
+
+bool CCoinsViewDB::IsSnapshotIncomplete() const {
+    return db.Exists(DB_SNAPSHOT_LOADING);
+}
+
+bool CCoinsViewDB::WipeSnapshot() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(DB_COIN);
+    CDBBatch batch(db);
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    while (pcursor->Valid()) {
+        COutPoint outpoint;
+        CoinEntry entry(&outpoint);
+        if (!pcursor->GetKey(entry) || entry.key != DB_COIN) {
+            break;
+        }
+        batch.Erase(entry);
+        if (batch.SizeEstimate() > batch_size) {
+            if (!db.WriteBatch(batch)) return false;
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    batch.Erase(DB_BEST_BLOCK);
+    batch.Erase(DB_HEAD_BLOCKS);
+    batch.Erase(DB_SNAPSHOT_LOADING);
+    return db.WriteBatch(batch, true);
+}
+
 size_t CCoinsViewDB::EstimateSize() const
 {
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+    nSyncInterval = std::max<int64_t>(0, gArgs.GetArg("-blocktreesyncinterval", DEFAULT_BLOCKTREE_SYNC_INTERVAL)) * 1000000;
+    nLastSync = GetTimeMicros();
+    fSyncPending = false;
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -166,28 +297,63 @@ bool CBlockTreeDB::ReadReindexing(bool &fReindexing) {
     return true;
 }
 
+bool CBlockTreeDB::WriteCleanShutdown(const uint256 &hashBestChain) {
+    if (!hashBestChain.IsNull())
+        return Write(DB_CLEAN_SHUTDOWN, hashBestChain, true);
+    else
+        return Erase(DB_CLEAN_SHUTDOWN, true);
+}
+
+bool CBlockTreeDB::ReadCleanShutdown(uint256 &hashBestChain) {
+    if (!Read(DB_CLEAN_SHUTDOWN, hashBestChain)) {
+        hashBestChain.SetNull();
+        return false;
+    }
+    return true;
+}
+
 bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
-    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper&>(db).NewIterator(), GetBestBlock());
+    return Cursor(0, 256);
+}
+
+CCoinsViewCursor *CCoinsViewDB::Cursor(unsigned int nBegin, unsigned int nEnd) const
+{
+    assert(nBegin <= nEnd && nEnd <= 256);
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper&>(db).NewIterator(), GetBestBlock(), nEnd);
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COIN);
+    if (nBegin == 0) {
+        i->pcursor->Seek(DB_COIN);
+    } else if (nBegin < 256) {
+        uint256 start;
+        *start.begin() = nBegin;
+        i->pcursor->Seek(std::make_pair(DB_COIN, start));
+    }
     // Cache key of first record
-    if (i->pcursor->Valid()) {
-        CoinEntry entry(&i->keyTmp.second);
-        i->pcursor->GetKey(entry);
-        i->keyTmp.first = entry.key;
+    if (nBegin < nEnd && i->pcursor->Valid()) {
+        i->CacheKey();
     } else {
         i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
     }
     return i;
 }
 
+void CCoinsViewDBCursor::CacheKey()
+{
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->GetKey(entry) || (entry.key == DB_COIN && *keyTmp.second.hash.begin() >= nEnd)) {
+        keyTmp.first = 0; // Invalidate cached key after last record of the shard so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
+}
+
 bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
@@ -216,15 +382,21 @@ bool CCoinsViewDBCursor::Valid() const
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    CoinEntry entry(&keyTmp.second);
-    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
+    if (!pcursor->Valid()) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
     } else {
-        keyTmp.first = entry.key;
+        CacheKey();
+    }
+}
+
+void CBlockTreeDB::MovePendingToBatch(CDBBatch& batch) {
+    for (const auto& entry : mapPendingUTXOStats) {
+        batch.Write(std::make_pair(DB_UTXO_STATS, entry.first), entry.second);
     }
+    mapPendingUTXOStats.clear();
 }
 
-bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, bool fForceSync) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
         batch.Write(std::make_pair(DB_BLOCK_FILES, it->first), *it->second);
@@ -233,17 +405,80 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(std::make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
-    return WriteBatch(batch, true);
+
+    LOCK(cs_pending);
+    MovePendingToBatch(batch);
+    int64_t nNow = GetTimeMicros();
+    bool fSync = fForceSync || nNow >= nLastSync + nSyncInterval;
+    if (!WriteBatch(batch, fSync))
+        return false;
+    if (fSync) {
+        nLastSync = nNow;
+        fSyncPending = false;
+    } else {
+        fSyncPending = true;
+    }
+    return true;
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
-    return Read(std::make_pair(DB_TXINDEX, txid), pos);
+void CBlockTreeDB::SyncIfDue() {
+    LOCK(cs_pending);
+    int64_t nNow = GetTimeMicros();
+    if (!fSyncPending || nNow < nLastSync + nSyncInterval)
+        return;
+    // LevelDB syncs its log on any synchronous write, so an empty batch suffices.
+    CDBBatch batch(*this);
+    WriteBatch(batch, true);
+    LogPrint(BCLog::BENCH, "Synced block index after %.2fs\n", (nNow - nLastSync) * 0.000001);
+    nLastSync = nNow;
+    fSyncPending = false;
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CBlockTreeDB::EraseLegacyTxIndex() {
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(std::make_pair(DB_TXINDEX, uint256()));
+
+    size_t batch_size = (size_t)gArgs.GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    CDBBatch batch(*this);
+    std::pair<char, uint256> key;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(key) || key.first != DB_TXINDEX) break;
+        batch.Erase(key);
+        if (batch.SizeEstimate() > batch_size) {
+            if (!WriteBatch(batch)) return false;
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    if (!WriteBatch(batch)) return false;
+    CompactRange(std::make_pair(DB_TXINDEX, uint256()), std::make_pair((char)(DB_TXINDEX + 1), uint256()));
+    return true;
+}
+
+bool CBlockTreeDB::ReadUTXOStats(const uint256 &hash, CCoinsStats &stats) {
+    {
+        LOCK(cs_pending);
+        std::map<uint256, CCoinsStats>::const_iterator it = mapPendingUTXOStats.find(hash);
+        if (it != mapPendingUTXOStats.end()) {
+            stats = it->second;
+            stats.hashBlock = hash;
+            return true;
+        }
+    }
+    if (!Read(std::make_pair(DB_UTXO_STATS, hash), stats))
+        return false;
+    stats.hashBlock = hash;
+    return true;
+}
+
+bool CBlockTreeDB::WriteUTXOStats(const uint256 &hash, const CCoinsStats &stats) {
+    LOCK(cs_pending);
+    mapPendingUTXOStats[hash] = stats;
+    if (memusage::DynamicUsage(mapPendingUTXOStats) <= MAX_BLOCKTREE_PENDING_USAGE)
+        return true;
     CDBBatch batch(*this);
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(std::make_pair(DB_TXINDEX, it->first), it->second);
+    MovePendingToBatch(batch);
     return WriteBatch(batch);
 }
 
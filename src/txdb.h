@@ -7,8 +7,10 @@
 #define BITCOIN_TXDB_H
 
 #include <coins.h>
+#include <coinstats.h>
 #include <dbwrapper.h>
 #include <chain.h>
+#include <sync.h>
 
 #include <map>
 #include <string>
@@ -29,14 +31,26 @@ static const int64_t nDefaultDbBatchSize = 16 << 20;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
 static const int64_t nMinDbCache = 4;
-//! Max memory allocated to block tree DB specific cache, if no -txindex (MiB)
+//! Max memory allocated to block tree DB specific cache (MiB)
 static const int64_t nMaxBlockDBCache = 2;
-//! Max memory allocated to block tree DB specific cache, if -txindex (MiB)
+//! Max memory allocated to tx index DB specific cache (MiB)
 // Unlike for the UTXO database, for the txindex scenario the leveldb cache make
 // a meaningful difference: https://github.com/bitcoin/bitcoin/pull/8273#issuecomment-229601991
-static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
+static const int64_t nMaxTxIndexCache = 1024;
+//! Max memory allocated to address index DB specific cache (MiB)
+static const int64_t nMaxAddrIndexCache = 1024;
+//! Max memory allocated to block filter index DB specific cache (MiB)
+static const int64_t nMaxFilterIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Max. number of threads batched coin lookups read the coin DB with
+static const int MAX_COINS_DB_READ_THREADS = 8;
+//! Number of coins a coin read thread takes from a batched lookup at a time
+static const size_t MIN_COINS_PER_READ_THREAD = 32;
+//! -blocktreesyncinterval default (seconds), 0 syncs every block index write
+static const int64_t DEFAULT_BLOCKTREE_SYNC_INTERVAL = 0;
+//! Max. memory of buffered UTXO statistics entries before they are written out (bytes)
+static const size_t MAX_BLOCKTREE_PENDING_USAGE = 16 << 20;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -63,6 +77,9 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/** Run a coin read thread, serving the large batched lookups of CCoinsViewDB::GetCoins. */
+void ThreadCoinsRead();
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB final : public CCoinsView
 {
@@ -72,15 +89,28 @@ public:
     explicit CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    //! Copies the stored encoding, which is the one caches keep coins in.
+    bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const override;
+    //! Reads large batches with several threads, to keep more requests in flight to the disk.
+    size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
+    //! Cursor over the shard of coins whose txid starts with a byte in [nBegin, nEnd), for scanning the set in parallel.
+    CCoinsViewCursor *Cursor(unsigned int nBegin, unsigned int nEnd) const;
 
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
+
+    //! Bulk-write coins of a UTXO set snapshot for hashBlock; the last chunk (fFinal) marks the database as being at hashBlock.
+    bool WriteSnapshotChunk(const std::vector<std::pair<COutPoint, Coin> > &vCoins, const uint256 &hashBlock, bool fFinal);
+    //! Whether the database holds the coins of a snapshot whose final chunk was never written.
+    bool IsSnapshotIncomplete() const;
+    //! Erase all coins and the best block, head blocks and partial snapshot markers.
+    bool WipeSnapshot();
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -97,10 +127,14 @@ public:
     void Next() override;
 
 private:
-    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+    CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn, unsigned int nEndIn):
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), nEnd(nEndIn) {}
     std::unique_ptr<CDBIterator> pcursor;
     std::pair<char, COutPoint> keyTmp;
+    //! First txid byte past the end of the shard (256 for no bound)
+    unsigned int nEnd;
+
+    void CacheKey();
 
     friend class CCoinsViewDB;
 };
@@ -114,16 +148,45 @@ public:
     CBlockTreeDB(const CBlockTreeDB&) = delete;
     CBlockTreeDB& operator=(const CBlockTreeDB&) = delete;
 
-    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    /** Write block file and block index entries, together with all buffered
+     *  UTXO statistics entries, in a single batch.
+     *  The batch is synced unless fForceSync is false and the last sync was
+     *  less than -blocktreesyncinterval ago; SyncIfDue then catches up later.
+     */
+    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, bool fForceSync = true);
+    /** Sync the database if a block index write has been waiting for longer than -blocktreesyncinterval. */
+    void SyncIfDue();
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &info);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindexing);
     bool ReadReindexing(bool &fReindexing);
-    bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &vect);
+    /** Record (or with a null hash, clear) the chain tip of a clean shutdown. Always synced. */
+    bool WriteCleanShutdown(const uint256 &hashBestChain);
+    bool ReadCleanShutdown(uint256 &hashBestChain);
+    /** Erase the transaction index that older versions kept in this database (see TxIndex). */
+    bool EraseLegacyTxIndex();
+    bool ReadUTXOStats(const uint256 &hash, CCoinsStats &stats);
+    bool WriteUTXOStats(const uint256 &hash, const CCoinsStats &stats);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+
+private:
+    /** Write the buffered entries into batch and clear the buffers. */
+    void MovePendingToBatch(CDBBatch& batch);
+
+    /** UTXO statistics entries are only buffered here when a block is connected, and written out with the next block index
+     *  write (which always precedes a chainstate flush, so they are on disk
+     *  for every block the chainstate on disk includes), or once the buffer
+     *  exceeds MAX_BLOCKTREE_PENDING_USAGE. Reads consult the buffer first.
+     */
+    CCriticalSection cs_pending;
+    std::map<uint256, CCoinsStats> mapPendingUTXOStats;
+
+    //! Sync interval (microseconds), time of the last sync, and whether a write is waiting for one.
+    int64_t nSyncInterval;
+    int64_t nLastSync;
+    bool fSyncPending;
 };
 
 #endif // BITCOIN_TXDB_H
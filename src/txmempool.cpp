@@ -18,11 +18,17 @@
 #include <utilmoneystr.h>
 #include <utiltime.h>
 
+/** TrimToSize evicts down to 1/TRIM_HEADROOM_DIVISOR below the size limit */
+static const size_t TRIM_HEADROOM_DIVISOR = 100;
+
+/** Past this many additions, extending the last block template saves little over assembling a new one */
+static const size_t MAX_TEMPLATE_JOURNAL_SIZE = 10000;
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
-    tx(_tx), nFee(_nFee), nTime(_nTime), entryHeight(_entryHeight),
-    spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp)
+    tx(_tx), nFee(_nFee), nTime(_nTime), lockPoints(lp), sigOpCost(_sigOpsCost),
+    entryHeight(_entryHeight), spendsCoinbase(_spendsCoinbase), m_epoch(0)
 {
     nTxWeight = GetTransactionWeight(*tx);
     nUsageSize = RecursiveDynamicUsage(tx);
@@ -61,39 +67,50 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const EpochGuard epoch(*this);
+    std::vector<txiter>& stageEntries = m_stage_scratch;
+    std::vector<txiter> vAllDescendants;
+    stageEntries.clear();
+    for (const CTxMemPoolEntry* child : GetMemPoolChildren(updateIt)) {
+        const txiter childEntry = mapTx.iterator_to(*child);
+        visited(childEntry);
+        stageEntries.push_back(childEntry);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        for (const txiter childEntry : setChildren) {
+        const txiter cit = stageEntries.back();
+        stageEntries.pop_back();
+        vAllDescendants.push_back(cit);
+        for (const CTxMemPoolEntry* child : GetMemPoolChildren(cit)) {
+            const txiter childEntry = mapTx.iterator_to(*child);
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
                 // but don't traverse again.
                 for (const txiter cacheEntry : cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!visited(cacheEntry)) {
+                        vAllDescendants.push_back(cacheEntry);
+                    }
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (!visited(childEntry)) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                stageEntries.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
-    // Update and add to cached descendant map
+    // vAllDescendants now contains all in-mempool descendants of updateIt.
+    // Update and add to cached descendant map. The cache entry is created
+    // even if it stays empty, so that later walks don't descend into it.
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    for (txiter cit : setAllDescendants) {
+    std::vector<txiter>& vCached = cachedDescendants[updateIt];
+    for (txiter cit : vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            vCached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
@@ -124,36 +141,44 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // setMemPoolChildren will be updated, an assumption made in
     // UpdateForDescendants.
     for (const uint256 &hash : reverse_iterate(vHashesToUpdate)) {
-        // we cache the in-mempool children to avoid duplicate updates
-        setEntries setChildren;
         // calculate children from mapNextTx
         txiter it = mapTx.find(hash);
         if (it == mapTx.end()) {
             continue;
         }
-        auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
-        // First calculate the children, and update setMemPoolChildren to
-        // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
-            const uint256 &childHash = iter->second->GetHash();
-            txiter childIter = mapTx.find(childHash);
-            assert(childIter != mapTx.end());
-            // We can skip updating entries we've encountered before or that
-            // are in the block (which are already accounted for).
-            if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
-                UpdateChild(it, childIter, true);
-                UpdateParent(childIter, it, true);
+        {
+            // the epoch marks the children already seen, to avoid duplicate updates
+            const EpochGuard epoch(*this);
+            auto iter = mapNextTx.lower_bound(COutPoint(hash, 0));
+            // First calculate the children, and update setMemPoolChildren to
+            // include them, and update their setMemPoolParents to include this tx.
+            for (; iter != mapNextTx.end() && iter->first->hash == hash; ++iter) {
+                const uint256 &childHash = iter->second->GetHash();
+                txiter childIter = mapTx.find(childHash);
+                assert(childIter != mapTx.end());
+                // We can skip updating entries we've encountered before or that
+                // are in the block (which are already accounted for).
+                if (!visited(childIter) && !setAlreadyIncluded.count(childHash)) {
+                    UpdateChild(it, childIter, true);
+                    UpdateParent(childIter, it, true);
+                }
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+    // The ancestor and descendant state changed, so snapshots are out of date
+    ++nTransactionsUpdated;
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
     LOCK(cs);
+    const EpochGuard epoch(*this);
 
-    setEntries parentHashes;
+    // Ancestors found but not walked yet; together with setAncestors these
+    // are the entries visited so far
+    std::vector<txiter>& parentHashes = m_stage_scratch;
+    parentHashes.clear();
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -162,8 +187,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
+            if (piter != mapTx.end() && !visited(piter)) {
+                parentHashes.push_back(piter);
                 if (parentHashes.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
@@ -174,16 +199,21 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (const CTxMemPoolEntry* parent : GetMemPoolParents(it)) {
+            const txiter piter = mapTx.iterator_to(*parent);
+            visited(piter);
+            parentHashes.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
+    uint64_t nVisited = parentHashes.size();
 
     while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+        txiter stageit = parentHashes.back();
+        parentHashes.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -197,13 +227,14 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        for (const txiter &phash : setMemPoolParents) {
+        for (const CTxMemPoolEntry* parent : GetMemPoolParents(stageit)) {
+            const txiter phash = mapTx.iterator_to(*parent);
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!visited(phash)) {
+                parentHashes.push_back(phash);
+                nVisited++;
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (nVisited + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -215,10 +246,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
-    for (txiter piter : parentIters) {
-        UpdateChild(piter, it, add);
+    for (const CTxMemPoolEntry* parent : GetMemPoolParents(it)) {
+        UpdateChild(mapTx.iterator_to(*parent), it, add);
     }
     const int64_t updateCount = (add ? 1 : -1);
     const int64_t updateSize = updateCount * it->GetTxSize();
@@ -244,9 +274,8 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries &setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    for (txiter updateIt : setMemPoolChildren) {
-        UpdateParent(updateIt, it, false);
+    for (const CTxMemPoolEntry* child : GetMemPoolChildren(it)) {
+        UpdateParent(mapTx.iterator_to(*child), it, false);
     }
 }
 
@@ -259,18 +288,31 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not the parent and child links (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
+        // Descendants that are being removed as well are walked through
+        // but not updated, as nothing reads their state any more.
         for (txiter removeIt : entriesToRemove) {
-            setEntries setDescendants;
-            CalculateDescendants(removeIt, setDescendants);
-            setDescendants.erase(removeIt); // don't update state for self
+            const EpochGuard epoch(*this);
+            std::vector<txiter>& stage = m_stage_scratch;
+            stage.assign(1, removeIt);
+            visited(removeIt);
             int64_t modifySize = -((int64_t)removeIt->GetTxSize());
             CAmount modifyFee = -removeIt->GetModifiedFee();
             int modifySigOps = -removeIt->GetSigOpCost();
-            for (txiter dit : setDescendants) {
-                mapTx.modify(dit, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+            while (!stage.empty()) {
+                txiter it = stage.back();
+                stage.pop_back();
+                if (it != removeIt && !entriesToRemove.count(it)) { // don't update state for self
+                    mapTx.modify(it, update_ancestor_state(modifySize, modifyFee, -1, modifySigOps));
+                }
+                for (const CTxMemPoolEntry* child : GetMemPoolChildren(it)) {
+                    const txiter childiter = mapTx.iterator_to(*child);
+                    if (!visited(childiter)) {
+                        stage.push_back(childiter);
+                    }
+                }
             }
         }
     }
@@ -284,18 +326,26 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of 
+        // of ancestors reachable via m_parents will be the same as the set of 
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then m_parents will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the m_parents notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        // Ancestors that are being removed as well need no update.
+        for (auto it = setAncestors.begin(); it != setAncestors.end(); ) {
+            if (entriesToRemove.count(*it)) {
+                it = setAncestors.erase(it);
+            } else {
+                ++it;
+            }
+        }
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.
         UpdateAncestorsOf(false, removeIt, setAncestors);
@@ -329,7 +379,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), m_epoch(0), m_has_epoch_guard(false), fTemplateJournal(false)
 {
     _clear(); //lock free clear
 
@@ -339,6 +389,18 @@ CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
     nCheckFrequency = 0;
 }
 
+CTxMemPool::EpochGuard::EpochGuard(const CTxMemPool& in) : pool(in)
+{
+    assert(!pool.m_has_epoch_guard);
+    ++pool.m_epoch;
+    pool.m_has_epoch_guard = true;
+}
+
+CTxMemPool::EpochGuard::~EpochGuard()
+{
+    pool.m_has_epoch_guard = false;
+}
+
 bool CTxMemPool::isSpent(const COutPoint& outpoint)
 {
     LOCK(cs);
@@ -365,7 +427,6 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -413,12 +474,21 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
 
+    if (fTemplateJournal) {
+        if (vTemplateJournal.size() < MAX_TEMPLATE_JOURNAL_SIZE) {
+            vTemplateJournal.push_back(hash);
+        } else {
+            StopTemplateJournal();
+        }
+    }
+
     return true;
 }
 
 void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 {
     NotifyEntryRemoved(it->GetSharedTx(), reason);
+    StopTemplateJournal();
     const uint256 hash = it->GetTx().GetHash();
     for (const CTxIn& txin : it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
@@ -434,8 +504,7 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    cachedInnerUsage -= memusage::DynamicUsage(it->m_parents) + memusage::DynamicUsage(it->m_children);
     mapTx.erase(it);
     nTransactionsUpdated++;
     if (minerPolicyEstimator) {minerPolicyEstimator->removeTx(hash, false);}
@@ -449,22 +518,23 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    // Entries go into setDescendants when they are staged, so that the
+    // insertion doubles as the check whether they were seen before.
+    std::vector<txiter> stage;
+    if (setDescendants.insert(entryit).second) {
+        stage.push_back(entryit);
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
     while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        for (const txiter &childiter : setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+        txiter it = stage.back();
+        stage.pop_back();
+
+        for (const CTxMemPoolEntry* child : GetMemPoolChildren(it)) {
+            const txiter childiter = mapTx.iterator_to(*child);
+            if (setDescendants.insert(childiter).second) {
+                stage.push_back(childiter);
             }
         }
     }
@@ -573,14 +643,16 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
     }
     // Before the txs in the new block have been removed from the mempool, update policy estimates
     if (minerPolicyEstimator) {minerPolicyEstimator->processBlock(nBlockHeight, entries);}
+    // Remove all of the block's transactions in one go, so that the
+    // descendant and ancestor state of what stays behind is updated once
+    // rather than once per transaction of a chain
+    setEntries stage;
+    for (const CTxMemPoolEntry* entry : entries) {
+        stage.insert(mapTx.iterator_to(*entry));
+    }
+    RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
     for (const auto& tx : vtx)
     {
-        txiter it = mapTx.find(tx->GetHash());
-        if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
-        }
         removeConflicts(*tx);
         ClearPrioritisation(tx->GetHash());
     }
@@ -590,7 +662,6 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -598,6 +669,7 @@ void CTxMemPool::_clear()
     lastRollingFeeUpdate = GetTime();
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
+    StopTemplateJournal();
     ++nTransactionsUpdated;
 }
 
@@ -639,10 +711,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        innerUsage += memusage::DynamicUsage(it->m_parents) + memusage::DynamicUsage(it->m_children);
+        assert(std::is_sorted(it->m_parents.begin(), it->m_parents.end()));
+        assert(std::is_sorted(it->m_children.begin(), it->m_children.end()));
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -668,7 +739,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == it->m_parents.size());
+        for (const CTxMemPoolEntry* parent : it->m_parents) {
+            assert(setParentCheck.count(mapTx.iterator_to(*parent)));
+        }
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -701,7 +775,10 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == it->m_children.size());
+        for (const CTxMemPoolEntry* child : it->m_children) {
+            assert(setChildrenCheck.count(mapTx.iterator_to(*child)));
+        }
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -814,6 +891,172 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
+static CTxMemPoolSnapshot::Entry MakeSnapshotEntry(const CTxMemPoolEntry& e)
+{
+    CTxMemPoolSnapshot::Entry entry;
+    entry.tx = e.GetSharedTx();
+    entry.nFee = e.GetFee();
+    entry.nModFee = e.GetModifiedFee();
+    entry.nTxSize = e.GetTxSize();
+    entry.nTime = e.GetTime();
+    entry.nHeight = e.GetHeight();
+    entry.nCountWithDescendants = e.GetCountWithDescendants();
+    entry.nSizeWithDescendants = e.GetSizeWithDescendants();
+    entry.nModFeesWithDescendants = e.GetModFeesWithDescendants();
+    entry.nCountWithAncestors = e.GetCountWithAncestors();
+    entry.nSizeWithAncestors = e.GetSizeWithAncestors();
+    entry.nModFeesWithAncestors = e.GetModFeesWithAncestors();
+    return entry;
+}
+
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    auto snapshot = std::make_shared<CTxMemPoolSnapshot>();
+    std::vector<const CTxMemPoolEntry*> vSources;
+    std::vector<std::pair<CTxMemPoolEntry::Links, CTxMemPoolEntry::Links>> vLinks;
+    {
+        LOCK(cs);
+        if (m_snapshot && m_snapshot->nTransactionsUpdated == nTransactionsUpdated) {
+            return m_snapshot;
+        }
+        snapshot->nTransactionsUpdated = nTransactionsUpdated;
+        snapshot->vEntries.reserve(mapTx.size());
+        vSources.reserve(mapTx.size());
+        vLinks.reserve(mapTx.size());
+        for (const CTxMemPoolEntry& e : mapTx) {
+            snapshot->vEntries.push_back(MakeSnapshotEntry(e));
+            vSources.push_back(&e);
+            vLinks.emplace_back(e.m_parents, e.m_children);
+        }
+    }
+    snapshot->Index(vSources, vLinks);
+
+    // Let the snapshot this one replaces be freed outside cs
+    std::shared_ptr<const CTxMemPoolSnapshot> old;
+    LOCK(cs);
+    if (snapshot->nTransactionsUpdated == nTransactionsUpdated) {
+        old.swap(m_snapshot);
+        m_snapshot = snapshot;
+    }
+    return snapshot;
+}
+
+std::unique_ptr<CTxMemPoolSnapshot> CTxMemPool::GetSnapshot(const std::vector<uint256>& vHashes, bool fLinked) const
+{
+    std::unique_ptr<CTxMemPoolSnapshot> snapshot(new CTxMemPoolSnapshot());
+    std::vector<const CTxMemPoolEntry*> vSources;
+    std::vector<std::pair<CTxMemPoolEntry::Links, CTxMemPoolEntry::Links>> vLinks;
+    {
+        LOCK(cs);
+        snapshot->nTransactionsUpdated = nTransactionsUpdated;
+        std::set<const CTxMemPoolEntry*> setCopied;
+        auto copy = [&](const CTxMemPoolEntry& e) {
+            if (!setCopied.insert(&e).second) return;
+            snapshot->vEntries.push_back(MakeSnapshotEntry(e));
+            vSources.push_back(&e);
+            if (fLinked) vLinks.emplace_back(e.m_parents, e.m_children);
+        };
+        for (const uint256& hash : vHashes) {
+            indexed_transaction_set::const_iterator it = mapTx.find(hash);
+            if (it == mapTx.end()) continue;
+            copy(*it);
+            if (fLinked) {
+                for (const CTxMemPoolEntry* parent : it->m_parents) copy(*parent);
+                for (const CTxMemPoolEntry* child : it->m_children) copy(*child);
+            }
+        }
+    }
+    snapshot->Index(vSources, vLinks);
+    return snapshot;
+}
+
+void CTxMemPoolSnapshot::Index(const std::vector<const CTxMemPoolEntry*>& vSources,
+                               const std::vector<std::pair<CTxMemPoolEntry::Links, CTxMemPoolEntry::Links>>& vLinks)
+{
+    // Sort as DepthAndScoreComparator does. The source entries may be gone
+    // by now: their addresses are only used to match up the links.
+    std::vector<uint32_t> vOrder(vEntries.size());
+    for (uint32_t i = 0; i < vOrder.size(); i++) vOrder[i] = i;
+    std::sort(vOrder.begin(), vOrder.end(), [this](uint32_t i, uint32_t j) {
+        const Entry& a = vEntries[i];
+        const Entry& b = vEntries[j];
+        if (a.nCountWithAncestors != b.nCountWithAncestors) {
+            return a.nCountWithAncestors < b.nCountWithAncestors;
+        }
+        double f1 = (double)a.nFee * b.nTxSize;
+        double f2 = (double)b.nFee * a.nTxSize;
+        if (f1 == f2) {
+            return b.tx->GetHash() < a.tx->GetHash();
+        }
+        return f1 > f2;
+    });
+
+    std::vector<Entry> vSorted;
+    vSorted.reserve(vEntries.size());
+    for (uint32_t i : vOrder) {
+        vSorted.push_back(std::move(vEntries[i]));
+    }
+    vEntries.swap(vSorted);
+
+    mapIndex.reserve(vEntries.size());
+    for (uint32_t i = 0; i < vEntries.size(); i++) {
+        mapIndex.emplace(vEntries[i].tx->GetHash(), i);
+    }
+
+    if (!vLinks.empty()) {
+        std::unordered_map<const CTxMemPoolEntry*, uint32_t> mapSource;
+        mapSource.reserve(vSources.size());
+        for (uint32_t i = 0; i < vOrder.size(); i++) {
+            mapSource.emplace(vSources[vOrder[i]], i);
+        }
+        for (uint32_t i = 0; i < vOrder.size(); i++) {
+            const auto& links = vLinks[vOrder[i]];
+            for (const CTxMemPoolEntry* parent : links.first) {
+                auto it = mapSource.find(parent);
+                if (it != mapSource.end()) vEntries[i].vParents.push_back(it->second);
+            }
+            for (const CTxMemPoolEntry* child : links.second) {
+                auto it = mapSource.find(child);
+                if (it != mapSource.end()) vEntries[i].vChildren.push_back(it->second);
+            }
+        }
+    }
+
+    nUsage = memusage::DynamicUsage(vEntries) + memusage::DynamicUsage(mapIndex);
+    for (const Entry& entry : vEntries) {
+        nUsage += memusage::DynamicUsage(entry.vParents) + memusage::DynamicUsage(entry.vChildren);
+    }
+}
+
+bool CTxMemPoolSnapshot::Find(const uint256& txid, uint32_t& index) const
+{
+    auto it = mapIndex.find(txid);
+    if (it == mapIndex.end()) return false;
+    index = it->second;
+    return true;
+}
+
+std::vector<uint32_t> CTxMemPoolSnapshot::Walk(uint32_t index, std::vector<uint32_t> Entry::*links) const
+{
+    std::vector<bool> vSeen(vEntries.size());
+    std::vector<uint32_t> vResult;
+    std::vector<uint32_t> vWalk{index};
+    vSeen[index] = true;
+    while (!vWalk.empty()) {
+        uint32_t i = vWalk.back();
+        vWalk.pop_back();
+        for (uint32_t link : vEntries[i].*links) {
+            if (!vSeen[link]) {
+                vSeen[link] = true;
+                vResult.push_back(link);
+                vWalk.push_back(link);
+            }
+        }
+    }
+    std::sort(vResult.begin(), vResult.end());
+    return vResult;
+}
+
 CTransactionRef CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -836,6 +1079,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
 {
     {
         LOCK(cs);
+        StopTemplateJournal();
         CAmount &delta = mapDeltas[hash];
         delta += nFeeDelta;
         txiter it = mapTx.find(hash);
@@ -878,6 +1122,27 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+void CTxMemPool::StartTemplateJournal()
+{
+    LOCK(cs);
+    fTemplateJournal = true;
+    vTemplateJournal.clear();
+}
+
+void CTxMemPool::StopTemplateJournal()
+{
+    fTemplateJournal = false;
+    vTemplateJournal.clear();
+}
+
+bool CTxMemPool::GetTemplateJournal(std::vector<uint256>& vAdded) const
+{
+    LOCK(cs);
+    if (!fTemplateJournal) return false;
+    vAdded = vTemplateJournal;
+    return true;
+}
+
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 {
     for (unsigned int i = 0; i < tx.vin.size(); i++)
@@ -904,10 +1169,56 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     return base->GetCoin(outpoint, coin);
 }
 
+bool CCoinsViewMemPool::GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const {
+    // See GetCoin.
+    CTransactionRef ptx = mempool.get(outpoint.hash);
+    if (ptx) {
+        if (outpoint.n < ptx->vout.size()) {
+            coin = CompressedCoin(Coin(ptx->vout[outpoint.n], MEMPOOL_HEIGHT, false));
+            return true;
+        } else {
+            return false;
+        }
+    }
+    return base->GetCompressedCoin(outpoint, coin);
+}
+
+size_t CCoinsViewMemPool::GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const {
+    // Outputs of mempool transactions are served from the mempool, as in
+    // GetCoin; the remaining outpoints are passed down in one batch.
+    size_t found = 0;
+    coins.clear();
+    coins.resize(outpoints.size());
+    std::vector<COutPoint> chain_outpoints;
+    std::vector<size_t> chain_pos;
+    for (size_t i = 0; i < outpoints.size(); i++) {
+        CTransactionRef ptx = mempool.get(outpoints[i].hash);
+        if (ptx) {
+            if (outpoints[i].n < ptx->vout.size()) {
+                coins[i] = CompressedCoin(Coin(ptx->vout[outpoints[i].n], MEMPOOL_HEIGHT, false));
+                found++;
+            }
+        } else {
+            chain_outpoints.push_back(outpoints[i]);
+            chain_pos.push_back(i);
+        }
+    }
+    if (chain_outpoints.empty()) return found;
+
+    std::vector<CompressedCoin> chain_coins;
+    found += base->GetCoins(chain_outpoints, chain_coins);
+    for (size_t j = 0; j < chain_outpoints.size(); j++) {
+        coins[chain_pos[j]] = std::move(chain_coins[j]);
+    }
+    return found;
+}
+
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // A mapTx node holds the entry, two pointers for the hashed index and
+    // three for each of the three ordered indexes; the hashed index adds a
+    // bucket array of one pointer per bucket.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 11 * sizeof(void*)) * mapTx.size() + memusage::MallocUsage((mapTx.bucket_count() + 1) * sizeof(void*)) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) + memusage::DynamicUsage(vTemplateJournal) + cachedInnerUsage + (m_snapshot ? m_snapshot->DynamicMemoryUsage() : 0);
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
@@ -921,15 +1232,13 @@ void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPool
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
+    // Descendants of expired transactions entered later, so most of them
+    // are expired too; staging them all in one set walks each just once.
+    setEntries stage;
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
+        CalculateDescendants(mapTx.project<0>(it), stage);
         it++;
     }
-    setEntries stage;
-    for (txiter removeit : toremove) {
-        CalculateDescendants(removeit, stage);
-    }
     RemoveStaged(stage, false, MemPoolRemovalReason::EXPIRY);
     return stage.size();
 }
@@ -944,40 +1253,43 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
     return addUnchecked(hash, entry, setAncestors, validFeeEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLinks(CTxMemPoolEntry::Links& links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    const CTxMemPoolEntry* ptr = &*link;
+    CTxMemPoolEntry::Links::iterator pos = std::lower_bound(links.begin(), links.end(), ptr);
+    const bool present = pos != links.end() && *pos == ptr;
+    if (add == present) return;
+    cachedInnerUsage -= memusage::DynamicUsage(links);
+    if (add) {
+        links.insert(pos, ptr);
+    } else {
+        links.erase(pos);
+        if (links.size() * 2 < links.capacity())
+            links.shrink_to_fit();
     }
+    cachedInnerUsage += memusage::DynamicUsage(links);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLinks(entry->m_children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLinks(entry->m_parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPoolEntry::Links& CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    return entry->m_parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPoolEntry::Links& CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    return entry->m_children;
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1012,25 +1324,76 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
+size_t CTxMemPool::EntryDynamicUsage(txiter it) const
+{
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 11 * sizeof(void*)) + it->DynamicMemoryUsage() +
+        memusage::DynamicUsage(it->m_parents) + memusage::DynamicUsage(it->m_children) +
+        it->GetTx().vin.size() * memusage::IncrementalDynamicUsage(mapNextTx) + sizeof(vTxHashes[0]);
+}
+
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
+    std::shared_ptr<const CTxMemPoolSnapshot> stale; // freed outside cs
     LOCK(cs);
 
+    // No caller can be handed a stale snapshot anymore, so it only takes up
+    // room that transactions could use
+    if (m_snapshot && m_snapshot->nTransactionsUpdated != nTransactionsUpdated) {
+        stale.swap(m_snapshot);
+    }
+
+    size_t usage = DynamicMemoryUsage();
+    if (usage <= sizelimit) return;
+    const size_t target = sizelimit - sizelimit / TRIM_HEADROOM_DIVISOR;
+
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
-
-        // We set the new mempool min fee to the feerate of the removed set, plus the
-        // "minimum reasonable fee rate" (ie some value under which we consider txn
-        // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
-        // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += incrementalRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
-
+    while (!mapTx.empty() && usage > target) {
+        // Stage the worst packages until they add up to the excess, and
+        // remove them at once. Their descendants go into the one stage, so
+        // a package that was already staged as part of another is skipped.
+        // The score of an entry only changes when some of its descendants
+        // are removed, so the batch ends before the first package that
+        // overlaps the stage: its score is rechecked in the next batch.
         setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        size_t freed = 0;
+        for (auto it = mapTx.get<descendant_score>().begin(); it != mapTx.get<descendant_score>().end() && freed < usage - target; ++it) {
+            txiter root = mapTx.project<0>(it);
+            if (stage.count(root)) continue;
+
+            // Gather the package as CalculateDescendants would
+            setEntries package{root};
+            std::vector<txiter> vWalk{root};
+            bool fOverlaps = false;
+            while (!vWalk.empty() && !fOverlaps) {
+                txiter entry = vWalk.back();
+                vWalk.pop_back();
+                for (const CTxMemPoolEntry* child : GetMemPoolChildren(entry)) {
+                    txiter childit = mapTx.iterator_to(*child);
+                    if (stage.count(childit)) {
+                        fOverlaps = true;
+                        break;
+                    }
+                    if (package.insert(childit).second) {
+                        vWalk.push_back(childit);
+                    }
+                }
+            }
+            if (fOverlaps) break;
+
+            // We set the new mempool min fee to the feerate of the removed set, plus the
+            // "minimum reasonable fee rate" (ie some value under which we consider txn
+            // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
+            // equal to txn which were removed with no block in between.
+            CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+            removed += incrementalRelayFee;
+            maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+            for (txiter entry : package) {
+                freed += EntryDynamicUsage(entry);
+            }
+            stage.insert(package.begin(), package.end());
+        }
+        trackPackageRemoved(maxFeeRateRemoved);
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -1048,6 +1411,7 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
                 }
             }
         }
+        usage = DynamicMemoryUsage();
     }
 
     if (maxFeeRateRemoved > CFeeRate(0)) {
@@ -9,6 +9,7 @@
 #include <memory>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 #include <string>
@@ -63,15 +64,16 @@ class CTxMemPool;
 
 class CTxMemPoolEntry
 {
+public:
+    /** In-mempool parents or children of an entry, sorted by address */
+    typedef std::vector<const CTxMemPoolEntry*> Links;
+
 private:
+    // Members are ordered and sized to keep the entry small: every mempool
+    // transaction carries one.
     CTransactionRef tx;
     CAmount nFee;              //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxWeight;          //!< ... and avoid recomputing tx weight (also used for GetTxSize())
-    size_t nUsageSize;         //!< ... and total memory usage
     int64_t nTime;             //!< Local time when entering the mempool
-    unsigned int entryHeight;  //!< Chain height when entering the mempool
-    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
-    int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
 
@@ -88,6 +90,12 @@ private:
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCostWithAncestors;
 
+    uint32_t nTxWeight;        //!< ... and avoid recomputing tx weight (also used for GetTxSize())
+    uint32_t nUsageSize;       //!< ... and total memory usage
+    int32_t sigOpCost;         //!< Total sigop cost
+    unsigned int entryHeight;  //!< Chain height when entering the mempool
+    bool spendsCoinbase;       //!< keep track of transactions that spend a coinbase
+
 public:
     CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                     int64_t _nTime, unsigned int _entryHeight,
@@ -127,7 +135,10 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable Links m_parents;  //!< In-mempool parents, maintained by CTxMemPool
+    mutable Links m_children; //!< In-mempool children, maintained by CTxMemPool
+    mutable uint64_t m_epoch; //!< Epoch of the last mempool traversal that visited this entry
+    mutable uint32_t vTxHashesIdx; //!< Index in mempool's vTxHashes
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -365,6 +376,60 @@ public:
     }
 };
 
+/**
+ * A copy of the mempool entries that queries and relay read without holding
+ * the mempool lock. Entries are in depth and score order, the order in which
+ * transactions are announced, and refer to their in-snapshot parents and
+ * children by index. Links to entries left out of a partial snapshot are
+ * dropped.
+ */
+class CTxMemPoolSnapshot
+{
+public:
+    struct Entry
+    {
+        CTransactionRef tx;
+        CAmount nFee;
+        CAmount nModFee;
+        size_t nTxSize;
+        int64_t nTime;
+        unsigned int nHeight;
+        uint64_t nCountWithDescendants;
+        uint64_t nSizeWithDescendants;
+        CAmount nModFeesWithDescendants;
+        uint64_t nCountWithAncestors;
+        uint64_t nSizeWithAncestors;
+        CAmount nModFeesWithAncestors;
+        std::vector<uint32_t> vParents;
+        std::vector<uint32_t> vChildren;
+
+        TxMempoolInfo GetInfo() const { return TxMempoolInfo{tx, nTime, CFeeRate(nFee, nTxSize), nModFee - nFee}; }
+    };
+
+    std::vector<Entry> vEntries;
+    /** The mempool's GetTransactionsUpdated() when the snapshot was taken */
+    unsigned int nTransactionsUpdated = 0;
+
+    /** Look up a transaction; false if it was not in the snapshot */
+    bool Find(const uint256& txid, uint32_t& index) const;
+    /** In-snapshot ancestors or descendants of an entry, not including it, in snapshot order */
+    std::vector<uint32_t> CalculateAncestors(uint32_t index) const { return Walk(index, &Entry::vParents); }
+    std::vector<uint32_t> CalculateDescendants(uint32_t index) const { return Walk(index, &Entry::vChildren); }
+    /** Memory used by the snapshot, not counting the transactions, which it shares with the mempool */
+    size_t DynamicMemoryUsage() const { return nUsage; }
+
+private:
+    std::unordered_map<uint256, uint32_t, SaltedTxidHasher> mapIndex;
+    size_t nUsage = 0;
+
+    std::vector<uint32_t> Walk(uint32_t index, std::vector<uint32_t> Entry::*links) const;
+    /** Sort the entries and turn the links copied from the mempool entries into indexes */
+    void Index(const std::vector<const CTxMemPoolEntry*>& vSources,
+               const std::vector<std::pair<CTxMemPoolEntry::Links, CTxMemPoolEntry::Links>>& vLinks);
+
+    friend class CTxMemPool;
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain transactions
  * that may be included in the next block.
@@ -392,18 +457,19 @@ public:
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
- * each CTxMemPoolEntry, we track the size and fees of all descendants.
+ * the in-mempool direct parents and direct children of each CTxMemPoolEntry
+ * in its m_parents and m_children.  Within each CTxMemPoolEntry, we also
+ * track the size and fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
  * children (because any such children would be an orphan).  So in
  * addUnchecked(), we:
- * - update a new entry's setMemPoolParents to include all in-mempool parents
+ * - update a new entry's m_parents to include all in-mempool parents
  * - update the new entry's direct parents to include the new tx as a child
  * - update all ancestors of the transaction to include the new tx's size/fee
  *
  * When a transaction is removed from the mempool, we must:
- * - update all in-mempool parents to not track the tx in setMemPoolChildren
+ * - update all in-mempool parents to not track the tx in m_children
  * - update all ancestors to not include the tx's size/fees in descendant state
  * - update all in-mempool children to not include it as a parent
  *
@@ -425,7 +491,7 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * m_parents and m_children may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -453,6 +519,16 @@ private:
 
     void trackPackageRemoved(const CFeeRate& rate);
 
+    mutable uint64_t m_epoch;          //!< Epoch of the current or last traversal, see EpochGuard
+    mutable bool m_has_epoch_guard;    //!< Whether a traversal is in progress
+
+    bool fTemplateJournal;                 //!< Whether additions are being recorded, see StartTemplateJournal()
+    std::vector<uint256> vTemplateJournal; //!< Transactions added since StartTemplateJournal()
+
+    mutable std::shared_ptr<const CTxMemPoolSnapshot> m_snapshot; //!< Last full snapshot, see GetSnapshot(); counted in DynamicMemoryUsage() and dropped by TrimToSize() once stale
+
+    void StopTemplateJournal();
+
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
@@ -496,24 +572,45 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
-private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
-
-    struct TxLinks {
-        setEntries parents;
-        setEntries children;
+    const CTxMemPoolEntry::Links& GetMemPoolParents(txiter entry) const;
+    const CTxMemPoolEntry::Links& GetMemPoolChildren(txiter entry) const;
+    /**
+     * A mempool traversal that marks the entries it visits with a fresh
+     * epoch number instead of collecting them in a setEntries, so that a
+     * walk costs one pass over the entries and no allocations. Only one
+     * traversal can be in progress at a time; cs must be held for its
+     * whole lifetime.
+     */
+    class EpochGuard {
+        const CTxMemPool& pool;
+    public:
+        explicit EpochGuard(const CTxMemPool& in);
+        ~EpochGuard();
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+private:
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
 
+    void UpdateLinks(CTxMemPoolEntry::Links& links, txiter link, bool add);
+    /** The part of DynamicMemoryUsage() that goes away with the entry */
+    size_t EntryDynamicUsage(txiter it) const;
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
+    /** Mark it as visited by the current traversal. Returns whether it was already. */
+    bool visited(txiter it) const
+    {
+        assert(m_has_epoch_guard);
+        if (it->m_epoch == m_epoch) return true;
+        it->m_epoch = m_epoch;
+        return false;
+    }
+
+    //! Scratch space for the entries still to be visited by a traversal, kept to reuse its capacity
+    mutable std::vector<txiter> m_stage_scratch;
+
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, CAmount> mapDeltas;
@@ -564,6 +661,22 @@ public:
     void ApplyDelta(const uint256 hash, CAmount &nFeeDelta) const;
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Start recording the transactions added to the mempool. The miner
+     * calls this after assembling a block template, so that the next
+     * template can extend it with the transactions added since instead
+     * of being assembled from the whole mempool again.
+     */
+    void StartTemplateJournal();
+    /**
+     * Returns whether the mempool only gained transactions since the last
+     * StartTemplateJournal(), and if so fills vAdded with their hashes in
+     * the order they were added. Any removal or prioritisation ends the
+     * recording, as the template may then contain or have skipped
+     * transactions based on state that no longer holds.
+     */
+    bool GetTemplateJournal(std::vector<uint256>& vAdded) const;
+
 public:
     /** Remove a set of transactions from the mempool.
      *  If a transaction is in this set, then all in-mempool descendants must
@@ -593,7 +706,8 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from m_parents. Must be true for entries not in the mempool
+     *  setAncestors is expected to be empty.
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents = true) const;
 
@@ -610,7 +724,11 @@ public:
       */
     CFeeRate GetMinFee(size_t sizelimit) const;
 
-    /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+    /** Remove transactions from the mempool once its dynamic size is > sizelimit.
+      *  Packages are evicted in batches, lowest descendant score first, until
+      *  the size is 1% below sizelimit, so that transactions accepted right
+      *  after do not each have to evict again. This can evict that much more
+      *  than a trim to sizelimit, plus part of the last package removed.
       *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
@@ -644,6 +762,17 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /**
+     * A snapshot of the whole mempool. It is shared by all callers until the
+     * mempool changes, and is only copied under cs, not sorted or indexed.
+     */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+    /**
+     * A snapshot of those of the given transactions that are in the mempool.
+     * If fLinked, their parents and children are copied too, and linked.
+     */
+    std::unique_ptr<CTxMemPoolSnapshot> GetSnapshot(const std::vector<uint256>& vHashes, bool fLinked) const;
+
     size_t DynamicMemoryUsage() const;
 
     boost::signals2::signal<void (CTransactionRef)> NotifyEntryAdded;
@@ -680,7 +809,7 @@ private:
     /** Before calling removeUnchecked for a given transaction,
      *  UpdateForRemoveFromMempool must be called on the entire (dependent) set
      *  of transactions being removed at the same time.  We use each
-     *  CTxMemPoolEntry's setMemPoolParents in order to walk ancestors of a
+     *  CTxMemPoolEntry's m_parents in order to walk ancestors of a
      *  given transaction that is removed, so we can't remove intermediate
      *  transactions in a chain before we've updated all the state for the
      *  removal.
@@ -707,6 +836,8 @@ protected:
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    bool GetCompressedCoin(const COutPoint &outpoint, CompressedCoin &coin) const override;
+    size_t GetCoins(const std::vector<COutPoint> &outpoints, std::vector<CompressedCoin> &coins) const override;
 };
 
 /**
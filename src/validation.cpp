@@ -6,17 +6,21 @@
 #include <validation.h>
 
 #include <arith_uint256.h>
+#include <bloom.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
 #include <checkqueue.h>
+#include <coinstats.h>
 #include <consensus/consensus.h>
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
 #include <cuckoocache.h>
 #include <hash.h>
+#include <index/txindex.h>
 #include <init.h>
+#include <mappedfile.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
 #include <policy/rbf.h>
@@ -41,13 +45,22 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <condition_variable>
+#include <deque>
 #include <future>
 #include <sstream>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/thread.hpp>
 
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
 #if defined(NDEBUG)
 # error "Bitcoin cannot be compiled without assertions."
 #endif
@@ -89,6 +102,7 @@ enum DisconnectResult
 };
 
 class ConnectTrace;
+struct CBlockRecord;
 
 /**
  * CChainState stores and provides an API to update our local knowledge of the
@@ -156,10 +170,11 @@ public:
     bool ActivateBestChain(CValidationState &state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock);
 
     bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex);
-    bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock);
+    bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CBlockRecord* precord, bool* fNewBlock);
 
     // Block (dis)connection on a given view:
-    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
+    /** Undo block on view. pblockUndo, if given, is the block's undo data already read from disk; it is consumed. */
+    DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CBlockUndo* pblockUndo = nullptr);
     bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                     CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck = false);
 
@@ -208,15 +223,23 @@ CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
-bool fTxIndex = false;
+bool fUTXOStats = DEFAULT_UTXOSTATS;
+int nMappedBlockFiles = DEFAULT_MMAP_BLOCK_FILES;
+int nBlockCompressionLevel = DEFAULT_BLOCK_COMPRESSION;
 bool fHavePruned = false;
+/** Whether any block or undo record was ever stored compressed, recorded in the block index database */
+static bool fHaveCompressedBlocks = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+uint256 hashCleanShutdownTip;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
+unsigned int nPruneWindow = 0;
+int64_t nPruneAge = 0;
+unsigned int nPruneUndoWindow = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
 
@@ -294,6 +317,7 @@ static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPr
 static void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight);
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = nullptr);
 static FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+static FILE* OpenDiskFile(const CDiskBlockPos &pos, const char *prefix, bool fReadOnly);
 
 bool CheckFinalTx(const CTransaction &tx, int flags)
 {
@@ -345,10 +369,10 @@ bool TestLockPointValidity(const LockPoints* lp)
     return true;
 }
 
-bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints)
+/** CheckSequenceLocks with the coins of the inputs looked up in viewCoins */
+static bool CheckSequenceLocks(const CCoinsView& viewCoins, const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints)
 {
     AssertLockHeld(cs_main);
-    AssertLockHeld(mempool.cs);
 
     CBlockIndex* tip = chainActive.Tip();
     assert(tip != nullptr);
@@ -370,14 +394,12 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         lockPair.second = lp->time;
     }
     else {
-        // pcoinsTip contains the UTXO set for chainActive.Tip()
-        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
         std::vector<int> prevheights;
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
             Coin coin;
-            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
+            if (!viewCoins.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
             if (coin.nHeight == MEMPOOL_HEIGHT) {
@@ -417,8 +439,18 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
     return EvaluateSequenceLocks(index, lockPair);
 }
 
+bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints)
+{
+    AssertLockHeld(mempool.cs);
+
+    // pcoinsTip contains the UTXO set for chainActive.Tip()
+    CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+    return CheckSequenceLocks(viewMemPool, tx, flags, lp, useExistingLockPoints);
+}
+
 // Returns the script flags which should be checked for a given block
 static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& chainparams);
+static void CacheScriptExecution(const CTransaction& tx, unsigned int flags);
 
 static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     int expired = pool.Expire(GetTime() - age);
@@ -466,9 +498,17 @@ static bool IsCurrentForFeeEstimation()
  * and instead just erase from the mempool as needed.
  */
 
+static void PrevalidateDisconnectedTransactions(const DisconnectedBlockTransactions& disconnectpool);
+
 void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool fAddToMempool)
 {
     AssertLockHeld(cs_main);
+    // Verify the scripts of all the transactions at once on the script check
+    // threads, so that AcceptToMemoryPool below finds them in the script
+    // execution cache rather than verifying them one transaction at a time.
+    if (fAddToMempool) {
+        PrevalidateDisconnectedTransactions(disconnectpool);
+    }
     std::vector<uint256> vHashUpdate;
     // disconnectpool's insertion_order index sorts the entries from
     // oldest to newest, but the oldest entry will be the last tx from the
@@ -508,7 +548,8 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
 // were somehow broken and returning the wrong scriptPubKeys
 static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, CTxMemPool& pool,
-                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata) {
+                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata,
+                 const std::vector<CTransactionRef>* ppackage = nullptr) {
     AssertLockHeld(cs_main);
 
     // pool.cs should be locked already, but go ahead and re-take the lock here
@@ -526,7 +567,13 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
         // and then only have to check equivalence for available inputs.
         if (coin.IsSpent()) return false;
 
-        const CTransactionRef& txFrom = pool.get(txin.prevout.hash);
+        CTransactionRef txFrom = pool.get(txin.prevout.hash);
+        if (!txFrom && ppackage && coin.nHeight == MEMPOOL_HEIGHT) {
+            // Created by an earlier transaction of the package
+            for (const CTransactionRef& txPackage : *ppackage) {
+                if (txPackage->GetHash() == txin.prevout.hash) txFrom = txPackage;
+            }
+        }
         if (txFrom) {
             assert(txFrom->GetHash() == txin.prevout.hash);
             assert(txFrom->vout.size() > txin.prevout.n);
@@ -541,9 +588,40 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
+/** The script verification flags transactions must pass to enter the mempool */
+static unsigned int GetMempoolScriptFlags(const CChainParams& chainparams)
+{
+    unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!chainparams.RequireStandard()) {
+        flags = gArgs.GetArg("-promiscuousmempoolflags", flags);
+    }
+    return flags;
+}
+
+/** Context of a package transaction passed to AcceptToMemoryPoolWorker */
+struct PackageMember
+{
+    /** If set, the inputs are looked up here instead of in the mempool, see AcceptPackageToMemoryPool */
+    CCoinsView* pviewPackage = nullptr;
+    /** The transactions of the package, to check in-package inputs against */
+    const std::vector<CTransactionRef>* ppackage = nullptr;
+    /** Reported back: modified fees, virtual size and in-mempool ancestors of the transaction */
+    CAmount nModifiedFees = 0;
+    int64_t nVSize = 0;
+    CTxMemPool::setEntries setAncestors;
+};
+
+/**
+ * With test_accept the transaction is checked but not added. A non-null
+ * pPackage marks the transaction as part of a package: the minimum fee
+ * checks are left to the package feerate, replacements are refused, and
+ * mempool trimming and the TransactionAddedToMempool notification are left
+ * to the caller.
+ */
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache,
+                              bool test_accept, PackageMember* pPackage)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -625,15 +703,27 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         }
     }
 
+    // A replacement's fees are weighed against what it replaces, which the
+    // package feerate does not account for
+    if (pPackage && !setConflicts.empty()) {
+        return state.Invalid(false, REJECT_DUPLICATE, "txn-mempool-conflict");
+    }
+
     {
         CCoinsView dummy;
         CCoinsViewCache view(&dummy);
 
         LockPoints lp;
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
-        view.SetBackend(viewMemPool);
+        if (pPackage && pPackage->pviewPackage) {
+            view.SetBackend(*pPackage->pviewPackage);
+        } else {
+            view.SetBackend(viewMemPool);
+        }
 
         // do all inputs exist?
+        // Looked up one by one rather than in a batch, so that an orphan
+        // stops at its first missing input instead of costing a read of each.
         for (const CTxIn txin : tx.vin) {
             if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
                 coins_to_uncache.push_back(txin.prevout);
@@ -663,9 +753,10 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
         // be mined yet.
-        // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
-        // CoinsViewCache instead of create its own
-        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
+        // Must keep pool.cs for this, as the mempool backs the coins views
+        // CheckSequenceLocks looks the inputs up in
+        if (!CheckSequenceLocks(pPackage && pPackage->pviewPackage ? *pPackage->pviewPackage : viewMemPool,
+                                tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp, false))
             return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
 
         CAmount nFees = 0;
@@ -711,13 +802,20 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
                 strprintf("%d", nSigOpsCost));
 
+        if (pPackage) {
+            pPackage->nModifiedFees = nModifiedFees;
+            pPackage->nVSize = nSize;
+        }
+
+        // Package transactions are held to the package feerate instead
+        const bool fCheckMinFees = !bypass_limits && !pPackage;
         CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (!bypass_limits && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+        if (fCheckMinFees && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nModifiedFees, mempoolRejectFee));
         }
 
         // No transactions are allowed below minRelayTxFee except from disconnected blocks
-        if (!bypass_limits && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+        if (fCheckMinFees && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met");
         }
 
@@ -736,6 +834,9 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
+        if (pPackage) {
+            pPackage->setAncestors = setAncestors;
+        }
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
@@ -880,10 +981,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
-        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
-        if (!chainparams.RequireStandard()) {
-            scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
-        }
+        const unsigned int scriptVerifyFlags = GetMempoolScriptFlags(chainparams);
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
@@ -917,7 +1015,8 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // invalid blocks (using TestBlockValidity), however allowing such
         // transactions into the mempool can be exploited as a DoS attack.
         unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
-        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata))
+        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata,
+                                            pPackage ? pPackage->ppackage : nullptr))
         {
             // If we're using promiscuousmempoolflags, we may hit this normally
             // Check if current block has some flags that scriptVerifyFlags
@@ -935,6 +1034,11 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             }
         }
 
+        if (test_accept) {
+            // Tx was accepted, but not added
+            return true;
+        }
+
         // Remove conflicting transactions from the mempool
         for (const CTxMemPool::txiter it : allConflicting)
         {
@@ -953,11 +1057,16 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // - it's not being readded during a reorg which bypasses typical mempool fee limits
         // - the node is not behind
         // - the transaction is not dependent on any other transactions in the mempool
-        bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
+        // - it was not accepted on the strength of a package feerate
+        bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && !pPackage && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
 
+        if (pPackage) {
+            return true;
+        }
+
         // trim mempool and check if tx was trimmed
         if (!bypass_limits) {
             LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
@@ -974,11 +1083,11 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 /** (try to) add transaction to memory pool with a specified acceptance time **/
 static bool AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx,
                         bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                        bool bypass_limits, const CAmount nAbsurdFee)
+                        bool bypass_limits, const CAmount nAbsurdFee, bool test_accept)
 {
     std::vector<COutPoint> coins_to_uncache;
-    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache);
-    if (!res) {
+    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache, test_accept, nullptr);
+    if (!res || test_accept) {
         for (const COutPoint& hashTx : coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
     }
@@ -990,10 +1099,205 @@ static bool AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPo
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx,
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
-                        bool bypass_limits, const CAmount nAbsurdFee)
+                        bool bypass_limits, const CAmount nAbsurdFee, bool test_accept)
+{
+    const CChainParams& chainparams = Params();
+    return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee, test_accept);
+}
+
+bool CheckPackage(const std::vector<CTransactionRef>& package, CValidationState& state)
+{
+    if (package.empty()) {
+        return state.Invalid(false, REJECT_INVALID, "package-empty");
+    }
+    if (package.size() > MAX_PACKAGE_COUNT) {
+        return state.Invalid(false, REJECT_NONSTANDARD, "package-too-many-transactions");
+    }
+
+    int64_t nTotalSize = 0;
+    std::set<uint256> setLater;
+    for (const CTransactionRef& tx : package) {
+        nTotalSize += GetVirtualTransactionSize(*tx);
+        if (!setLater.insert(tx->GetHash()).second) {
+            return state.Invalid(false, REJECT_INVALID, "package-contains-duplicates");
+        }
+    }
+    if (nTotalSize > MAX_PACKAGE_SIZE * 1000) {
+        return state.Invalid(false, REJECT_NONSTANDARD, "package-too-large");
+    }
+
+    // Walk the package in order, so that setLater holds the transactions
+    // after the current one: none of them may be spent by it
+    std::set<COutPoint> setSpent;
+    for (const CTransactionRef& tx : package) {
+        setLater.erase(tx->GetHash());
+        for (const CTxIn& txin : tx->vin) {
+            if (setLater.count(txin.prevout.hash)) {
+                return state.Invalid(false, REJECT_INVALID, "package-not-sorted");
+            }
+            if (!setSpent.insert(txin.prevout).second) {
+                return state.Invalid(false, REJECT_INVALID, "conflict-in-package");
+            }
+        }
+    }
+
+    // Only a child with its parents makes a package: the package feerate is
+    // then the feerate the child is mined at, and no transaction can ride
+    // along on fees paid by another it does not depend on.
+    const CTransaction& child = *package.back();
+    std::set<uint256> setParents;
+    for (const CTxIn& txin : child.vin) {
+        setParents.insert(txin.prevout.hash);
+    }
+    for (size_t i = 0; i + 1 < package.size(); i++) {
+        if (!setParents.count(package[i]->GetHash())) {
+            return state.Invalid(false, REJECT_INVALID, "package-not-child-with-parents");
+        }
+    }
+    return true;
+}
+
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               bool* pfMissingInputs, const CAmount nAbsurdFee, bool test_accept,
+                               PackageAcceptResult& result)
 {
     const CChainParams& chainparams = Params();
-    return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee);
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs); // held so that the mempool does not change between checking the package and adding it
+    result = PackageAcceptResult();
+    result.nFailedTx = package.size();
+    if (pfMissingInputs) {
+        *pfMissingInputs = false;
+    }
+
+    if (!CheckPackage(package, state)) {
+        return false;
+    }
+
+    // Check the transactions one by one without adding them. The coins each
+    // one creates go into viewPackage, where the later ones find their
+    // in-package parents, and the scripts that passed are cached for when
+    // the package is added below.
+    const int64_t nAcceptTime = GetTime();
+    const unsigned int scriptVerifyFlags = GetMempoolScriptFlags(chainparams);
+    std::vector<COutPoint> coins_to_uncache;
+    CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+    CCoinsViewCache viewPackage(&viewMemPool);
+    std::vector<size_t> vNew;
+    CTxMemPool::setEntries setAncestors;
+    bool fAccepted = true;
+    for (size_t i = 0; i < package.size(); i++) {
+        const CTransactionRef& tx = package[i];
+        if (pool.exists(tx->GetHash())) {
+            continue;
+        }
+        PackageMember member;
+        member.pviewPackage = &viewPackage;
+        member.ppackage = &package;
+        if (!AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, nullptr,
+                                      false, nAbsurdFee, coins_to_uncache, true /* test_accept */, &member)) {
+            result.nFailedTx = i;
+            fAccepted = false;
+            break;
+        }
+        AddCoins(viewPackage, *tx, MEMPOOL_HEIGHT);
+        CacheScriptExecution(*tx, scriptVerifyFlags);
+        setAncestors.insert(member.setAncestors.begin(), member.setAncestors.end());
+        vNew.push_back(i);
+        result.nFees += member.nModifiedFees;
+        result.nVSize += member.nVSize;
+    }
+
+    if (fAccepted && !vNew.empty()) {
+        // The ancestors of each transaction were counted above without the
+        // package transactions before it. Check the limits for the package as
+        // a whole instead, as if it all descended from each of its in-mempool
+        // ancestors and had all of them as its ancestors.
+        const size_t nLimitAncestors = gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        const size_t nLimitAncestorSize = gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        const size_t nLimitDescendants = gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        const size_t nLimitDescendantSize = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        uint64_t nAncestorsSize = result.nVSize;
+        for (CTxMemPool::txiter it : setAncestors) {
+            nAncestorsSize += it->GetTxSize();
+            if (it->GetCountWithDescendants() + vNew.size() > nLimitDescendants ||
+                it->GetSizeWithDescendants() + result.nVSize > nLimitDescendantSize) {
+                fAccepted = state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false,
+                                      strprintf("package exceeds descendant limits of %s", it->GetTx().GetHash().ToString()));
+                break;
+            }
+        }
+        if (fAccepted && (setAncestors.size() + vNew.size() > nLimitAncestors || nAncestorsSize > nLimitAncestorSize)) {
+            fAccepted = state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, "package exceeds ancestor limits");
+        }
+    }
+
+    const size_t nMaxMempool = gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    if (fAccepted && !vNew.empty()) {
+        CAmount mempoolRejectFee = pool.GetMinFee(nMaxMempool).GetFee(result.nVSize);
+        if (mempoolRejectFee > 0 && result.nFees < mempoolRejectFee) {
+            fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", result.nFees, mempoolRejectFee));
+        } else if (result.nFees < ::minRelayTxFee.GetFee(result.nVSize)) {
+            fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met");
+        }
+    }
+
+    std::vector<CTransactionRef> vAdded;
+    if (fAccepted && !test_accept) {
+        // Add the transactions for real, parents first. The checks above are
+        // repeated against the mempool, which now holds the in-package
+        // parents, and pass again as neither it nor the chain changed since.
+        MemPoolRemovalReason reason = MemPoolRemovalReason::UNKNOWN;
+        for (size_t i : vNew) {
+            PackageMember member;
+            if (!AcceptToMemoryPoolWorker(chainparams, pool, state, package[i], pfMissingInputs, nAcceptTime, nullptr,
+                                          false, nAbsurdFee, coins_to_uncache, false /* test_accept */, &member)) {
+                error("%s: %s passed as part of the package but failed to be added, %s", __func__,
+                      package[i]->GetHash().ToString(), FormatStateMessage(state));
+                result.nFailedTx = i;
+                fAccepted = false;
+                break;
+            }
+            vAdded.push_back(package[i]);
+        }
+
+        // trim mempool and check if any of the package was trimmed
+        if (fAccepted) {
+            LimitMempoolSize(pool, nMaxMempool, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            for (const CTransactionRef& tx : vAdded) {
+                if (!pool.exists(tx->GetHash())) {
+                    reason = MemPoolRemovalReason::SIZELIMIT;
+                    fAccepted = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                    break;
+                }
+            }
+        }
+
+        if (!fAccepted) {
+            // Take out whatever is left of the package, children first
+            for (auto it = vAdded.rbegin(); it != vAdded.rend(); ++it) {
+                if (pool.exists((*it)->GetHash())) {
+                    pool.removeRecursive(**it, reason);
+                }
+            }
+        }
+    }
+
+    if (!fAccepted || test_accept) {
+        for (const COutPoint& outpoint : coins_to_uncache) {
+            pcoinsTip->Uncache(outpoint);
+        }
+    } else {
+        for (const CTransactionRef& tx : vAdded) {
+            GetMainSignals().TransactionAddedToMempool(tx);
+        }
+        LogPrint(BCLog::MEMPOOL, "accepted package of %u transactions (%u new) at %s\n",
+                 package.size(), vAdded.size(), CFeeRate(result.nFees, result.nVSize).ToString());
+    }
+
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FLUSH_STATE_PERIODIC);
+    return fAccepted;
 }
 
 /**
@@ -1004,8 +1308,6 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
 {
     CBlockIndex* pindexSlow = blockIndex;
 
-    LOCK(cs_main);
-
     if (!blockIndex) {
         CTransactionRef ptx = mempool.get(hash);
         if (ptx) {
@@ -1013,31 +1315,12 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
             return true;
         }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut->GetHash() != hash)
-                    return error("%s: txid mismatch", __func__);
-                return true;
-            }
-
-            // transaction not found in index, nothing more can be done
-            return false;
+        if (g_txindex) {
+            return g_txindex->FindTx(hash, hashBlock, txOut);
         }
 
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+            LOCK(cs_main);
             const Coin& coin = AccessByTxid(*pcoinsTip, hash);
             if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
         }
@@ -1069,51 +1352,327 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
 // CBlock and CBlockIndex
 //
 
-static bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+namespace {
+
+/** Recently read block and undo files, kept memory-mapped (see -mmapblockfiles). */
+class CDiskFileMappings
+{
+private:
+    std::mutex cs;
+    //! Mapped files by prefix and file number, most recently used first
+    std::list<std::pair<std::pair<std::string, int>, std::shared_ptr<const CMappedFile>>> lru;
+
+public:
+    /** Get a mapping of the file containing pos that is at least nMinSize bytes large. */
+    std::shared_ptr<const CMappedFile> Get(const CDiskBlockPos& pos, const char* prefix, size_t nMinSize)
+    {
+        const std::pair<std::string, int> key(prefix, pos.nFile);
+        std::lock_guard<std::mutex> lock(cs);
+        for (auto it = lru.begin(); it != lru.end(); ++it) {
+            if (it->first != key) continue;
+            if (it->second->size() >= nMinSize) {
+                lru.splice(lru.begin(), lru, it);
+                return it->second;
+            }
+            // The file has grown since it was mapped
+            lru.erase(it);
+            break;
+        }
+        std::shared_ptr<const CMappedFile> mapping = CMappedFile::Open(GetBlockPosFilename(pos, prefix));
+        if (!mapping || mapping->size() < nMinSize) {
+            return nullptr;
+        }
+        lru.emplace_front(key, mapping);
+        while (lru.size() > (size_t)nMappedBlockFiles) {
+            lru.pop_back();
+        }
+        return mapping;
+    }
+
+    /** Drop the mappings of block and undo file nFile, e.g. before it is deleted. */
+    void Erase(int nFile)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        lru.remove_if([nFile](const std::pair<std::pair<std::string, int>, std::shared_ptr<const CMappedFile>>& entry) { return entry.first.second == nFile; });
+    }
+};
+
+CDiskFileMappings g_disk_file_mappings;
+
+/** Upper bound on the size of the block and undo records waiting to be written */
+static const size_t MAX_BLOCK_WRITE_QUEUE_SIZE = 64 << 20;
+
+/**
+ * Appends block and undo records to their files on a background thread, so
+ * that storing a block does not wait for the disk. Positions are still
+ * assigned up front by FindBlockPos and FindUndoPos, and records can be read
+ * back through Find until they are written. Records are written, and the
+ * files they went to synced, in batches of whatever has been queued since the
+ * previous batch. Flush makes everything queued so far durable.
+ */
+class CBlockWriter
+{
+private:
+    struct Record {
+        const char* prefix;
+        //! Position of the index header preceding the record
+        CDiskBlockPos pos;
+        //! The index header followed by the record
+        std::shared_ptr<const std::vector<uint8_t>> data;
+    };
+
+    //! Held while writing a batch, so that Flush also waits for a batch in progress
+    std::mutex csWrite;
+    std::mutex cs;
+    std::condition_variable cvQueue;
+    std::condition_variable cvSpace;
+    std::deque<Record> queue;
+    //! Records that have not been written yet, by prefix, file and position of the record itself
+    std::map<std::tuple<std::string, int, unsigned int>, std::shared_ptr<const std::vector<uint8_t>>> mapPending;
+    size_t nQueuedBytes = 0;
+    bool fRunning = false;
+    std::thread thread;
+
+    void ThreadWrite();
+
+public:
+    void Start();
+    void Stop();
+
+    /** Queue data (an index header and the record following it) for writing at pos. Only waits if the queue is full. */
+    void Enqueue(const char* prefix, const CDiskBlockPos& pos, std::vector<uint8_t>&& data);
+
+    /** The queued data of the record at pos, i.e. excluding the index header, if it was not written yet. */
+    std::shared_ptr<const std::vector<uint8_t>> Find(const char* prefix, const CDiskBlockPos& pos);
+
+    /** Write and sync everything queued so far. */
+    void Flush();
+};
+
+CBlockWriter g_block_writer;
+
+} // namespace
+
+/**
+ * Set in the size field preceding a record in a block or undo file when the
+ * record is stored as a zstd frame (see -blockcompression). Records are never
+ * anywhere near 2 GiB, so older data without the flag reads unchanged.
+ */
+static const uint32_t DISK_RECORD_COMPRESSED = 0x80000000;
+
+/**
+ * Serialize obj for storage, and compress it if -blockcompression is enabled
+ * and that makes it any smaller. Returns whether data is compressed.
+ */
+template <typename T>
+static bool SerializeDiskRecord(const T& obj, std::vector<uint8_t>& data)
+{
+    data.clear();
+    CVectorWriter(SER_DISK, CLIENT_VERSION, data, 0) << obj;
+#ifdef USE_ZSTD
+    if (nBlockCompressionLevel > 0) {
+        std::vector<uint8_t> compressed(ZSTD_compressBound(data.size()));
+        size_t nCompressed = ZSTD_compress(compressed.data(), compressed.size(), data.data(), data.size(), nBlockCompressionLevel);
+        if (!ZSTD_isError(nCompressed) && nCompressed < data.size()) {
+            compressed.resize(nCompressed);
+            data.swap(compressed);
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+/**
+ * Record in the block index database that the block files hold compressed
+ * records, before the first one is written. Builds that cannot decompress
+ * them refuse to load the block index instead of misreading them.
+ */
+static void MarkCompressedBlocks()
+{
+    AssertLockHeld(cs_main);
+    if (!fHaveCompressedBlocks) {
+        pblocktree->WriteFlag("compressedblocks", true);
+        fHaveCompressedBlocks = true;
+    }
+}
+
+/**
+ * A block as it is stored in a block file: the record SerializeDiskRecord
+ * produced for it, or, for a block that already resides in a block file
+ * (-reindex), its position and the length of the stored record.
+ */
+struct CBlockRecord
 {
-    // Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("WriteBlockToDisk: OpenBlockFile failed");
+    std::vector<uint8_t> data;
+    bool fCompressed = false;
+    //! Length of the stored record, not counting the index header
+    unsigned int nSize = 0;
+    //! Position of the record if it is already on disk, null otherwise
+    CDiskBlockPos pos;
 
-    // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, block);
-    fileout << FLATDATA(messageStart) << nSize;
+    CBlockRecord() {}
 
-    // Write block
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("WriteBlockToDisk: ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    explicit CBlockRecord(const CBlock& block)
+    {
+        fCompressed = SerializeDiskRecord(block, data);
+        nSize = data.size();
+    }
+};
 
+static bool DecompressDiskRecord(const unsigned char* pbegin, size_t nSize, std::vector<uint8_t>& out)
+{
+#ifdef USE_ZSTD
+    unsigned long long nContentSize = ZSTD_getFrameContentSize(pbegin, nSize);
+    if (nContentSize == ZSTD_CONTENTSIZE_ERROR || nContentSize == ZSTD_CONTENTSIZE_UNKNOWN || nContentSize > MAX_SIZE)
+        return error("%s: Invalid zstd frame", __func__);
+    out.resize(nContentSize);
+    size_t nDecompressed = ZSTD_decompress(out.data(), out.size(), pbegin, nSize);
+    if (ZSTD_isError(nDecompressed) || nDecompressed != nContentSize)
+        return error("%s: zstd decompression failed", __func__);
     return true;
+#else
+    return error("%s: Found compressed block data, but this build does not support -blockcompression", __func__);
+#endif
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+/**
+ * The uncompressed contents of a block, or undo data followed by its
+ * checksum, as read from disk. [pbegin, pbegin + nSize) points either into
+ * the data still queued for writing, or into mapping, both of which are kept
+ * alive with the record, or into buffer.
+ */
+struct CDiskRecord
+{
+    std::shared_ptr<const std::vector<uint8_t>> pending;
+    std::shared_ptr<const CMappedFile> mapping;
+    std::vector<uint8_t> buffer;
+    const unsigned char* pbegin = nullptr;
+    size_t nSize = 0;
+};
+
+/**
+ * Read the record stored at pos in a block ("blk") or undo ("rev") file,
+ * followed by nTrailer bytes of checksum, from a memory-mapped file if
+ * -mmapblockfiles allows it. Checks the network magic and size preceding it,
+ * and decompresses it if it was stored compressed.
+ */
+static bool ReadDiskRecord(const CDiskBlockPos& pos, const char* prefix, size_t nTrailer, const CMessageHeader::MessageStartChars& message_start, CDiskRecord& record)
+{
+    // Every record is preceded by the network magic and its size
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s: Invalid position %s", __func__, pos.ToString());
+
+    unsigned char header[8];
+    const unsigned char* pstored = nullptr;
+    size_t nStored = 0;
+    record.pending = g_block_writer.Find(prefix, pos);
+    if (!record.pending && nMappedBlockFiles > 0) {
+        record.mapping = g_disk_file_mappings.Get(pos, prefix, pos.nPos);
+        if (record.mapping) {
+            nStored = (ReadLE32(record.mapping->data() + pos.nPos - 4) & ~DISK_RECORD_COMPRESSED) + nTrailer;
+            if (nStored > MAX_SIZE)
+                return error("%s: Data is larger than maximum deserialization size for %s: %u versus %u", __func__, pos.ToString(), nStored, MAX_SIZE);
+            if (record.mapping->size() - pos.nPos < nStored) {
+                // Written after the file was mapped
+                record.mapping = g_disk_file_mappings.Get(pos, prefix, pos.nPos + nStored);
+            }
+        }
+    }
+    if (record.pending) {
+        // Still queued in the block writer
+        memcpy(header, record.pending->data(), sizeof(header));
+        pstored = record.pending->data() + sizeof(header);
+        nStored = record.pending->size() - sizeof(header);
+    } else if (record.mapping) {
+        memcpy(header, record.mapping->data() + pos.nPos - 8, sizeof(header));
+        pstored = record.mapping->data() + pos.nPos;
+    } else {
+        // Open history file at the index header preceding the record
+        CAutoFile filein(OpenDiskFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), prefix, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenDiskFile failed for %s", __func__, pos.ToString());
+        try {
+            filein >> FLATDATA(header);
+            nStored = (ReadLE32(header + 4) & ~DISK_RECORD_COMPRESSED) + nTrailer;
+            if (nStored > MAX_SIZE)
+                return error("%s: Data is larger than maximum deserialization size for %s: %u versus %u", __func__, pos.ToString(), nStored, MAX_SIZE);
+            record.buffer.resize(nStored); // Zeroing of memory is intentional here
+            filein.read((char*)record.buffer.data(), nStored);
+        } catch (const std::exception& e) {
+            return error("%s: Read failed: %s for %s", __func__, e.what(), pos.ToString());
+        }
+        pstored = record.buffer.data();
+    }
+
+    if (memcmp(header, message_start, CMessageHeader::MESSAGE_START_SIZE)) {
+        return error("%s: Magic mismatch for %s: %s versus expected %s", __func__, pos.ToString(),
+                     HexStr(header, header + CMessageHeader::MESSAGE_START_SIZE),
+                     HexStr(message_start, message_start + CMessageHeader::MESSAGE_START_SIZE));
+    }
+
+    if (!(ReadLE32(header + 4) & DISK_RECORD_COMPRESSED)) {
+        record.pbegin = pstored;
+        record.nSize = nStored;
+        return true;
+    }
+
+    // The checksum trailer of undo data is stored uncompressed after the frame
+    std::vector<uint8_t> decompressed;
+    if (!DecompressDiskRecord(pstored, nStored - nTrailer, decompressed))
+        return error("%s: Failed to decompress %s", __func__, pos.ToString());
+    decompressed.insert(decompressed.end(), pstored + nStored - nTrailer, pstored + nStored);
+    record.buffer.swap(decompressed);
+    record.pending.reset();
+    record.mapping.reset();
+    record.pbegin = record.buffer.data();
+    record.nSize = record.buffer.size();
+    return true;
+}
+
+static bool WriteBlockToDisk(const CBlockRecord& record, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // Index header followed by the block, appended by the block writer
+    std::vector<uint8_t> data;
+    data.reserve(8 + record.data.size());
+    CVectorWriter(SER_DISK, CLIENT_VERSION, data, 0) << FLATDATA(messageStart) << (unsigned int)(record.nSize | (record.fCompressed ? DISK_RECORD_COMPRESSED : 0));
+    data.insert(data.end(), record.data.begin(), record.data.end());
+    if (record.fCompressed)
+        MarkCompressedBlocks();
+    g_block_writer.Enqueue("blk", pos, std::move(data));
+    pos.nPos += 8;
+
+    return true;
+}
+
+static bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fCheckPoW)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "blk", 0, Params().MessageStart(), record))
+        return error("ReadBlockFromDisk: Failed to read block at %s", pos.ToString());
 
-    // Read block
     try {
-        filein >> block;
+        CMemoryReader reader(SER_DISK, CLIENT_VERSION, record.pbegin, record.nSize);
+        reader >> block;
     }
     catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
     // Check the header
-    if (!CheckProofOfWork(block.GetHash(), block.nBits, consensusParams))
+    if (fCheckPoW && !CheckProofOfWork(block.GetHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
 
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    return ReadBlockFromDisk(block, pos, consensusParams, true);
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     CDiskBlockPos blockPos;
@@ -1122,7 +1681,9 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
         blockPos = pindex->GetBlockPos();
     }
 
-    if (!ReadBlockFromDisk(block, blockPos, consensusParams))
+    // The proof of work of the header was checked before pindex was created,
+    // so it is enough to make sure that this is the block pindex refers to.
+    if (!ReadBlockFromDisk(block, blockPos, consensusParams, false))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
@@ -1130,35 +1691,177 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
-CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
+/**
+ * Remove the witness data from a serialized block in place, by copying
+ * everything except the segwit marker, flag and witnesses of each
+ * transaction forward. This never writes past what has already been parsed.
+ */
+static bool StripBlockWitness(std::vector<uint8_t>& block)
 {
-    int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
-    // Force block reward to zero when right shift is undefined.
-    if (halvings >= 64)
-        return 0;
+    const size_t nTotal = block.size();
+    CMemoryReader s(SER_NETWORK, PROTOCOL_VERSION, block.data(), nTotal);
+    size_t nOut = 0;
+    auto pos = [&]() { return nTotal - s.size(); };
+    auto copy = [&](size_t nBegin, size_t nEnd) {
+        if (nOut != nBegin) memmove(block.data() + nOut, block.data() + nBegin, nEnd - nBegin);
+        nOut += nEnd - nBegin;
+    };
+    auto skip_script = [&]() { s.ignore(ReadCompactSize(s)); };
 
-    CAmount nSubsidy = 50 * COIN;
-    // Subsidy is cut in half every 210,000 blocks which will occur approximately every 4 years.
-    nSubsidy >>= halvings;
-    return nSubsidy;
+    try {
+        s.ignore(::GetSerializeSize(CBlockHeader(), SER_NETWORK, PROTOCOL_VERSION));
+        uint64_t nTx = ReadCompactSize(s);
+        copy(0, pos());
+        for (uint64_t i = 0; i < nTx; i++) {
+            const size_t nTxBegin = pos();
+            s.ignore(4); // nVersion
+            const size_t nVersionEnd = pos();
+            uint64_t nIn = ReadCompactSize(s);
+            bool fWitness = false;
+            if (nIn == 0) {
+                unsigned char flags;
+                s >> flags;
+                if (flags != 0) {
+                    // Only the witness flag is defined
+                    if (flags != 1) return false;
+                    fWitness = true;
+                }
+            }
+            const size_t nInputsBegin = pos();
+            if (fWitness) nIn = ReadCompactSize(s);
+            if (fWitness || nIn != 0) {
+                for (uint64_t j = 0; j < nIn; j++) {
+                    s.ignore(36); // prevout
+                    skip_script();
+                    s.ignore(4); // nSequence
+                }
+                uint64_t nOutputs = ReadCompactSize(s);
+                for (uint64_t j = 0; j < nOutputs; j++) {
+                    s.ignore(8); // nValue
+                    skip_script();
+                }
+            }
+            if (!fWitness) {
+                s.ignore(4); // nLockTime
+                copy(nTxBegin, pos());
+                continue;
+            }
+            const size_t nOutputsEnd = pos();
+            for (uint64_t j = 0; j < nIn; j++) {
+                uint64_t nStack = ReadCompactSize(s);
+                for (uint64_t k = 0; k < nStack; k++) {
+                    skip_script();
+                }
+            }
+            const size_t nWitnessEnd = pos();
+            s.ignore(4); // nLockTime
+            copy(nTxBegin, nVersionEnd);
+            copy(nInputsBegin, nOutputsEnd);
+            copy(nWitnessEnd, pos());
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (!s.empty()) return false;
+    block.resize(nOut);
+    return true;
 }
 
-bool IsInitialBlockDownload()
+bool ReadTxFromDisk(CTransactionRef& tx, const CDiskBlockPos& pos, unsigned int nTxOffset)
 {
-    // Once this function has returned false, it must remain false.
-    static std::atomic<bool> latchToFalse{false};
-    // Optimization: pre-test latch before taking the lock.
-    if (latchToFalse.load(std::memory_order_relaxed))
-        return false;
+    // Offset of the transaction within the serialized block
+    const size_t nOffset = ::GetSerializeSize(CBlockHeader(), SER_DISK, CLIENT_VERSION) + nTxOffset;
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s: Invalid position %s", __func__, pos.ToString());
+
+    if (!g_block_writer.Find("blk", pos)) {
+        // Open history file at the index header preceding the block
+        CAutoFile file(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+        try {
+            unsigned char header[8];
+            file >> FLATDATA(header);
+            if (!(ReadLE32(header + 4) & DISK_RECORD_COMPRESSED)) {
+                if (fseek(file.Get(), nOffset, SEEK_CUR))
+                    return error("%s: fseek(...) failed", __func__);
+                file >> tx;
+                return true;
+            }
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
 
-    LOCK(cs_main);
-    if (latchToFalse.load(std::memory_order_relaxed))
-        return false;
-    if (fImporting || fReindex)
-        return true;
-    if (chainActive.Tip() == nullptr)
-        return true;
-    if (chainActive.Tip()->nChainWork < nMinimumChainWork)
+    // A compressed block has to be decompressed as a whole, and one that is
+    // not written yet is read from the block writer's queue
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "blk", 0, Params().MessageStart(), record))
+        return error("%s: Failed to read block at %s", __func__, pos.ToString());
+    if (nOffset >= record.nSize)
+        return error("%s: Invalid transaction offset %u at %s", __func__, nTxOffset, pos.ToString());
+    try {
+        CMemoryReader reader(SER_DISK, CLIENT_VERSION, record.pbegin + nOffset, record.nSize - nOffset);
+        reader >> tx;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start, bool fWitness)
+{
+    CDiskBlockPos blockPos;
+    {
+        LOCK(cs_main);
+        blockPos = pindex->GetBlockPos();
+    }
+
+    CDiskRecord record;
+    if (!ReadDiskRecord(blockPos, "blk", 0, message_start, record)) {
+        return error("%s: Failed to read block at %s", __func__, blockPos.ToString());
+    }
+    if (record.pbegin == record.buffer.data()) {
+        block.swap(record.buffer);
+    } else {
+        block.assign(record.pbegin, record.pbegin + record.nSize);
+    }
+
+    if (!fWitness && !StripBlockWitness(block)) {
+        return error("%s: Failed to parse block at %s", __func__, blockPos.ToString());
+    }
+    return true;
+}
+
+CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
+{
+    int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
+    // Force block reward to zero when right shift is undefined.
+    if (halvings >= 64)
+        return 0;
+
+    CAmount nSubsidy = 50 * COIN;
+    // Subsidy is cut in half every 210,000 blocks which will occur approximately every 4 years.
+    nSubsidy >>= halvings;
+    return nSubsidy;
+}
+
+bool IsInitialBlockDownload()
+{
+    // Once this function has returned false, it must remain false.
+    static std::atomic<bool> latchToFalse{false};
+    // Optimization: pre-test latch before taking the lock.
+    if (latchToFalse.load(std::memory_order_relaxed))
+        return false;
+
+    LOCK(cs_main);
+    if (latchToFalse.load(std::memory_order_relaxed))
+        return false;
+    if (fImporting || fReindex)
+        return true;
+    if (chainActive.Tip() == nullptr)
+        return true;
+    if (chainActive.Tip()->nChainWork < nMinimumChainWork)
         return true;
     if (chainActive.Tip()->GetBlockTime() < (GetTime() - nMaxTipAge))
         return true;
@@ -1326,6 +2029,23 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
+static uint256 ScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
+/** Record that the scripts of tx are known to be valid under flags, as CheckInputs does after verifying them. */
+static void CacheScriptExecution(const CTransaction& tx, unsigned int flags)
+{
+    AssertLockHeld(cs_main);
+    scriptExecutionCache.insert(ScriptExecutionCacheEntry(tx, flags));
+}
+
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
@@ -1371,11 +2091,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            const uint256 hashCacheEntry = ScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
@@ -1434,50 +2150,37 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
 
 namespace {
 
-bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+bool UndoWriteToDisk(const CBlockUndo& blockundo, const std::vector<uint8_t>& record, bool fCompressed, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
-    // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, blockundo);
-    fileout << FLATDATA(messageStart) << nSize;
-
-    // Write undo data
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("%s: ftell failed", __func__);
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
+    // Index header followed by the undo data, appended by the block writer
+    std::vector<uint8_t> data;
+    data.reserve(8 + record.size() + 32);
+    CVectorWriter(SER_DISK, CLIENT_VERSION, data, 0) << FLATDATA(messageStart) << (unsigned int)(record.size() | (fCompressed ? DISK_RECORD_COMPRESSED : 0));
+    data.insert(data.end(), record.begin(), record.end());
+    if (fCompressed)
+        MarkCompressedBlocks();
 
     // calculate & write checksum
     CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
     hasher << hashBlock;
     hasher << blockundo;
-    fileout << hasher.GetHash();
+    uint256 hashChecksum = hasher.GetHash();
+    data.insert(data.end(), hashChecksum.begin(), hashChecksum.end());
+
+    g_block_writer.Enqueue("rev", pos, std::move(data));
+    pos.nPos += 8;
 
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+template <typename Stream>
+static bool UndoReadFromStream(Stream& filein, CBlockUndo& blockundo, const uint256& hashPrevBlock)
 {
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull()) {
-        return error("%s: no undo data available", __func__);
-    }
-
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenUndoFile failed", __func__);
-
     // Read block
     uint256 hashChecksum;
-    CHashVerifier<CAutoFile> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
+    CHashVerifier<Stream> verifier(&filein); // We need a CHashVerifier as reserializing may lose data
     try {
-        verifier << pindex->pprev->GetBlockHash();
+        verifier << hashPrevBlock;
         verifier >> blockundo;
         filein >> hashChecksum;
     }
@@ -1492,6 +2195,31 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
+/** Read the undo data at pos of the block whose parent is hashPrevBlock. Does not touch the block index. */
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashPrevBlock)
+{
+    if (pos.IsNull()) {
+        return error("%s: no undo data available", __func__);
+    }
+
+    // Undo data is followed by its checksum
+    CDiskRecord record;
+    if (!ReadDiskRecord(pos, "rev", sizeof(uint256), Params().MessageStart(), record))
+        return error("%s: Failed to read undo data at %s", __func__, pos.ToString());
+
+    CMemoryReader reader(SER_DISK, CLIENT_VERSION, record.pbegin, record.nSize);
+    return UndoReadFromStream(reader, blockundo, hashPrevBlock);
+}
+
+} // namespace
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+{
+    return UndoReadFromDisk(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash());
+}
+
+namespace {
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1510,6 +2238,114 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
     return state.Error(strMessage);
 }
 
+void CBlockWriter::Start()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fRunning = true;
+    }
+    thread = std::thread(&TraceThread<std::function<void()>>, "blkwriter", std::function<void()>(std::bind(&CBlockWriter::ThreadWrite, this)));
+}
+
+void CBlockWriter::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fRunning = false;
+    }
+    cvQueue.notify_all();
+    cvSpace.notify_all();
+    if (thread.joinable())
+        thread.join();
+    Flush();
+}
+
+void CBlockWriter::ThreadWrite()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            cvQueue.wait(lock, [this] { return !fRunning || !queue.empty(); });
+            if (queue.empty())
+                return;
+        }
+        Flush();
+    }
+}
+
+void CBlockWriter::Enqueue(const char* prefix, const CDiskBlockPos& pos, std::vector<uint8_t>&& data)
+{
+    std::shared_ptr<const std::vector<uint8_t>> record = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+    bool fWriteNow;
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        cvSpace.wait(lock, [this] { return nQueuedBytes < MAX_BLOCK_WRITE_QUEUE_SIZE || !fRunning; });
+        queue.push_back(Record{prefix, pos, record});
+        mapPending.emplace(std::make_tuple(std::string(prefix), pos.nFile, pos.nPos + 8), record);
+        nQueuedBytes += record->size();
+        fWriteNow = !fRunning;
+    }
+    if (fWriteNow) {
+        Flush();
+    } else {
+        cvQueue.notify_one();
+    }
+}
+
+std::shared_ptr<const std::vector<uint8_t>> CBlockWriter::Find(const char* prefix, const CDiskBlockPos& pos)
+{
+    std::lock_guard<std::mutex> lock(cs);
+    if (mapPending.empty())
+        return nullptr;
+    auto it = mapPending.find(std::make_tuple(std::string(prefix), pos.nFile, pos.nPos));
+    return it == mapPending.end() ? nullptr : it->second;
+}
+
+void CBlockWriter::Flush()
+{
+    std::lock_guard<std::mutex> lockWrite(csWrite);
+    std::deque<Record> batch;
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        batch.swap(queue);
+    }
+    if (batch.empty())
+        return;
+
+    // Append the records, opening and syncing each file once per batch
+    std::map<std::pair<std::string, int>, FILE*> files;
+    bool fWritten = true;
+    for (const Record& record : batch) {
+        FILE*& file = files[std::make_pair(std::string(record.prefix), record.pos.nFile)];
+        if (!file)
+            file = OpenDiskFile(CDiskBlockPos(record.pos.nFile, 0), record.prefix, false);
+        if (!file || fseek(file, record.pos.nPos, SEEK_SET) ||
+            fwrite(record.data->data(), 1, record.data->size(), file) != record.data->size()) {
+            fWritten = false;
+            break;
+        }
+    }
+    for (const auto& file : files) {
+        if (!file.second)
+            continue;
+        if (fWritten)
+            FileCommit(file.second);
+        fclose(file.second);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        for (const Record& record : batch) {
+            mapPending.erase(std::make_tuple(std::string(record.prefix), record.pos.nFile, record.pos.nPos + 8));
+            nQueuedBytes -= record.data->size();
+        }
+    }
+    cvSpace.notify_all();
+
+    if (!fWritten)
+        AbortNode("Failed to write block data");
+}
+
 } // namespace
 
 /**
@@ -1546,23 +2382,99 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
     return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
+/** UTXO set statistics of the last block connected or disconnected, saving a database read per block. Protected by cs_main. */
+static CCoinsStats g_last_utxo_stats;
+
+static bool ReadUTXOStatsForBlock(const CBlockIndex* pindex, CCoinsStats& stats)
+{
+    if (!g_last_utxo_stats.hashBlock.IsNull() && g_last_utxo_stats.hashBlock == pindex->GetBlockHash()) {
+        stats = g_last_utxo_stats;
+        return true;
+    }
+    return pblocktree->ReadUTXOStats(pindex->GetBlockHash(), stats);
+}
+
+static bool WriteUTXOStatsForBlock(const CBlock& block, const CBlockUndo& blockundo, CValidationState& state, CBlockIndex* pindex)
+{
+    if (!fUTXOStats) return true;
+
+    CCoinsStats stats;
+    // The genesis block's outputs are not part of the UTXO set, so its statistics are empty.
+    if (pindex->pprev != nullptr) {
+        if (!ReadUTXOStatsForBlock(pindex->pprev, stats)) {
+            // Nothing to build upon (e.g. -utxostats was only just enabled).
+            // The next full scan by gettxoutsetinfo seeds the statistics.
+            return true;
+        }
+        if (!ApplyBlockToStats(stats, block, blockundo, pindex->nHeight)) {
+            // The statistics are an optional index; leave them unmaintained
+            // rather than failing the block connection.
+            LogPrintf("%s: unable to update UTXO set statistics for %s\n", __func__, pindex->GetBlockHash().ToString());
+            return true;
+        }
+    }
+    stats.nHeight = pindex->nHeight;
+    stats.hashBlock = pindex->GetBlockHash();
+
+    if (!pblocktree->WriteUTXOStats(stats.hashBlock, stats)) {
+        return AbortNode(state, "Failed to write UTXO set statistics");
+    }
+    g_last_utxo_stats = stats;
+
+    return true;
+}
+
+static void RevertUTXOStatsForBlock(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    if (!fUTXOStats) return;
+
+    // Statistics are keyed by block hash, so the parent's normally exist
+    // already. They are only missing if the statistics were seeded at a later
+    // block; derive them so that the seed survives a reorg.
+    CCoinsStats stats;
+    if (ReadUTXOStatsForBlock(pindex->pprev, stats)) {
+        g_last_utxo_stats = stats;
+        return;
+    }
+    if (!ReadUTXOStatsForBlock(pindex, stats)) return;
+
+    if (!RevertBlockFromStats(stats, block, blockundo, pindex->nHeight)) {
+        LogPrintf("%s: unable to derive UTXO set statistics for %s\n", __func__, pindex->pprev->GetBlockHash().ToString());
+        return;
+    }
+    stats.nHeight = pindex->pprev->nHeight;
+    stats.hashBlock = pindex->pprev->GetBlockHash();
+    if (!pblocktree->WriteUTXOStats(stats.hashBlock, stats)) {
+        LogPrintf("%s: failed to write UTXO set statistics for %s\n", __func__, stats.hashBlock.ToString());
+        return;
+    }
+    g_last_utxo_stats = stats;
+}
+
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When FAILED is returned, view is left in an indeterminate state. */
-DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, CBlockUndo* pblockUndo)
 {
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    if (!UndoReadFromDisk(blockUndo, pindex)) {
-        error("DisconnectBlock(): failure reading undo data");
-        return DISCONNECT_FAILED;
+    CBlockUndo blockUndoRead;
+    if (!pblockUndo) {
+        if (!UndoReadFromDisk(blockUndoRead, pindex)) {
+            error("DisconnectBlock(): failure reading undo data");
+            return DISCONNECT_FAILED;
+        }
+        pblockUndo = &blockUndoRead;
     }
+    CBlockUndo& blockUndo = *pblockUndo;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size()) {
         error("DisconnectBlock(): block and undo data inconsistent");
         return DISCONNECT_FAILED;
     }
 
+    // Must run before the undo coins are moved out below.
+    RevertUTXOStatsForBlock(block, blockUndo, pindex);
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = *(block.vtx[i]);
@@ -1607,6 +2519,8 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
 
 void static FlushBlockFile(bool fFinalize = false)
 {
+    g_block_writer.Flush();
+
     LOCK(cs_LastBlockFile);
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
@@ -1635,9 +2549,11 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull()) {
         CDiskBlockPos _pos;
-        if (!FindUndoPos(state, pindex->nFile, _pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+        std::vector<uint8_t> record;
+        bool fCompressed = SerializeDiskRecord(blockundo, record);
+        if (!FindUndoPos(state, pindex->nFile, _pos, record.size() + 40))
             return error("ConnectBlock(): FindUndoPos failed");
-        if (!UndoWriteToDisk(blockundo, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
+        if (!UndoWriteToDisk(blockundo, record, fCompressed, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart()))
             return AbortNode(state, "Failed to write undo data");
 
         // update nUndoPos in block index
@@ -1649,31 +2565,279 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     return true;
 }
 
-static bool WriteTxIndexDataForBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("bitcoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+namespace {
+
+/**
+ * A script check of a transaction verified ahead of AcceptToMemoryPool. A
+ * failure is recorded for its transaction instead of failing the whole batch,
+ * so that the other transactions of the batch are still verified.
+ */
+class CPrevalidationCheck
 {
-    if (!fTxIndex) return true;
+private:
+    CScriptCheck check;
+    std::atomic<bool>* pfFailed;
 
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
-    for (const CTransactionRef& tx : block.vtx)
+public:
+    CPrevalidationCheck() : pfFailed(nullptr) {}
+    CPrevalidationCheck(CScriptCheck&& checkIn, std::atomic<bool>* pfFailedIn) : pfFailed(pfFailedIn)
     {
-        vPos.push_back(std::make_pair(tx->GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+        check.swap(checkIn);
     }
 
-    if (!pblocktree->WriteTxIndex(vPos)) {
-        return AbortNode(state, "Failed to write transaction index");
+    bool operator()()
+    {
+        if (!*pfFailed && !check()) {
+            *pfFailed = true;
+        }
+        return true;
     }
 
-    return true;
+    void swap(CPrevalidationCheck& other)
+    {
+        check.swap(other.check);
+        std::swap(pfFailed, other.pfFailed);
+    }
+};
+
+} // namespace
+
+/**
+ * Transactions are verified ahead of the mempool on threads of their own, so
+ * that this never waits for, or holds up, block validation on scriptcheckqueue.
+ */
+static CCheckQueue<CPrevalidationCheck> prevalidationqueue(128);
+
+void ThreadPrevalidationCheck() {
+    RenameThread("bitcoin-txcheck");
+    prevalidationqueue.Thread();
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Witness hashes of transactions whose scripts failed in a prevalidation, so they are not run again */
+static CRollingBloomFilter prevalidationFailures(20000, 0.000001);
 
-void ThreadScriptCheck() {
-    RenameThread("bitcoin-scriptch");
-    scriptcheckqueue.Thread();
+/**
+ * Run the script checks of the inputs of txs that are not skipped, on the
+ * prevalidation threads if there are any. coins holds the spent outputs of
+ * all inputs of txs, in order. Transactions that pass are added to the script
+ * execution cache, so that AcceptToMemoryPool does not run their scripts
+ * again; those that fail are remembered in prevalidationFailures. Returns
+ * whether all checks passed.
+ */
+static bool RunScriptChecks(const std::vector<CTransactionRef>& txs, const std::vector<Coin>& coins,
+                            const std::vector<bool>& vSkip, unsigned int flags)
+{
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(txs.size());
+    std::unique_ptr<std::atomic<bool>[]> vFailed(new std::atomic<bool>[txs.size()]);
+    std::vector<CPrevalidationCheck> vChecks;
+    size_t nCoin = 0;
+    for (size_t n = 0; n < txs.size(); n++) {
+        const CTransaction& tx = *txs[n];
+        vFailed[n] = false;
+        if (!vSkip[n]) {
+            vTxData.emplace_back(tx);
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                vChecks.emplace_back(CScriptCheck(coins[nCoin + i].out, tx, i, flags, true /* cacheStore */, &vTxData.back()), &vFailed[n]);
+            }
+        }
+        nCoin += tx.vin.size();
+    }
+    if (vChecks.empty())
+        return true;
+
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CPrevalidationCheck> control(&prevalidationqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (CPrevalidationCheck& check : vChecks) {
+            check();
+        }
+    }
+
+    bool fAllValid = true;
+    LOCK(cs_main);
+    for (size_t n = 0; n < txs.size(); n++) {
+        if (vSkip[n]) continue;
+        if (vFailed[n]) {
+            prevalidationFailures.insert(txs[n]->GetWitnessHash());
+            fAllValid = false;
+        } else {
+            CacheScriptExecution(*txs[n], flags);
+        }
+    }
+    return fAllValid;
+}
+
+void PrevalidateTransactions(CTxMemPool& pool, const std::vector<CTransactionRef>& txs)
+{
+    // Context-free checks first. Like the checks on fees and conflicts
+    // below, they keep this from doing script work for transactions that
+    // AcceptToMemoryPool rejects before it gets to the scripts.
+    std::vector<CTransactionRef> vCandidates;
+    vCandidates.reserve(txs.size());
+    for (const CTransactionRef& tx : txs) {
+        CValidationState state;
+        std::string reason;
+        if (tx->IsCoinBase() || !CheckTransaction(*tx, state))
+            continue;
+        if (fRequireStandard && !IsStandardTx(*tx, reason, true))
+            continue;
+        vCandidates.push_back(tx);
+    }
+    if (vCandidates.empty())
+        return;
+
+    // Look up the spent outputs under the locks, leaving pcoinsTip's cache
+    // as it was so that AcceptToMemoryPool can uncache what it pulls in.
+    std::vector<Coin> coins;
+    std::vector<bool> vSkip(vCandidates.size());
+    const unsigned int flags = GetMempoolScriptFlags(Params());
+    {
+        LOCK2(cs_main, pool.cs);
+
+        std::vector<COutPoint> prevouts;
+        std::vector<COutPoint> uncached;
+        for (const CTransactionRef& tx : vCandidates) {
+            for (const CTxIn& txin : tx->vin) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                    uncached.push_back(txin.prevout);
+                }
+                prevouts.push_back(txin.prevout);
+            }
+        }
+        std::vector<CompressedCoin> fetched;
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+        viewMemPool.GetCoins(prevouts, fetched);
+        for (const COutPoint& outpoint : uncached) {
+            pcoinsTip->Uncache(outpoint);
+        }
+        coins.reserve(fetched.size());
+        for (const CompressedCoin& coin : fetched) {
+            coins.push_back(coin.Decompress());
+        }
+
+        const CFeeRate minFeeRate = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        size_t nCoin = 0;
+        for (size_t n = 0; n < vCandidates.size(); n++) {
+            const CTransactionRef& tx = vCandidates[n];
+            bool fSkip = pool.exists(tx->GetHash()) || prevalidationFailures.contains(tx->GetWitnessHash());
+            CAmount nFees = -tx->GetValueOut();
+            for (const CTxIn& txin : tx->vin) {
+                const Coin& coin = coins[nCoin++];
+                fSkip = fSkip || coin.IsSpent() || pool.mapNextTx.find(txin.prevout) != pool.mapNextTx.end();
+                if (!fSkip) nFees += coin.out.nValue;
+            }
+            if (!fSkip) {
+                const unsigned int nSize = GetVirtualTransactionSize(*tx);
+                pool.ApplyDelta(tx->GetHash(), nFees);
+                fSkip = nFees < minFeeRate.GetFee(nSize) || nFees < ::minRelayTxFee.GetFee(nSize);
+            }
+            vSkip[n] = fSkip;
+        }
+    }
+
+    // Verify all inputs of the remaining transactions on the prevalidation
+    // threads. Without them this still runs the scripts outside the locks.
+    // A failing check only means AcceptToMemoryPool will reject the
+    // transaction itself, with the proper state.
+    RunScriptChecks(vCandidates, coins, vSkip, flags);
+}
+
+static void PrevalidateDisconnectedTransactions(const DisconnectedBlockTransactions& disconnectpool)
+{
+    AssertLockHeld(cs_main);
+
+    // The same checks as PrevalidateTransactions, in the order the
+    // transactions are added back to the mempool
+    std::vector<CTransactionRef> vCandidates;
+    vCandidates.reserve(disconnectpool.queuedTx.size());
+    std::unordered_map<uint256, const CTransaction*, SaltedTxidHasher> mapDisconnected;
+    for (auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin(); it != disconnectpool.queuedTx.get<insertion_order>().rend(); ++it) {
+        const CTransactionRef& tx = *it;
+        mapDisconnected.emplace(tx->GetHash(), tx.get());
+        CValidationState state;
+        std::string reason;
+        if (tx->IsCoinBase() || !CheckTransaction(*tx, state))
+            continue;
+        if (fRequireStandard && !IsStandardTx(*tx, reason, true))
+            continue;
+        vCandidates.push_back(tx);
+    }
+    if (vCandidates.empty())
+        return;
+
+    // Fetch the spent coins in one go. Outputs of other disconnected
+    // transactions are not in any view yet, so they are taken from the
+    // transactions themselves.
+    const unsigned int flags = GetMempoolScriptFlags(Params());
+    std::vector<bool> vSkip(vCandidates.size());
+    std::vector<Coin> coins;
+    {
+        LOCK(mempool.cs);
+        std::vector<COutPoint> prevouts;
+        std::vector<COutPoint> uncached;
+        for (const CTransactionRef& tx : vCandidates) {
+            for (const CTxIn& txin : tx->vin) {
+                if (mapDisconnected.count(txin.prevout.hash)) continue;
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                    uncached.push_back(txin.prevout);
+                }
+                prevouts.push_back(txin.prevout);
+            }
+        }
+        std::vector<CompressedCoin> fetched;
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+        viewMemPool.GetCoins(prevouts, fetched);
+        for (const COutPoint& outpoint : uncached) {
+            pcoinsTip->Uncache(outpoint);
+        }
+
+        size_t nFetched = 0;
+        for (size_t n = 0; n < vCandidates.size(); n++) {
+            const CTransaction& tx = *vCandidates[n];
+            // Already verified when it was in the mempool before
+            bool fSkip = scriptExecutionCache.contains(ScriptExecutionCacheEntry(tx, flags), false) ||
+                         prevalidationFailures.contains(tx.GetWitnessHash());
+            for (const CTxIn& txin : tx.vin) {
+                auto parent = mapDisconnected.find(txin.prevout.hash);
+                if (parent == mapDisconnected.end()) {
+                    coins.push_back(fetched[nFetched++].Decompress());
+                } else if (txin.prevout.n < parent->second->vout.size()) {
+                    coins.emplace_back(parent->second->vout[txin.prevout.n], MEMPOOL_HEIGHT, false);
+                } else {
+                    coins.emplace_back();
+                }
+                fSkip = fSkip || coins.back().IsSpent() || mempool.mapNextTx.count(txin.prevout);
+            }
+            vSkip[n] = fSkip;
+        }
+    }
+
+    // Transactions that fail are verified again by AcceptToMemoryPool,
+    // which rejects them with the proper state.
+    size_t nChecked = std::count(vSkip.begin(), vSkip.end(), false);
+    bool fAllValid = RunScriptChecks(vCandidates, coins, vSkip, flags);
+    LogPrint(BCLog::MEMPOOL, "Verified scripts of %u of %u disconnected transactions%s\n",
+             nChecked, disconnectpool.queuedTx.size(), fAllValid ? "" : ", not all valid");
+}
+
+void StartBlockWriter()
+{
+    g_block_writer.Start();
+}
+
+void StopBlockWriter()
+{
+    g_block_writer.Stop();
 }
 
 // Protected by cs_main
@@ -1805,8 +2969,11 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
             view.SetBestBlock(pindex->GetBlockHash());
+            if (!WriteUTXOStatsForBlock(block, CBlockUndo(), state, pindex))
+                return false;
+        }
         return true;
     }
 
@@ -1900,6 +3067,27 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+
+    // Pull all inputs that are not created within this block into the cache
+    // with one batched lookup, instead of one database read per input below.
+    {
+        std::set<uint256> setBlockTxids;
+        for (const auto& ptx : block.vtx) {
+            setBlockTxids.insert(ptx->GetHash());
+        }
+        std::vector<COutPoint> prevouts;
+        for (const auto& ptx : block.vtx) {
+            if (ptx->IsCoinBase()) continue;
+            for (const CTxIn& txin : ptx->vin) {
+                if (!setBlockTxids.count(txin.prevout.hash)) {
+                    prevouts.push_back(txin.prevout);
+                }
+            }
+        }
+        std::vector<CompressedCoin> coins;
+        view.GetCoins(prevouts, coins);
+    }
+
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = *(block.vtx[i]);
@@ -1984,7 +3172,7 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (!WriteTxIndexDataForBlock(block, state, pindex))
+    if (!WriteUTXOStatsForBlock(block, blockundo, state, pindex))
         return false;
 
     assert(pindex->phashBlock);
@@ -2079,7 +3267,8 @@ bool static FlushStateToDisk(const CChainParams& chainparams, CValidationState &
                     vBlocks.push_back(*it);
                     setDirtyBlockIndex.erase(it++);
                 }
-                if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
+                // Only a final flush, or one that is about to delete block files, has to wait for the sync.
+                if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks, mode == FLUSH_STATE_ALWAYS || fFlushForPrune)) {
                     return AbortNode(state, "Failed to write to block index database");
                 }
             }
@@ -3350,18 +4539,21 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
     return true;
 }
 
-/** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CChainParams& chainparams, const CDiskBlockPos* dbp) {
-    unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
-    CDiskBlockPos blockPos;
-    if (dbp != nullptr)
-        blockPos = *dbp;
-    if (!FindBlockPos(blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != nullptr)) {
+/** Store block on disk. If precord is non-nullptr, it is the block's record, which may already reside on disk */
+static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CChainParams& chainparams, const CBlockRecord* precord) {
+    std::unique_ptr<CBlockRecord> record;
+    if (precord == nullptr) {
+        record.reset(new CBlockRecord(block));
+        precord = record.get();
+    }
+    const bool fKnown = !precord->pos.IsNull();
+    CDiskBlockPos blockPos = precord->pos;
+    if (!FindBlockPos(blockPos, precord->nSize+8, nHeight, block.GetBlockTime(), fKnown)) {
         error("%s: FindBlockPos failed", __func__);
         return CDiskBlockPos();
     }
-    if (dbp == nullptr) {
-        if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart())) {
+    if (!fKnown) {
+        if (!WriteBlockToDisk(*precord, blockPos, chainparams.MessageStart())) {
             AbortNode("Failed to write block");
             return CDiskBlockPos();
         }
@@ -3369,8 +4561,8 @@ static CDiskBlockPos SaveBlockToDisk(const CBlock& block, int nHeight, const CCh
     return blockPos;
 }
 
-/** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
-bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+/** Store block on disk. If precord is non-nullptr, it is the block's record, which may already reside on disk */
+bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CBlockRecord* precord, bool* fNewBlock)
 {
     const CBlock& block = *pblock;
 
@@ -3432,13 +4624,24 @@ bool CChainState::AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CVali
 
     // Write block to history file
     try {
-        CDiskBlockPos blockPos = SaveBlockToDisk(block, pindex->nHeight, chainparams, dbp);
+        // The undo data of a pruned block that is fetched again may have
+        // been kept (see -pruneundowindow). It is stored along with the file
+        // the block used to be in, so it has to move with the block.
+        CBlockUndo blockundo;
+        const bool fMoveUndo = (pindex->nStatus & BLOCK_HAVE_UNDO) && UndoReadFromDisk(blockundo, pindex);
+        CDiskBlockPos blockPos = SaveBlockToDisk(block, pindex->nHeight, chainparams, precord);
         if (blockPos.IsNull()) {
             state.Error(strprintf("%s: Failed to find position to write new block to disk", __func__));
             return false;
         }
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos, chainparams.GetConsensus()))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) {
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nUndoPos = 0;
+            if (fMoveUndo && !WriteUndoDataForBlock(blockundo, state, pindex, chainparams))
+                return false;
+        }
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error: ") + e.what());
     }
@@ -3463,11 +4666,16 @@ bool ProcessNewBlock(const CChainParams& chainparams, const std::shared_ptr<cons
         // belt-and-suspenders.
         bool ret = CheckBlock(*pblock, state, chainparams.GetConsensus());
 
+        // Compress the block for storage before taking cs_main
+        std::unique_ptr<CBlockRecord> record;
+        if (ret && nBlockCompressionLevel > 0)
+            record.reset(new CBlockRecord(*pblock));
+
         LOCK(cs_main);
 
         if (ret) {
             // Store to disk
-            ret = g_chainstate.AcceptBlock(pblock, state, chainparams, &pindex, fForceProcessing, nullptr, fNewBlock);
+            ret = g_chainstate.AcceptBlock(pblock, state, chainparams, &pindex, fForceProcessing, record.get(), fNewBlock);
         }
         if (!ret) {
             GetMainSignals().BlockChecked(*pblock, state);
@@ -3526,7 +4734,7 @@ uint64_t CalculateCurrentUsage()
 }
 
 /* Prune a block file (modify associated database entries)*/
-void PruneOneBlockFile(const int fileNumber)
+void PruneOneBlockFile(const int fileNumber, bool fKeepUndo)
 {
     LOCK(cs_LastBlockFile);
 
@@ -3534,10 +4742,12 @@ void PruneOneBlockFile(const int fileNumber)
         CBlockIndex* pindex = entry.second;
         if (pindex->nFile == fileNumber) {
             pindex->nStatus &= ~BLOCK_HAVE_DATA;
-            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
-            pindex->nFile = 0;
             pindex->nDataPos = 0;
-            pindex->nUndoPos = 0;
+            if (!fKeepUndo) {
+                pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+                pindex->nFile = 0;
+                pindex->nUndoPos = 0;
+            }
             setDirtyBlockIndex.insert(pindex);
 
             // Prune from mapBlocksUnlinked -- any block we prune would have
@@ -3555,21 +4765,62 @@ void PruneOneBlockFile(const int fileNumber)
         }
     }
 
-    vinfoBlockFile[fileNumber].SetNull();
+    if (fKeepUndo) {
+        // The heights and times stay around to decide when to prune the undo data
+        vinfoBlockFile[fileNumber].nBlocks = 0;
+        vinfoBlockFile[fileNumber].nSize = 0;
+    } else {
+        vinfoBlockFile[fileNumber].SetNull();
+    }
     setDirtyFileInfo.insert(fileNumber);
 }
 
 
 void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
+    g_block_writer.Flush();
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        bool fKeepUndo;
+        {
+            LOCK(cs_LastBlockFile);
+            fKeepUndo = vinfoBlockFile[*it].nUndoSize > 0;
+        }
+        g_disk_file_mappings.Erase(*it);
         fs::remove(GetBlockPosFilename(pos, "blk"));
+        if (fKeepUndo) {
+            LogPrintf("Prune: %s deleted blk (%05u), kept rev\n", __func__, *it);
+            continue;
+        }
         fs::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
     }
 }
 
+/** Whether the undo data of a block file should outlive its block data (see -pruneundowindow) */
+static bool KeepUndoWhenPruning(const CBlockFileInfo& info, int nTipHeight)
+{
+    return info.nUndoSize > 0 && (int64_t)info.nHeightLast + nPruneUndoWindow > nTipHeight;
+}
+
+/**
+ * Prune what is left of block files whose block data was pruned, but whose
+ * undo data was kept, once it is no longer needed.
+ */
+static int FindUndoFilesToPrune(std::set<int>& setFilesToPrune, int nTipHeight)
+{
+    int count = 0;
+    for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+        const CBlockFileInfo& info = vinfoBlockFile[fileNumber];
+        if (info.nSize != 0 || info.nUndoSize == 0 || KeepUndoWhenPruning(info, nTipHeight))
+            continue;
+        PruneOneBlockFile(fileNumber);
+        setFilesToPrune.insert(fileNumber);
+        count++;
+    }
+    return count;
+}
+
 /* Calculate the block/rev files to delete based on height specified by user with RPC command pruneblockchain */
 static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPruneHeight)
 {
@@ -3585,10 +4836,11 @@ static void FindFilesToPruneManual(std::set<int>& setFilesToPrune, int nManualPr
     for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
         if (vinfoBlockFile[fileNumber].nSize == 0 || vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
             continue;
-        PruneOneBlockFile(fileNumber);
+        PruneOneBlockFile(fileNumber, KeepUndoWhenPruning(vinfoBlockFile[fileNumber], chainActive.Height()));
         setFilesToPrune.insert(fileNumber);
         count++;
     }
+    count += FindUndoFilesToPrune(setFilesToPrune, chainActive.Height());
     LogPrintf("Prune (Manual): prune_height=%d removed %d blk/rev pairs\n", nLastBlockWeCanPrune, count);
 }
 
@@ -3625,7 +4877,9 @@ static void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfte
         return;
     }
 
-    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
+    const int nTipHeight = chainActive.Tip()->nHeight;
+    const int64_t nTipTime = chainActive.Tip()->GetBlockTime();
+    unsigned int nLastBlockWeCanPrune = nTipHeight - MIN_BLOCKS_TO_KEEP;
     uint64_t nCurrentUsage = CalculateCurrentUsage();
     // We don't check to prune until after we've allocated new space for files
     // So we should leave a buffer under our target to account for another allocation
@@ -3634,26 +4888,36 @@ static void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfte
     uint64_t nBytesToPrune;
     int count=0;
 
-    if (nCurrentUsage + nBuffer >= nPruneTarget) {
-        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
-            nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+    for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+        const CBlockFileInfo& info = vinfoBlockFile[fileNumber];
 
-            if (vinfoBlockFile[fileNumber].nSize == 0)
-                continue;
+        if (info.nSize == 0)
+            continue;
 
-            if (nCurrentUsage + nBuffer < nPruneTarget)  // are we below our target?
-                break;
+        // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip but keep scanning
+        if (info.nHeightLast > nLastBlockWeCanPrune)
+            continue;
 
-            // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip but keep scanning
-            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
-                continue;
+        // prune while we are above our target, and files that are outside of the -prunewindow or -pruneage
+        bool fAboveTarget = nCurrentUsage + nBuffer >= nPruneTarget;
+        bool fBelowWindow = nPruneWindow > 0 && (int64_t)info.nHeightLast + nPruneWindow < nTipHeight;
+        bool fTooOld = nPruneAge > 0 && (int64_t)info.nTimeLast + nPruneAge < nTipTime;
+        if (!fAboveTarget && !fBelowWindow && !fTooOld)
+            continue;
 
-            PruneOneBlockFile(fileNumber);
-            // Queue up the files for removal
-            setFilesToPrune.insert(fileNumber);
-            nCurrentUsage -= nBytesToPrune;
-            count++;
-        }
+        bool fKeepUndo = KeepUndoWhenPruning(info, nTipHeight);
+        nBytesToPrune = info.nSize + (fKeepUndo ? 0 : info.nUndoSize);
+        PruneOneBlockFile(fileNumber, fKeepUndo);
+        // Queue up the files for removal
+        setFilesToPrune.insert(fileNumber);
+        nCurrentUsage -= nBytesToPrune;
+        count++;
+    }
+
+    int nUndoFiles = FindUndoFilesToPrune(setFilesToPrune, nTipHeight);
+    if (nUndoFiles > 0) {
+        count += nUndoFiles;
+        nCurrentUsage = CalculateCurrentUsage();
     }
 
     LogPrint(BCLog::PRUNE, "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
@@ -3802,7 +5066,17 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         }
     }
 
-    // Check presence of blk files
+    // A clean shutdown leaves a marker with the tip it flushed. Consume it right
+    // away, so that a crash before the next clean shutdown cannot reuse it.
+    if (pblocktree->ReadCleanShutdown(hashCleanShutdownTip)) {
+        if (!pblocktree->WriteCleanShutdown(uint256())) {
+            return error("%s: failed to clear the clean shutdown marker", __func__);
+        }
+        LogPrintf("%s: last shutdown was clean at block %s\n", __func__, hashCleanShutdownTip.ToString());
+    }
+
+    // Check presence of blk files. They can go missing while the node is not
+    // running, so a clean shutdown marker says nothing about them.
     LogPrintf("Checking all blk files are present...\n");
     std::set<int> setBlkDataFiles;
     for (const std::pair<uint256, CBlockIndex*>& item : mapBlockIndex)
@@ -3825,15 +5099,18 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     if (fHavePruned)
         LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
 
+    // Check whether block files hold compressed records, which need zstd
+    pblocktree->ReadFlag("compressedblocks", fHaveCompressedBlocks);
+#ifndef USE_ZSTD
+    if (fHaveCompressedBlocks)
+        return error("LoadBlockIndexDB(): Block files hold compressed data (-blockcompression), but this build does not support it");
+#endif
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
     if(fReindexing) fReindex = true;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     return true;
 }
 
@@ -3850,32 +5127,227 @@ bool LoadChainTip(const CChainParams& chainparams)
             return false;
         }
     }
-
-    // Load pointer to end of best chain
-    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
-    if (it == mapBlockIndex.end())
-        return false;
-    chainActive.SetTip(it->second);
-
-    g_chainstate.PruneBlockIndexCandidates();
-
-    LogPrintf("Loaded best chain: hashBestChain=%s height=%d date=%s progress=%f\n",
-        chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
-        DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        GuessVerificationProgress(chainparams.TxData(), chainActive.Tip()));
-    return true;
+
+    // Load pointer to end of best chain
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    if (it == mapBlockIndex.end())
+        return false;
+    chainActive.SetTip(it->second);
+
+    g_chainstate.PruneBlockIndexCandidates();
+
+    LogPrintf("Loaded best chain: hashBestChain=%s height=%d date=%s progress=%f\n",
+        chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
+        DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
+        GuessVerificationProgress(chainparams.TxData(), chainActive.Tip()));
+    return true;
+}
+
+CVerifyDB::CVerifyDB()
+{
+    uiInterface.ShowProgress(_("Verifying blocks..."), 0, false);
+}
+
+CVerifyDB::~CVerifyDB()
+{
+    uiInterface.ShowProgress("", 100, false);
+}
+
+namespace {
+
+/**
+ * A block read back by VerifyDB, with the outcome of its context-free checks.
+ * What the reading threads need from the block index is copied in up front.
+ */
+struct VerifyDBItem {
+    CBlockIndex* pindex;
+    uint256 hash;
+    uint256 hashPrev;
+    int nHeight;
+    CDiskBlockPos pos;
+    CDiskBlockPos undoPos;
+    CBlock block;
+    CBlockUndo undo;
+    bool fHaveUndo = false;
+    //! Why the block failed its checks, empty if it passed
+    std::string strError;
+};
+
+/** Number of blocks each VerifyDB thread reads ahead of the in-order stage. */
+const size_t VERIFYDB_BLOCKS_PER_THREAD = 4;
+
+/**
+ * Reads the blocks VerifyDB walks through ahead of it, on nThreads - 1
+ * threads that are started once and fed every pass, and on the calling
+ * thread when it would otherwise wait: level 0 reads each block, level 1
+ * runs CheckBlock on it and level 2 reads its undo data. Items are kept in a
+ * window of slots; the caller fills a slot from the block index (it holds
+ * cs_main) when it hands the previous item of that slot back, so the
+ * reading threads only touch the block files, never the block index.
+ */
+class VerifyDBReader
+{
+private:
+    const Consensus::Params& consensusParams;
+    std::mutex cs;
+    std::condition_variable cvRead;
+    std::condition_variable cvDone;
+    std::vector<VerifyDBItem> vSlots;
+    std::vector<bool> vDone;
+    const std::vector<CBlockIndex*>* pvIndex = nullptr;
+    int nCheckLevel = 0;
+    //! Items of the pass prepared in their slots, claimed by a reader, and handed out and back by the caller
+    size_t nPrepared = 0;
+    size_t nClaimed = 0;
+    size_t nReleased = 0;
+    bool fRunning = true;
+    std::vector<std::thread> threads;
+
+    void Prepare(size_t i);
+    void Read(VerifyDBItem& item);
+    void ThreadRead();
+
+public:
+    VerifyDBReader(int nThreads, const Consensus::Params& consensusParamsIn);
+    ~VerifyDBReader();
+
+    /** Start a pass over the blocks of vIndex, which must outlive it. */
+    void Start(const std::vector<CBlockIndex*>& vIndex, int nCheckLevelIn);
+    /** The next block of the pass, read and checked. Only valid until Release. */
+    VerifyDBItem& Next();
+    /** Hand the block returned by Next back, letting its slot be reused. */
+    void Release();
+};
+
+VerifyDBReader::VerifyDBReader(int nThreads, const Consensus::Params& consensusParamsIn) : consensusParams(consensusParamsIn)
+{
+    vSlots.resize(nThreads * VERIFYDB_BLOCKS_PER_THREAD);
+    vDone.resize(vSlots.size());
+    for (int i = 1; i < nThreads; i++) {
+        threads.emplace_back(&TraceThread<std::function<void()>>, "verifydb", std::function<void()>(std::bind(&VerifyDBReader::ThreadRead, this)));
+    }
+}
+
+VerifyDBReader::~VerifyDBReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        fRunning = false;
+    }
+    cvRead.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void VerifyDBReader::Prepare(size_t i)
+{
+    AssertLockHeld(cs_main);
+    VerifyDBItem& item = vSlots[i % vSlots.size()];
+    CBlockIndex* pindex = (*pvIndex)[i];
+    item = VerifyDBItem();
+    item.pindex = pindex;
+    item.hash = pindex->GetBlockHash();
+    item.hashPrev = pindex->pprev->GetBlockHash();
+    item.nHeight = pindex->nHeight;
+    item.pos = pindex->GetBlockPos();
+    item.undoPos = pindex->GetUndoPos();
+    vDone[i % vSlots.size()] = false;
+}
+
+void VerifyDBReader::Start(const std::vector<CBlockIndex*>& vIndex, int nCheckLevelIn)
+{
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        // Nothing of the previous pass may still be out for reading.
+        assert(nReleased == nPrepared);
+        pvIndex = &vIndex;
+        nCheckLevel = nCheckLevelIn;
+        nPrepared = std::min(vSlots.size(), vIndex.size());
+        nClaimed = 0;
+        nReleased = 0;
+        for (size_t i = 0; i < nPrepared; i++) {
+            Prepare(i);
+        }
+    }
+    cvRead.notify_all();
+}
+
+void VerifyDBReader::Read(VerifyDBItem& item)
+{
+    // check level 0: read from disk
+    if (!ReadBlockFromDisk(item.block, item.pos, consensusParams, false) || item.block.GetHash() != item.hash) {
+        item.strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", item.nHeight, item.hash.ToString());
+        return;
+    }
+    // check level 1: verify block validity
+    CValidationState state;
+    if (nCheckLevel >= 1 && !CheckBlock(item.block, state, consensusParams)) {
+        item.strError = strprintf("found bad block at %d, hash=%s (%s)", item.nHeight,
+                                  item.hash.ToString(), FormatStateMessage(state));
+        return;
+    }
+    // check level 2: verify undo validity
+    if (nCheckLevel >= 2 && !item.undoPos.IsNull()) {
+        if (!UndoReadFromDisk(item.undo, item.undoPos, item.hashPrev)) {
+            item.strError = strprintf("found bad undo data at %d, hash=%s", item.nHeight, item.hash.ToString());
+            return;
+        }
+        item.fHaveUndo = true;
+    }
+}
+
+void VerifyDBReader::ThreadRead()
+{
+    while (true) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            cvRead.wait(lock, [this] { return !fRunning || nClaimed < nPrepared; });
+            if (!fRunning)
+                return;
+            i = nClaimed++;
+        }
+        Read(vSlots[i % vSlots.size()]);
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            vDone[i % vSlots.size()] = true;
+        }
+        cvDone.notify_all();
+    }
 }
 
-CVerifyDB::CVerifyDB()
+VerifyDBItem& VerifyDBReader::Next()
 {
-    uiInterface.ShowProgress(_("Verifying blocks..."), 0, false);
+    std::unique_lock<std::mutex> lock(cs);
+    assert(nReleased < nPrepared);
+    const size_t nSlot = nReleased % vSlots.size();
+    if (nClaimed == nReleased) {
+        // No reader got to it yet: read it here rather than wait.
+        nClaimed++;
+        lock.unlock();
+        Read(vSlots[nSlot]);
+        lock.lock();
+        vDone[nSlot] = true;
+    }
+    cvDone.wait(lock, [&] { return vDone[nSlot]; });
+    return vSlots[nSlot];
 }
 
-CVerifyDB::~CVerifyDB()
+void VerifyDBReader::Release()
 {
-    uiInterface.ShowProgress("", 100, false);
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        nReleased++;
+        if (nPrepared < pvIndex->size()) {
+            Prepare(nPrepared++);
+        }
+    }
+    cvRead.notify_one();
 }
 
+} // namespace
+
 bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -3886,7 +5358,10 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     if (nCheckDepth <= 0 || nCheckDepth > chainActive.Height())
         nCheckDepth = chainActive.Height();
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    // Blocks are read and checked ahead on as many threads as -par allows,
+    // then disconnected and reconnected in chain order on this one.
+    const int nThreads = std::max(nScriptCheckThreads, 1);
+    LogPrintf("Verifying last %i blocks at level %i using %i threads\n", nCheckDepth, nCheckLevel, nThreads);
     CCoinsViewCache coins(coinsview);
     CBlockIndex* pindexState = chainActive.Tip();
     CBlockIndex* pindexFailure = nullptr;
@@ -3894,16 +5369,10 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     CValidationState state;
     int reportDone = 0;
     LogPrintf("[0%%]...");
+
+    std::vector<CBlockIndex*> vIndex;
     for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        boost::this_thread::interruption_point();
-        int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
-        if (reportDone < percentageDone/10) {
-            // report every 10% step
-            LogPrintf("[%d%%]...", percentageDone);
-            reportDone = percentageDone/10;
-        }
-        uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone, false);
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
         if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
@@ -3911,27 +5380,29 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-            return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
-            return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__,
-                         pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            if (!pindex->GetUndoPos().IsNull()) {
-                if (!UndoReadFromDisk(undo, pindex)) {
-                    return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                }
-            }
+        vIndex.push_back(pindex);
+    }
+
+    VerifyDBReader reader(nThreads, chainparams.GetConsensus());
+    reader.Start(vIndex, nCheckLevel);
+    for (size_t nPos = 0; nPos < vIndex.size(); nPos++)
+    {
+        VerifyDBItem& item = reader.Next();
+        CBlockIndex* pindex = item.pindex;
+        boost::this_thread::interruption_point();
+        int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
+        if (reportDone < percentageDone/10) {
+            // report every 10% step
+            LogPrintf("[%d%%]...", percentageDone);
+            reportDone = percentageDone/10;
         }
+        uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone, false);
+        if (!item.strError.empty())
+            return error("VerifyDB(): *** %s", item.strError);
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             assert(coins.GetBestBlock() == pindex->GetBlockHash());
-            DisconnectResult res = g_chainstate.DisconnectBlock(block, pindex, coins);
+            DisconnectResult res = g_chainstate.DisconnectBlock(item.block, pindex, coins, item.fHaveUndo ? &item.undo : nullptr);
             if (res == DISCONNECT_FAILED) {
                 return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             }
@@ -3940,27 +5411,34 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
                 nGoodTransactions = 0;
                 pindexFailure = pindex;
             } else {
-                nGoodTransactions += block.vtx.size();
+                nGoodTransactions += item.block.vtx.size();
             }
         }
         if (ShutdownRequested())
             return true;
+        reader.Release();
     }
     if (pindexFailure)
         return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
-        CBlockIndex *pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        vIndex.clear();
+        for (CBlockIndex* pindex = chainActive.Next(pindexState); pindex; pindex = chainActive.Next(pindex)) {
+            vIndex.push_back(pindex);
+        }
+        // CheckBlock marks the blocks checked, which ConnectBlock relies on to skip it
+        reader.Start(vIndex, 1);
+        for (size_t nPos = 0; nPos < vIndex.size(); nPos++) {
+            VerifyDBItem& item = reader.Next();
+            CBlockIndex* pindex = item.pindex;
             boost::this_thread::interruption_point();
             uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))), false);
-            pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            if (!g_chainstate.ConnectBlock(block, state, pindex, coins, chainparams))
+            if (!item.strError.empty())
+                return error("VerifyDB(): *** %s", item.strError);
+            if (!g_chainstate.ConnectBlock(item.block, state, pindex, coins, chainparams))
                 return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            reader.Release();
         }
     }
 
@@ -4195,6 +5673,7 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    fHaveCompressedBlocks = false;
 
     g_chainstate.UnloadBlockIndex();
 }
@@ -4217,9 +5696,6 @@ bool LoadBlockIndex(const CChainParams& chainparams)
         // needs_init.
 
         LogPrintf("Initializing databases...\n");
-        // Use the provided setting for -txindex in the new database
-        fTxIndex = gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX);
-        pblocktree->WriteFlag("txindex", fTxIndex);
     }
     return true;
 }
@@ -4259,7 +5735,7 @@ bool LoadGenesisBlock(const CChainParams& chainparams)
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
     // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    static std::multimap<uint256, CBlockRecord> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
@@ -4274,6 +5750,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
@@ -4284,6 +5761,8 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
                 // read size
                 blkdat >> nSize;
+                fCompressed = nSize & DISK_RECORD_COMPRESSED;
+                nSize &= ~DISK_RECORD_COMPRESSED;
                 if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
                     continue;
             } catch (const std::exception&) {
@@ -4293,13 +5772,27 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
             try {
                 // read block
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
+                CBlockRecord record;
+                if (dbp) {
                     dbp->nPos = nBlockPos;
+                    record.pos = *dbp;
+                    record.nSize = nSize;
+                    record.fCompressed = fCompressed;
+                }
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
                 CBlock& block = *pblock;
-                blkdat >> block;
+                if (fCompressed) {
+                    std::vector<uint8_t> compressed(nSize), decompressed;
+                    blkdat.read((char*)compressed.data(), nSize);
+                    if (!DecompressDiskRecord(compressed.data(), nSize, decompressed))
+                        continue;
+                    CMemoryReader reader(SER_DISK, CLIENT_VERSION, decompressed.data(), decompressed.size());
+                    reader >> block;
+                } else {
+                    blkdat >> block;
+                }
                 nRewind = blkdat.GetPos();
 
                 // detect out of order blocks, and store them for later
@@ -4308,7 +5801,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                             block.hashPrevBlock.ToString());
                     if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, record));
                     continue;
                 }
 
@@ -4316,7 +5809,9 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     LOCK(cs_main);
                     CValidationState state;
-                    if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp, nullptr))
+                    if (dbp && fCompressed)
+                        MarkCompressedBlocks();
+                    if (g_chainstate.AcceptBlock(pblock, state, chainparams, nullptr, true, dbp ? &record : nullptr, nullptr))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -4340,16 +5835,18 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 while (!queue.empty()) {
                     uint256 head = queue.front();
                     queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    std::pair<std::multimap<uint256, CBlockRecord>::iterator, std::multimap<uint256, CBlockRecord>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                        std::multimap<uint256, CBlockRecord>::iterator it = range.first;
                         std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+                        if (ReadBlockFromDisk(*pblockrecursive, it->second.pos, chainparams.GetConsensus()))
                         {
                             LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
                                     head.ToString());
                             LOCK(cs_main);
                             CValidationState dummy;
+                            if (it->second.fCompressed)
+                                MarkCompressedBlocks();
                             if (g_chainstate.AcceptBlock(pblockrecursive, dummy, chainparams, nullptr, true, &it->second, nullptr))
                             {
                                 nLoaded++;
@@ -4441,7 +5938,8 @@ void CChainState::CheckBlockIndex(const Consensus::Params& consensusParams)
             // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
             if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
         }
-        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        // Undo data can outlive pruned block data (see -pruneundowindow)
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert((pindex->nStatus & BLOCK_HAVE_DATA) || fHavePruned);
         assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
         // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
         assert((pindexFirstNeverProcessed != nullptr) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
@@ -4587,7 +6085,77 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/**
+ * mempool.dat is a journal: the version, then a sequence of records, each
+ * followed by a checksum. DumpMempool writes a checkpoint, a fee delta record
+ * followed by an addition record for each mempool transaction.
+ * AppendMempoolJournal then appends the changes since, so that the file
+ * follows the mempool without rewriting it.
+ */
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+static const unsigned char MEMPOOL_RECORD_ADD = 'a';    //!< transaction and entry time
+static const unsigned char MEMPOOL_RECORD_REMOVE = 'r'; //!< txid
+static const unsigned char MEMPOOL_RECORD_DELTAS = 'd'; //!< all prioritisation deltas
+/** Number of transactions LoadMempool reads and prevalidates at a time */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+/** Records the journal may hold beyond the mempool size before it is rewritten as a checkpoint */
+static const uint64_t MEMPOOL_JOURNAL_SLACK = 10000;
+
+namespace {
+
+/** A mempool change not yet appended to mempool.dat */
+struct MempoolChange
+{
+    bool fAdded;
+    CTransactionRef tx;
+};
+
+/**
+ * The mempool changes since mempool.dat was last written. Recording starts
+ * with the first checkpoint; lock order is cs_mempool_file, mempool.cs, cs.
+ */
+struct MempoolJournal
+{
+    CCriticalSection cs;
+    bool fActive = false;
+    std::vector<MempoolChange> vChanges;
+    std::map<uint256, CAmount> mapDeltas; //!< As last written
+    uint64_t nRecords = 0;                //!< In mempool.dat
+};
+
+MempoolJournal g_mempool_journal;
+CCriticalSection cs_mempool_file;
+
+/** The checksum after each journal record: the first four bytes of its double SHA256 */
+uint32_t MempoolRecordChecksum(const uint256& hash)
+{
+    return ReadLE32(hash.begin());
+}
+
+/** Append the record in ssRecord to the journal, followed by its checksum */
+void WriteMempoolRecord(CAutoFile& file, const CDataStream& ssRecord)
+{
+    file.write(ssRecord.data(), ssRecord.size());
+    file << MempoolRecordChecksum(Hash(ssRecord.begin(), ssRecord.end()));
+}
+
+void MempoolJournalAdded(CTransactionRef tx)
+{
+    LOCK(g_mempool_journal.cs);
+    if (g_mempool_journal.fActive) {
+        g_mempool_journal.vChanges.push_back({true, std::move(tx)});
+    }
+}
+
+void MempoolJournalRemoved(CTransactionRef tx, MemPoolRemovalReason reason)
+{
+    LOCK(g_mempool_journal.cs);
+    if (g_mempool_journal.fActive) {
+        g_mempool_journal.vChanges.push_back({false, std::move(tx)});
+    }
+}
+
+} // namespace
 
 bool LoadMempool(void)
 {
@@ -4606,59 +6174,129 @@ bool LoadMempool(void)
     int64_t already_there = 0;
     int64_t nNow = GetTime();
 
+    // Replay the journal into the transactions it leaves, in the order they
+    // were added, so that parents come before their children.
+    std::vector<std::pair<CTransactionRef, int64_t>> vEntries;
+    std::map<uint256, size_t> mapEntries;
+    std::map<uint256, CAmount> mapDeltas;
     try {
         uint64_t version;
         file >> version;
         if (version != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Mempool file has version %u, which this version cannot load. Continuing with an empty mempool.\n", version);
             return false;
         }
-        uint64_t num;
-        file >> num;
-        while (num--) {
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    for (uint64_t nRecord = 0; ; nRecord++) {
+        CHashVerifier<CAutoFile> verifier(&file);
+        unsigned char type;
+        try {
+            verifier >> type;
+        } catch (const std::exception& e) {
+            if (!feof(file.Get())) {
+                LogPrintf("Failed to read mempool journal record %u (%s), ignoring the rest of the journal.\n", nRecord, e.what());
+            }
+            break; // end of the journal
+        }
+        try {
             CTransactionRef tx;
             int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
-            if (amountdelta) {
-                mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+            uint256 hash;
+            std::map<uint256, CAmount> mapRecordDeltas;
+            if (type == MEMPOOL_RECORD_ADD) {
+                verifier >> tx;
+                verifier >> nTime;
+            } else if (type == MEMPOOL_RECORD_REMOVE) {
+                verifier >> hash;
+            } else if (type == MEMPOOL_RECORD_DELTAS) {
+                verifier >> mapRecordDeltas;
+            } else {
+                throw std::ios_base::failure(strprintf("unknown record type %u", type));
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
-                                           nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
-                if (state.IsValid()) {
-                    ++count;
+            uint32_t nChecksum;
+            file >> nChecksum;
+            if (nChecksum != MempoolRecordChecksum(verifier.GetHash())) {
+                throw std::ios_base::failure("checksum mismatch");
+            }
+
+            if (type == MEMPOOL_RECORD_ADD) {
+                auto it = mapEntries.emplace(tx->GetHash(), vEntries.size());
+                if (it.second) {
+                    vEntries.emplace_back(tx, nTime);
                 } else {
-                    // mempool may contain the transaction already, e.g. from
-                    // wallet(s) having loaded it while we were processing
-                    // mempool transactions; consider these as valid, instead of
-                    // failed, but mark them as 'already there'
-                    if (mempool.exists(tx->GetHash())) {
-                        ++already_there;
-                    } else {
-                        ++failed;
-                    }
+                    vEntries[it.first->second] = std::make_pair(tx, nTime);
                 }
+            } else if (type == MEMPOOL_RECORD_REMOVE) {
+                auto it = mapEntries.find(hash);
+                if (it != mapEntries.end()) {
+                    vEntries[it->second].first = nullptr;
+                    mapEntries.erase(it);
+                }
+            } else {
+                mapDeltas.swap(mapRecordDeltas);
+            }
+        } catch (const std::exception& e) {
+            if (feof(file.Get())) {
+                // A record cut short by a crash while appending; what
+                // precedes it is intact.
+                LogPrintf("Mempool journal ends in an incomplete record (%s), ignoring it.\n", e.what());
+            } else {
+                // Nothing after a garbled record can be trusted to start
+                // where a record does, so stop here as well.
+                LogPrintf("Mempool journal record %u is corrupt (%s), ignoring it and the rest of the journal.\n", nRecord, e.what());
+            }
+            break;
+        }
+    }
+
+    for (const auto& i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.second);
+    }
+
+    std::vector<CTransactionRef> vTxs;
+    std::vector<int64_t> vTimes;
+    for (size_t n = 0; n < vEntries.size(); ) {
+        vTxs.clear();
+        vTimes.clear();
+        for (; n < vEntries.size() && vTxs.size() < MEMPOOL_LOAD_BATCH_SIZE; n++) {
+            if (!vEntries[n].first) continue;
+            if (vEntries[n].second + nExpiryTimeout > nNow) {
+                vTxs.push_back(vEntries[n].first);
+                vTimes.push_back(vEntries[n].second);
             } else {
                 ++expired;
             }
-            if (ShutdownRequested())
-                return false;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+        // Verify the scripts of the batch together on the script check
+        // threads before accepting the transactions one by one.
+        PrevalidateTransactions(mempool, vTxs);
 
-        for (const auto& i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.second);
+        for (size_t i = 0; i < vTxs.size(); i++) {
+            const CTransactionRef& tx = vTxs[i];
+            CValidationState state;
+            LOCK(cs_main);
+            AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, vTimes[i],
+                                       nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */,
+                                       false /* test_accept */);
+            if (state.IsValid()) {
+                ++count;
+            } else {
+                // mempool may contain the transaction already, e.g. from
+                // wallet(s) having loaded it while we were processing
+                // mempool transactions; consider these as valid, instead of
+                // failed, but mark them as 'already there'
+                if (mempool.exists(tx->GetHash())) {
+                    ++already_there;
+                } else {
+                    ++failed;
+                }
+            }
+            if (ShutdownRequested())
+                return false;
         }
-    } catch (const std::exception& e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
-        return false;
     }
 
     LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there\n", count, failed, expired, already_there);
@@ -4669,6 +6307,7 @@ bool DumpMempool(void)
 {
     int64_t start = GetTimeMicros();
 
+    LOCK(cs_mempool_file);
     std::map<uint256, CAmount> mapDeltas;
     std::vector<TxMempoolInfo> vinfo;
 
@@ -4678,6 +6317,20 @@ bool DumpMempool(void)
             mapDeltas[i.first] = i.second;
         }
         vinfo = mempool.infoAll();
+
+        // Record the changes from here on, for AppendMempoolJournal to
+        // append while -persistmempool keeps the file up to date
+        static bool fConnected = false;
+        if (!fConnected) {
+            mempool.NotifyEntryAdded.connect(&MempoolJournalAdded);
+            mempool.NotifyEntryRemoved.connect(&MempoolJournalRemoved);
+            fConnected = true;
+        }
+        LOCK(g_mempool_journal.cs);
+        g_mempool_journal.fActive = gArgs.GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL);
+        g_mempool_journal.vChanges.clear();
+        g_mempool_journal.mapDeltas = mapDeltas;
+        g_mempool_journal.nRecords = vinfo.size() + 1;
     }
 
     int64_t mid = GetTimeMicros();
@@ -4685,7 +6338,7 @@ bool DumpMempool(void)
     try {
         FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat.new", "wb");
         if (!filestr) {
-            return false;
+            throw std::runtime_error("cannot open mempool.dat.new");
         }
 
         CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
@@ -4693,15 +6346,15 @@ bool DumpMempool(void)
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
 
-        file << (uint64_t)vinfo.size();
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        ssRecord << MEMPOOL_RECORD_DELTAS << mapDeltas;
+        WriteMempoolRecord(file, ssRecord);
         for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
-            mapDeltas.erase(i.tx->GetHash());
+            ssRecord.clear();
+            ssRecord << MEMPOOL_RECORD_ADD << *(i.tx) << (int64_t)i.nTime;
+            WriteMempoolRecord(file, ssRecord);
         }
 
-        file << mapDeltas;
         FileCommit(file.Get());
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
@@ -4709,11 +6362,378 @@ bool DumpMempool(void)
         LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*MICRO, (last-mid)*MICRO);
     } catch (const std::exception& e) {
         LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        LOCK(g_mempool_journal.cs);
+        g_mempool_journal.fActive = false;
+        g_mempool_journal.vChanges.clear();
         return false;
     }
     return true;
 }
 
+bool AppendMempoolJournal()
+{
+    int64_t start = GetTimeMicros();
+
+    LOCK(cs_mempool_file);
+    std::vector<std::pair<TxMempoolInfo, bool>> vRecords;
+    std::map<uint256, CAmount> mapDeltas;
+    bool fWriteDeltas;
+    bool fCheckpoint;
+    {
+        LOCK(mempool.cs);
+        LOCK(g_mempool_journal.cs);
+        if (!g_mempool_journal.fActive) {
+            return false;
+        }
+        // Once most of the journal is about transactions that are gone,
+        // write a checkpoint instead.
+        fCheckpoint = g_mempool_journal.nRecords + g_mempool_journal.vChanges.size() > 2 * mempool.size() + MEMPOOL_JOURNAL_SLACK;
+    }
+    if (fCheckpoint) {
+        return DumpMempool();
+    }
+    {
+        LOCK(mempool.cs);
+        LOCK(g_mempool_journal.cs);
+        for (const MempoolChange& change : g_mempool_journal.vChanges) {
+            if (change.fAdded) {
+                // Added transactions that left again need no record
+                TxMempoolInfo info = mempool.info(change.tx->GetHash());
+                if (info.tx) {
+                    vRecords.emplace_back(std::move(info), true);
+                }
+            } else {
+                TxMempoolInfo info;
+                info.tx = change.tx;
+                vRecords.emplace_back(std::move(info), false);
+            }
+        }
+        g_mempool_journal.vChanges.clear();
+        for (const auto &i : mempool.mapDeltas) {
+            mapDeltas[i.first] = i.second;
+        }
+        fWriteDeltas = mapDeltas != g_mempool_journal.mapDeltas;
+        g_mempool_journal.mapDeltas = mapDeltas;
+        g_mempool_journal.nRecords += vRecords.size() + fWriteDeltas;
+    }
+    if (vRecords.empty() && !fWriteDeltas) {
+        return true;
+    }
+
+    try {
+        FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat", "ab");
+        if (!filestr) {
+            throw std::runtime_error("cannot open mempool.dat");
+        }
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+        for (const auto& record : vRecords) {
+            ssRecord.clear();
+            if (record.second) {
+                ssRecord << MEMPOOL_RECORD_ADD << *(record.first.tx) << (int64_t)record.first.nTime;
+            } else {
+                ssRecord << MEMPOOL_RECORD_REMOVE << record.first.tx->GetHash();
+            }
+            WriteMempoolRecord(file, ssRecord);
+        }
+        if (fWriteDeltas) {
+            ssRecord.clear();
+            ssRecord << MEMPOOL_RECORD_DELTAS << mapDeltas;
+            WriteMempoolRecord(file, ssRecord);
+        }
+        FileCommit(file.Get());
+        file.fclose();
+    } catch (const std::exception& e) {
+        // The changes are lost to the journal; start over from a checkpoint
+        LogPrintf("Failed to append to the mempool journal: %s. Writing it anew.\n", e.what());
+        return DumpMempool();
+    }
+    LogPrint(BCLog::MEMPOOL, "Appended %u records to the mempool journal: %gs\n", vRecords.size() + fWriteDeltas, (GetTimeMicros() - start) * MICRO);
+    return true;
+}
+
+static const uint64_t UTXO_SNAPSHOT_VERSION = 2;
+//! Number of key-range shards the chainstate is split into by DumpTxOutSet
+static const unsigned int UTXO_SNAPSHOT_SHARDS = 64;
+//! Number of coins LoadTxOutSet writes to the coin database at once
+static const size_t UTXO_SNAPSHOT_LOAD_BATCH = 100000;
+
+namespace {
+
+/** The coins of one shard of the UTXO set, serialized in snapshot format. */
+struct SnapshotShard
+{
+    CDataStream data;
+    CCoinsStats stats;
+
+    SnapshotShard() : data(SER_DISK, CLIENT_VERSION) {}
+};
+
+void WriteSnapshotOutputs(CDataStream& data, const uint256& txid, const std::vector<std::pair<uint32_t, Coin> >& outputs)
+{
+    data << txid;
+    data << VARINT((uint64_t)outputs.size());
+    for (const auto& output : outputs) {
+        data << VARINT(output.first);
+        data << output.second;
+    }
+}
+
+void SerializeSnapshotShard(CCoinsViewCursor* pcursorIn, SnapshotShard& shard)
+{
+    std::unique_ptr<CCoinsViewCursor> pcursor(pcursorIn);
+    uint256 prevkey;
+    std::vector<std::pair<uint32_t, Coin> > outputs;
+    while (pcursor->Valid()) {
+        if (ShutdownRequested()) {
+            throw std::runtime_error("shutdown requested");
+        }
+        COutPoint key;
+        Coin coin;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coin)) {
+            throw std::runtime_error("unable to read coin database");
+        }
+        if (!outputs.empty() && key.hash != prevkey) {
+            WriteSnapshotOutputs(shard.data, prevkey, outputs);
+            outputs.clear();
+        }
+        ApplyCoinToStats(shard.stats, key, coin, false);
+        prevkey = key.hash;
+        outputs.emplace_back(key.n, std::move(coin));
+        pcursor->Next();
+    }
+    if (!outputs.empty()) {
+        WriteSnapshotOutputs(shard.data, prevkey, outputs);
+    }
+}
+
+/**
+ * Read the coins of a snapshot, from the current position up to its end
+ * marker, and hand each to fn. Returns the number of coins read.
+ */
+template <typename Fn>
+uint64_t ReadSnapshotCoins(CAutoFile& file, Fn fn)
+{
+    uint64_t nCoins = 0;
+    while (true) {
+        uint256 txid;
+        uint64_t nOutputs;
+        file >> txid;
+        file >> VARINT(nOutputs);
+        if (nOutputs == 0) break;
+        for (uint64_t i = 0; i < nOutputs; i++) {
+            uint32_t n;
+            Coin coin;
+            file >> VARINT(n);
+            file >> coin;
+            fn(COutPoint(txid, n), std::move(coin));
+            nCoins++;
+        }
+        if (nCoins % UTXO_SNAPSHOT_LOAD_BATCH < nOutputs && ShutdownRequested()) {
+            throw std::runtime_error("shutdown requested");
+        }
+    }
+    return nCoins;
+}
+
+} // namespace
+
+bool DumpTxOutSet(const fs::path& path, CCoinsViewDB* view, uint256& hashBlock, uint64_t& nCoins, uint256& hashMuHash)
+{
+    int64_t nStart = GetTimeMillis();
+    const CChainParams& chainparams = Params();
+
+    // Take all shard cursors while holding cs_main, which every write to the
+    // coin database also does, so that they all see the same UTXO set.
+    std::vector<CCoinsViewCursor*> vCursors;
+    {
+        LOCK(cs_main);
+        hashBlock = view->GetBestBlock();
+        for (unsigned int i = 0; i < UTXO_SNAPSHOT_SHARDS; i++) {
+            vCursors.push_back(view->Cursor(i * 256 / UTXO_SNAPSHOT_SHARDS, (i + 1) * 256 / UTXO_SNAPSHOT_SHARDS));
+        }
+    }
+
+    fs::path pathTmp = path;
+    pathTmp += ".incomplete";
+    nCoins = 0;
+    MuHash3072 muhash;
+    std::vector<SnapshotShard> vShards(UTXO_SNAPSHOT_SHARDS);
+    std::vector<std::future<void> > vFutures(UTXO_SNAPSHOT_SHARDS);
+    unsigned int nNextLaunch = 0;
+    try {
+        FILE* filestr = fsbridge::fopen(pathTmp, "wb");
+        if (!filestr) {
+            for (CCoinsViewCursor* pcursor : vCursors) delete pcursor;
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+        }
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << UTXO_SNAPSHOT_VERSION;
+        file << FLATDATA(chainparams.MessageStart());
+        file << hashBlock;
+        // Placeholder for the MuHash of the set, filled in once it is known.
+        const long nMuHashPos = ftell(file.Get());
+        file << uint256();
+
+        // Scan the shards in parallel, but write them out in key order. At
+        // most nThreads serialized shards are held in memory at any time.
+        const unsigned int nThreads = std::max(GetNumCores(), 1);
+        for (unsigned int i = 0; i < UTXO_SNAPSHOT_SHARDS; i++) {
+            while (nNextLaunch < UTXO_SNAPSHOT_SHARDS && nNextLaunch < i + nThreads) {
+                vFutures[nNextLaunch] = std::async(std::launch::async, SerializeSnapshotShard, vCursors[nNextLaunch], std::ref(vShards[nNextLaunch]));
+                nNextLaunch++;
+            }
+            vFutures[i].get();
+            file.write(vShards[i].data.data(), vShards[i].data.size());
+            nCoins += vShards[i].stats.nTransactionOutputs;
+            muhash *= vShards[i].stats.muhash;
+            vShards[i] = SnapshotShard();
+        }
+
+        // End marker and coin count, so the reader can detect truncation.
+        file << uint256();
+        file << VARINT((uint64_t)0);
+        file << nCoins;
+
+        muhash.Finalize(hashMuHash.begin());
+        if (nMuHashPos < 0 || fseek(file.Get(), nMuHashPos, SEEK_SET) != 0) {
+            throw std::runtime_error("unable to seek in snapshot file");
+        }
+        file << hashMuHash;
+
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, path);
+    } catch (const std::exception& e) {
+        // Let running shard scans finish (their futures join on destruction),
+        // and free the cursors that were never handed out.
+        for (unsigned int i = nNextLaunch; i < UTXO_SNAPSHOT_SHARDS; i++) delete vCursors[i];
+        vFutures.clear();
+        fs::remove(pathTmp);
+        return error("%s: failed to dump UTXO set: %s", __func__, e.what());
+    }
+
+    LogPrintf("Dumped %u coins at block %s to UTXO set snapshot in %dms\n", nCoins, hashBlock.ToString(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadTxOutSet(const fs::path& path, CCoinsViewDB* view, const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+    FILE* filestr = fsbridge::fopen(path, "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return error("%s: failed to open UTXO set snapshot %s", __func__, path.string());
+    }
+    if (!view->GetBestBlock().IsNull() || !view->GetHeadBlocks().empty()) {
+        return error("%s: coin database is not empty", __func__);
+    }
+
+    uint256 hashBlock;
+    uint256 hashMuHash;
+    CCoinsStats stats;
+    long nCoinsPos;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != UTXO_SNAPSHOT_VERSION) {
+            return error("%s: unsupported UTXO set snapshot version %u", __func__, version);
+        }
+        CMessageHeader::MessageStartChars pchMessageStart;
+        file >> FLATDATA(pchMessageStart);
+        if (memcmp(pchMessageStart, chainparams.MessageStart(), sizeof(pchMessageStart)) != 0) {
+            return error("%s: UTXO set snapshot is for a different network", __func__);
+        }
+        file >> hashBlock;
+        file >> hashMuHash;
+        nCoinsPos = ftell(file.Get());
+    } catch (const std::exception& e) {
+        return error("%s: failed to deserialize UTXO set snapshot header: %s", __func__, e.what());
+    }
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(hashBlock);
+        // The chain up to the snapshot's block must be fully available, as
+        // it becomes our tip.
+        if (it == mapBlockIndex.end() || it->second->nChainTx == 0) {
+            return error("%s: block %s of the UTXO set snapshot and its ancestors are not available", __func__, hashBlock.ToString());
+        }
+        stats.nHeight = it->second->nHeight;
+    }
+    stats.hashBlock = hashBlock;
+    // If we maintained statistics for this block ourselves, the snapshot
+    // must commit to the same set.
+    CCoinsStats statsKnown;
+    if (pblocktree->ReadUTXOStats(hashBlock, statsKnown) && statsKnown.GetMuHash() != hashMuHash) {
+        return error("%s: UTXO set snapshot MuHash %s does not match the known %s", __func__, hashMuHash.ToString(), statsKnown.GetMuHash().ToString());
+    }
+
+    // First pass: check the coins against the MuHash and the coin count of
+    // the snapshot, without writing any of them.
+    uint64_t nCoins = 0;
+    try {
+        nCoins = ReadSnapshotCoins(file, [&stats](const COutPoint& outpoint, Coin&& coin) {
+            ApplyCoinToStats(stats, outpoint, coin, false);
+        });
+        uint64_t nCoinsExpected;
+        file >> nCoinsExpected;
+        if (nCoins != nCoinsExpected) {
+            return error("%s: UTXO set snapshot contains %u coins, expected %u", __func__, nCoins, nCoinsExpected);
+        }
+    } catch (const std::exception& e) {
+        return error("%s: failed to deserialize UTXO set snapshot after %u coins: %s", __func__, nCoins, e.what());
+    }
+    if (stats.GetMuHash() != hashMuHash) {
+        return error("%s: UTXO set snapshot coins do not match its MuHash %s", __func__, hashMuHash.ToString());
+    }
+
+    // Second pass: write the coins. They are hashed again, in case the file
+    // changed in between, and until the final chunk is written the database
+    // is marked as holding a partial snapshot, which is wiped on failure
+    // here or, after a crash, at the next start.
+    std::string strError;
+    try {
+        if (fseek(file.Get(), nCoinsPos, SEEK_SET) != 0) {
+            throw std::runtime_error("unable to seek in snapshot file");
+        }
+        CCoinsStats statsWritten;
+        std::vector<std::pair<COutPoint, Coin> > vCoins;
+        vCoins.reserve(UTXO_SNAPSHOT_LOAD_BATCH);
+        ReadSnapshotCoins(file, [&](const COutPoint& outpoint, Coin&& coin) {
+            ApplyCoinToStats(statsWritten, outpoint, coin, false);
+            vCoins.emplace_back(outpoint, std::move(coin));
+            if (vCoins.size() >= UTXO_SNAPSHOT_LOAD_BATCH) {
+                if (!view->WriteSnapshotChunk(vCoins, hashBlock, false)) {
+                    throw std::runtime_error("failed to write to coin database");
+                }
+                vCoins.clear();
+            }
+        });
+        if (statsWritten.nTransactionOutputs != nCoins || statsWritten.GetMuHash() != hashMuHash) {
+            throw std::runtime_error("snapshot file changed while it was loaded");
+        }
+        if (!view->WriteSnapshotChunk(vCoins, hashBlock, true)) {
+            throw std::runtime_error("failed to write to coin database");
+        }
+    } catch (const std::exception& e) {
+        strError = e.what();
+    }
+    if (!strError.empty()) {
+        if (!view->WipeSnapshot()) {
+            LogPrintf("%s: failed to erase the partially loaded UTXO set snapshot\n", __func__);
+        }
+        return error("%s: failed to load UTXO set snapshot: %s", __func__, strError);
+    }
+
+    // Seed the maintained statistics with the verified set.
+    if (fUTXOStats && !pblocktree->WriteUTXOStats(hashBlock, stats)) {
+        return error("%s: failed to write UTXO set statistics", __func__);
+    }
+    LogPrintf("Loaded %u coins at block %s from UTXO set snapshot in %dms\n", nCoins, hashBlock.ToString(), GetTimeMillis() - nStart);
+    return true;
+}
+
 //! Guess how far we are in the verification process at the given block index
 //! require cs_main if pindex has not been validated yet (because nChainTx might be unset)
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex *pindex) {
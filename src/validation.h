@@ -31,6 +31,7 @@
 #include <atomic>
 
 class CBlockIndex;
+class CBlockUndo;
 class CBlockTreeDB;
 class CChainParams;
 class CCoinsViewDB;
@@ -67,6 +68,10 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Maximum number of transactions in a package submitted with AcceptPackageToMemoryPool */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Maximum total virtual size of a package in kilobytes, the same as the ancestor size limit */
+static const unsigned int MAX_PACKAGE_SIZE = 101;
 /** Maximum kilobytes for transactions to store for processing during reorg */
 static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -130,9 +135,22 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 24 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+static const bool DEFAULT_ADDRINDEX = false;
+/** Default for -blockfilterindex: "0", "1" or the name of a filter type */
+static const char* const DEFAULT_BLOCKFILTERINDEX = "0";
+/** Default for -utxostats */
+static const bool DEFAULT_UTXOSTATS = false;
+/** Default for -mmapblockfiles; mapping block files needs a 64-bit address space */
+static const int DEFAULT_MMAP_BLOCK_FILES = sizeof(void*) > 4 ? 16 : 0;
+/** Default for -blockcompression: store blocks and undo data uncompressed */
+static const int DEFAULT_BLOCK_COMPRESSION = 0;
+/** Highest -blockcompression level, the strongest regular zstd level */
+static const int MAX_BLOCK_COMPRESSION = 19;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Seconds between appends to the mempool journal with -persistmempool */
+static const int64_t MEMPOOL_JOURNAL_INTERVAL = 60;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
@@ -145,6 +163,7 @@ static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 
 /** Default for -stopatheight */
 static const int DEFAULT_STOPATHEIGHT = 0;
@@ -168,10 +187,17 @@ extern CConditionVariable cvBlockChange;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
+/** Whether UTXO set statistics are maintained for every connected block (-utxostats) */
+extern bool fUTXOStats;
+/** Number of block and undo files kept memory-mapped for reading (-mmapblockfiles) */
+extern int nMappedBlockFiles;
+/** zstd compression level for newly written block and undo data, 0 if disabled (-blockcompression) */
+extern int nBlockCompressionLevel;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** Chain tip recorded by the previous clean shutdown, null if it was not clean */
+extern uint256 hashCleanShutdownTip;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
@@ -201,6 +227,12 @@ extern bool fHavePruned;
 extern bool fPruneMode;
 /** Number of MiB of block files that we're trying to stay below. */
 extern uint64_t nPruneTarget;
+/** Also prune block files whose blocks are all more than this many blocks below the tip, 0 if disabled (-prunewindow). */
+extern unsigned int nPruneWindow;
+/** Also prune block files whose blocks are all more than this many seconds older than the tip, 0 if disabled (-pruneage). */
+extern int64_t nPruneAge;
+/** Keep the undo data of block files with blocks within this many blocks of the tip when pruning their block data (-pruneundowindow). */
+extern unsigned int nPruneUndoWindow;
 /** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
 static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
 /** Minimum blocks required to signal NODE_NETWORK_LIMITED */
@@ -272,6 +304,12 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread verifying transactions ahead of the mempool (see PrevalidateTransactions) */
+void ThreadPrevalidationCheck();
+/** Start writing new blocks and undo data to disk on a background thread */
+void StartBlockWriter();
+/** Write out all queued blocks and undo data, and go back to writing synchronously */
+void StopBlockWriter();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -287,12 +325,13 @@ double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex* pin
 uint64_t CalculateCurrentUsage();
 
 /**
- *  Mark one block file as pruned.
+ *  Mark one block file as pruned. With fKeepUndo only its block data is
+ *  pruned; its undo data stays available until the file is pruned again.
  */
-void PruneOneBlockFile(const int fileNumber);
+void PruneOneBlockFile(const int fileNumber, bool fKeepUndo = false);
 
 /**
- *  Actually unlink the specified files
+ *  Actually unlink the specified files. Undo files that are still in use are kept.
  */
 void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune);
 
@@ -307,7 +346,56 @@ void PruneBlockFilesManual(int nManualPruneHeight);
  * plTxnReplaced will be appended to with all transactions replaced from mempool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx,
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
-                        bool bypass_limits, const CAmount nAbsurdFee);
+                        bool bypass_limits, const CAmount nAbsurdFee, bool test_accept=false);
+
+/** Outcome of AcceptPackageToMemoryPool */
+struct PackageAcceptResult
+{
+    /** Index of the transaction that was rejected, or the package size if none was */
+    size_t nFailedTx = 0;
+    /** Modified fees and virtual size of the package transactions that were not in the mempool yet */
+    CAmount nFees = 0;
+    int64_t nVSize = 0;
+};
+
+/**
+ * Context-free checks of the shape of a package: its size, order, topology
+ * and internal conflicts and duplicates. Cheap, so done before any script
+ * work, and again by AcceptPackageToMemoryPool.
+ */
+bool CheckPackage(const std::vector<CTransactionRef>& package, CValidationState& state);
+
+/**
+ * (try to) add a package of transactions to the memory pool as a whole.
+ * The package is a child and its parents, sorted so that parents come before
+ * their children, with the child last, and may be up to MAX_PACKAGE_COUNT
+ * transactions and MAX_PACKAGE_SIZE kilobytes. Every transaction must pass
+ * the usual policy checks except the minimum fee ones, which are applied to
+ * the feerate of the package instead, so that a child can pay for a parent
+ * that is below minRelayTxFee or the mempool minimum fee; the ancestor and
+ * descendant limits apply to the package as a whole. Transactions already in
+ * the mempool are skipped and do not count towards the package feerate.
+ * Packages may not replace mempool transactions. The package is checked in
+ * full before anything is added, and either all of it ends up in the mempool
+ * or none of it does; with test_accept nothing is added. Must be called with
+ * cs_main held.
+ */
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               bool* pfMissingInputs, const CAmount nAbsurdFee, bool test_accept,
+                               PackageAcceptResult& result);
+
+/**
+ * Verify the input scripts of txs ahead of AcceptToMemoryPool, on threads of
+ * their own and without holding cs_main or pool.cs while scripts run.
+ * Transactions that pass go into the script execution cache, so that
+ * AcceptToMemoryPool does not run their scripts again under the locks;
+ * failures are remembered so they are not prevalidated twice. Never affects
+ * whether a transaction is accepted. Transactions that
+ * AcceptToMemoryPool would reject before verifying scripts (missing inputs,
+ * conflicts, too low fees, nonstandard) are skipped. Must not be called
+ * with cs_main held.
+ */
+void PrevalidateTransactions(CTxMemPool& pool, const std::vector<CTransactionRef>& txs);
 
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
@@ -396,6 +484,12 @@ void InitScriptExecutionCache();
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block pindex refers to as serialized on disk, without deserializing it. Witness data is stripped unless fWitness. */
+bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start, bool fWitness = true);
+/** Read the transaction at offset nTxOffset after the header of the block stored at pos. */
+bool ReadTxFromDisk(CTransactionRef& tx, const CDiskBlockPos& pos, unsigned int nTxOffset);
+/** Read the undo data of the block pindex refers to, checking it against the block's parent. */
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -477,10 +571,20 @@ static const unsigned int REJECT_HIGHFEE = 0x100;
 /** Get block file info entry for one block file */
 CBlockFileInfo* GetBlockFileInfo(size_t n);
 
-/** Dump the mempool to disk. */
+/** Dump the mempool to disk, as a checkpoint of the journal in mempool.dat. */
 bool DumpMempool();
 
+/** Append the mempool changes since mempool.dat was last written to it. */
+bool AppendMempoolJournal();
+
 /** Load the mempool from disk. */
 bool LoadMempool();
 
+/** Write the UTXO set of view to a snapshot file, scanning it in parallel shards.
+ *  The file commits to the MuHash of the set (as reported by gettxoutsetinfo), which is returned in hashMuHash. */
+bool DumpTxOutSet(const fs::path& path, CCoinsViewDB* view, uint256& hashBlock, uint64_t& nCoins, uint256& hashMuHash);
+
+/** Load a UTXO set snapshot written by DumpTxOutSet into the empty coin database view, verifying its MuHash. */
+bool LoadTxOutSet(const fs::path& path, CCoinsViewDB* view, const CChainParams& chainparams);
+
 #endif // BITCOIN_VALIDATION_H